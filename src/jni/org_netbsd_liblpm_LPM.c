@@ -117,24 +117,18 @@ Java_org_netbsd_liblpm_LPM_lookup__JLjava_lang_String_2(JNIEnv *env,
     jobject obj, jlong lpm_ref, jstring addr)
 {
 	lpm_t *lpm = (lpm_t *)lpm_ref;
+	const jsize len = (*env)->GetStringUTFLength(env, addr);
 	const char *addr_s;
-	uint32_t addr_buf[4];
-	size_t len;
-	unsigned pref;
+	void *ret;
 
 	addr_s = (*env)->GetStringUTFChars(env, addr, NULL);
 	if (addr_s == NULL) {
 		/* XXX would be better to throw an exception in this case */
 		return NULL;
 	}
-
-	if (lpm_strtobin(addr_s, addr_buf, &len, &pref) != 0) {
-		(*env)->ReleaseStringUTFChars(env, addr, addr_s);
-		return NULL;
-	}
+	ret = lpm_lookup_str(lpm, addr_s, len);
 	(*env)->ReleaseStringUTFChars(env, addr, addr_s);
-
-	return lpm_lookup(lpm, addr_buf, len);
+	return ret;
 }
 
 JNIEXPORT jobject JNICALL
@@ -25,362 +25,2548 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <inttypes.h>
+#include <limits.h>
 #include <string.h>
 #include <strings.h>
 #include <errno.h>
 #include <assert.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#ifdef LPM_NUMA
+#include <numa.h>
+#endif
 
 #include "lpm.h"
+#include "lpm_impl.h"
+
+static const uint32_t zero_address[LPM_MAX_WORDS];
+
+void *
+lpm_alloc(lpm_t *lpm, size_t len)
+{
+#ifdef LPM_NUMA
+	if (lpm->node >= 0) {
+		const unsigned c = (len - 1) >> LPM_NUMA_CLASS_SHIFT;
+		const size_t objlen = (c + 1) << LPM_NUMA_CLASS_SHIFT;
+		void *ptr;
 
-#define	LPM_MAX_PREFIX		(128)
-#define	LPM_MAX_WORDS		(LPM_MAX_PREFIX >> 5)
-#define	LPM_TO_WORDS(x)		((x) >> 2)
-#define	LPM_HASH_STEP		(8)
-#define	LPM_LEN_IDX(len)	((len) >> 4)
+		if (len > LPM_NUMA_MAXOBJ) {
+			return numa_alloc_onnode(len, lpm->node);
+		}
+		if ((ptr = lpm->freelist[c]) != NULL) {
+			lpm->freelist[c] = *(void **)ptr;
+			return ptr;
+		}
+		if (!lpm->chunks || lpm->chunk_used + objlen > LPM_NUMA_CHUNK) {
+			lpm_chunk_t *chunk;
 
-#ifdef DEBUG
-#define	ASSERT			assert
-#else
-#define	ASSERT(x)
+			chunk = numa_alloc_onnode(LPM_NUMA_CHUNK, lpm->node);
+			if (chunk == NULL) {
+				return NULL;
+			}
+			chunk->next = lpm->chunks;
+			lpm->chunks = chunk;
+			lpm->chunk_used = LPM_NUMA_MAXOBJ;
+		}
+		ptr = (uint8_t *)lpm->chunks + lpm->chunk_used;
+		lpm->chunk_used += objlen;
+		return ptr;
+	}
 #endif
+	(void)lpm;
+	return malloc(len);
+}
 
-typedef struct lpm_ent {
-	struct lpm_ent *next;
-	void *		val;
-	unsigned	len;
-	uint8_t		key[];
-} lpm_ent_t;
+void *
+lpm_zalloc(lpm_t *lpm, size_t len)
+{
+	void *ptr;
+
+	if ((ptr = lpm_alloc(lpm, len)) != NULL) {
+		memset(ptr, 0, len);
+	}
+	return ptr;
+}
+
+void
+lpm_free(lpm_t *lpm, void *ptr, size_t len)
+{
+#ifdef LPM_NUMA
+	if (lpm->node >= 0 && ptr) {
+		const unsigned c = (len - 1) >> LPM_NUMA_CLASS_SHIFT;
+
+		if (len > LPM_NUMA_MAXOBJ) {
+			numa_free(ptr, len);
+			return;
+		}
+		*(void **)ptr = lpm->freelist[c];
+		lpm->freelist[c] = ptr;
+		return;
+	}
+#endif
+	(void)lpm; (void)len;
+	free(ptr);
+}
+
+/*
+ * lpm_mem_charge: account the given number of bytes of the hash maps of
+ * the table, unless it would exceed the memory limit.
+ *
+ * => Returns false, with errno set to ENOMEM, if over the limit.
+ */
+bool
+lpm_mem_charge(lpm_t *lpm, size_t len)
+{
+	if (lpm->memlimit && lpm->memused + len > lpm->memlimit) {
+		errno = ENOMEM;
+		return false;
+	}
+	lpm->memused += len;
+	return true;
+}
+
+/*
+ * lpm_gen_next: a new generation of a table, see lpm_lookup_cached().
+ * The generations are unique across all tables and snapshots, so that
+ * a table created at the address of a destroyed one does not match the
+ * cached results of the latter.
+ */
+uint64_t
+lpm_gen_next(void)
+{
+	static uint64_t lpm_gen_last;
+
+	return __atomic_add_fetch(&lpm_gen_last, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * lpm_hashmap_alloc and lpm_hashmap_free: the allocations of the hash
+ * maps (the bucket arrays, the filters and the entries), accounted to
+ * the table.
+ */
+void *
+lpm_hashmap_alloc(lpm_t *lpm, size_t len, bool zero)
+{
+	void *ptr;
+
+	if (!lpm_mem_charge(lpm, len)) {
+		return NULL;
+	}
+	if ((ptr = zero ? lpm_zalloc(lpm, len) : lpm_alloc(lpm, len)) == NULL) {
+		lpm->memused -= len;
+	}
+	return ptr;
+}
+
+/*
+ * lpm_hashmap_free: release the memory of the hash map (bucket array,
+ * filter or entry) and uncharge it.
+ */
+void
+lpm_hashmap_free(lpm_t *lpm, void *ptr, size_t len)
+{
+	if (ptr) {
+		lpm->memused -= len;
+		lpm_free(lpm, ptr, len);
+	}
+}
+
+/*
+ * hashmap_memsize: the bytes of the bucket arrays, the filter and the
+ * entries of the hash map.
+ */
+static size_t
+hashmap_memsize(const lpm_hmap_t *hmap)
+{
+	return (size_t)(hmap->hashsize + hmap->oldsize) * sizeof(lpm_ent_t *) +
+	    hmap->bloomsize * sizeof(uint64_t) + hmap->entsize;
+}
 
+/*
+ * The slab of the entries laid out contiguously by lpm_compact().
+ * It is released once all of its entries are removed.
+ */
 typedef struct {
-	unsigned	hashsize;
+	size_t		size;
 	unsigned	nitems;
-	lpm_ent_t **	bucket;
-} lpm_hmap_t;
+} lpm_slab_t;
 
-struct lpm {
-	uint32_t	bitmask[LPM_MAX_WORDS];
-	void *		defvals[2];
-	lpm_hmap_t	prefix[LPM_MAX_PREFIX + 1];
-};
+#define	LPM_SLAB_ALIGN(x)	(((x) + 7) & ~(size_t)7)
 
-static const uint32_t zero_address[LPM_MAX_WORDS];
+/*
+ * lpm_hashmap_free_entry: release the entry of the hash map.
+ */
+void
+lpm_hashmap_free_entry(lpm_t *lpm, lpm_hmap_t *hmap, lpm_ent_t *entry)
+{
+	const size_t entlen = offsetof(lpm_ent_t, key[entry->len]);
+	lpm_slab_t *slab = hmap->slab;
 
-lpm_t *
-lpm_create(void)
+	if (slab && (uint8_t *)entry > (uint8_t *)slab &&
+	    (uint8_t *)entry < (uint8_t *)slab + slab->size) {
+		if (--slab->nitems == 0) {
+			hmap->entsize -= slab->size;
+			lpm_hashmap_free(lpm, slab, slab->size);
+			hmap->slab = NULL;
+		}
+		return;
+	}
+	hmap->entsize -= entlen;
+	lpm_hashmap_free(lpm, entry, entlen);
+}
+
+#ifdef LPM_NUMA
+
+static lpm_t *
+lpm_create_node(int node)
 {
 	lpm_t *lpm;
 
-	if ((lpm = calloc(1, sizeof(lpm_t))) == NULL) {
+	if ((lpm = numa_alloc_onnode(sizeof(lpm_t), node)) == NULL) {
+		return NULL;
+	}
+	memset(lpm, 0, sizeof(lpm_t));
+	lpm->node = node;
+	return lpm;
+}
+
+/*
+ * lpm_create_replicas: create a replica of the table on each NUMA node
+ * with memory and map every CPU to the replica of its node.
+ */
+static lpm_t *
+lpm_create_replicas(void)
+{
+	const int maxnode = numa_max_node();
+	const int ncpus = numa_num_configured_cpus();
+	lpm_t *lpm = NULL, **node_replica;
+	unsigned nreplicas = 0;
+
+	if ((node_replica = calloc(maxnode + 1, sizeof(lpm_t *))) == NULL) {
 		return NULL;
 	}
+	for (int node = 0; node <= maxnode; node++) {
+		if (numa_node_size64(node, NULL) <= 0) {
+			continue;
+		}
+		if ((node_replica[node] = lpm_create_node(node)) == NULL) {
+			goto err;
+		}
+		if (lpm == NULL) {
+			lpm = node_replica[node];
+		}
+		nreplicas++;
+	}
+	if (lpm == NULL) {
+		goto err;
+	}
+	lpm->replicas = calloc(nreplicas, sizeof(lpm_t *));
+	lpm->cpu_replica = calloc(ncpus, sizeof(lpm_t *));
+	if (!lpm->replicas || !lpm->cpu_replica) {
+		goto err;
+	}
+	for (int node = 0; node <= maxnode; node++) {
+		if (node_replica[node]) {
+			lpm->replicas[lpm->nreplicas++] = node_replica[node];
+		}
+	}
+	for (int cpu = 0; cpu < ncpus; cpu++) {
+		const int node = numa_node_of_cpu(cpu);
+		lpm_t *replica = node >= 0 ? node_replica[node] : NULL;
+		lpm->cpu_replica[cpu] = replica ? replica : lpm;
+	}
+	lpm->ncpus = ncpus;
+	free(node_replica);
 	return lpm;
+err:
+	for (int node = 0; node <= maxnode; node++) {
+		lpm_t *replica = node_replica[node];
+
+		if (replica == NULL) {
+			continue;
+		}
+		free(replica->replicas);
+		free(replica->cpu_replica);
+		numa_free(replica, sizeof(lpm_t));
+	}
+	free(node_replica);
+	return NULL;
+}
+
+#endif
+
+static uint64_t
+splitmix64(uint64_t *x)
+{
+	uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
 }
 
+/*
+ * lpm_hash_init: initialise the seed of the hash function, derived from
+ * the given value or random, if zero.
+ */
 void
-lpm_clear(lpm_t *lpm, lpm_dtor_t dtor, void *arg)
+lpm_hash_init(uint64_t *seed, uint64_t val)
+{
+	static uint64_t counter;
+	struct timespec ts;
+	uint64_t x = val;
+
+	if (val == 0 && getentropy(seed, 2 * sizeof(uint64_t)) == 0) {
+		return;
+	}
+	if (val == 0) {
+		/* No entropy source: the best effort. */
+		clock_gettime(CLOCK_MONOTONIC, &ts);
+		x = ((uint64_t)ts.tv_sec << 32) ^ ts.tv_nsec ^
+		    (uintptr_t)seed ^ __atomic_add_fetch(&counter, 1,
+		    __ATOMIC_RELAXED);
+	}
+	seed[0] = splitmix64(&x);
+	seed[1] = splitmix64(&x);
+}
+
+/*
+ * lpm_create_ex: construct a new LPM object with the given configuration.
+ *
+ * => LPM_F_NUMA: replicate the table on each NUMA node; it is a no-op,
+ *    unless the library is built with the NUMA support.
+ * => LPM_F_BLOOM: maintain a Bloom filter for each prefix length, so
+ *    that the lookups skip most of the hash map probes which would miss.
+ * => The hash maps grow by the growth factor (rounded up to a power of 2)
+ *    once the load factor exceeds the maximum; zero means the default.
+ * => The hash maps are pre-sized using the initial sizes, if any.
+ * => LPM_F_MAPPED: look up the IPv4-mapped IPv6 addresses (::ffff:0:0/96)
+ *    and, if the NAT64 prefix is given (e.g. 64:ff9b::/96), the addresses
+ *    within it using the IPv4 prefixes, unless there is a matching IPv6
+ *    prefix longer than /96.  Only lpm_lookup() and the lookups built on
+ *    it (the dual, cached and flow lookups) are affected.
+ * => The hash function is seeded with the given seed, e.g. to reproduce
+ *    the layout; zero means a random seed, which should be used if the
+ *    keys may come from an untrusted source.
+ * => The memory of the hash maps (of each replica) is limited to the
+ *    given number of bytes, if any: the updates which would exceed it
+ *    fail with ENOMEM, see lpm_memory_usage().
+ */
+lpm_t *
+lpm_create_ex(const lpm_conf_t *conf)
+{
+	unsigned growth_shift = 1;
+	lpm_t *lpm = NULL;
+
+#ifdef LPM_NUMA
+	if ((conf->flags & LPM_F_NUMA) != 0 && numa_available() != -1 &&
+	    (lpm = lpm_create_replicas()) == NULL) {
+		return NULL;
+	}
+#endif
+	if (lpm == NULL) {
+		if ((lpm = calloc(1, sizeof(lpm_t))) == NULL) {
+			return NULL;
+		}
+		lpm->node = -1;
+	}
+
+	while (conf->growth > (1U << growth_shift) && growth_shift < 8) {
+		growth_shift++;
+	}
+	lpm_hash_init(lpm->seed, conf->seed);
+	lpm->gen = lpm_gen_next();
+	if ((conf->flags & LPM_F_MAPPED) != 0) {
+		lpm->mapped[lpm->nmapped++][2] = htonl(0xffff);
+		if (conf->nat64) {
+			memcpy(lpm->mapped[lpm->nmapped++], conf->nat64, 12);
+		}
+	}
+	for (unsigned r = 0; r < LPM_NREPLICAS(lpm); r++) {
+		lpm_t *replica = LPM_REPLICA(lpm, r);
+
+		memcpy(replica->seed, lpm->seed, sizeof(lpm->seed));
+		memcpy(replica->mapped, lpm->mapped, sizeof(lpm->mapped));
+		replica->nmapped = lpm->nmapped;
+		replica->memlimit = conf->memlimit;
+		replica->flags = conf->flags;
+		replica->max_load = conf->max_load ? conf->max_load : LPM_MAX_LOAD;
+		replica->growth_shift = growth_shift;
+	}
+	for (unsigned n = 1; n < conf->nsizes && n <= LPM_MAX_PREFIX; n++) {
+		if (conf->sizes[n] && lpm_reserve(lpm,
+		    LPM_MAX_KEYLEN, n, conf->sizes[n]) == -1) {
+			lpm_destroy(lpm);
+			return NULL;
+		}
+	}
+	return lpm;
+}
+
+lpm_t *
+lpm_create(void)
+{
+	const lpm_conf_t conf = { .flags = 0 };
+	return lpm_create_ex(&conf);
+}
+
+/*
+ * hashmap_unshare: drop the reference to the shared hash map.
+ *
+ * => Returns true if it was the last reference, i.e. the caller owns it.
+ */
+static bool
+hashmap_unshare(lpm_hmap_t *hmap)
+{
+	unsigned *shared = hmap->shared;
+
+	hmap->shared = NULL;
+	if (__atomic_sub_fetch(shared, 1, __ATOMIC_ACQ_REL) != 0) {
+		return false;
+	}
+	free(shared);
+	return true;
+}
+
+/*
+ * hashmap_destroy: release the hash map with its entries, calling the
+ * destructor, if any, for each entry.  If the hash map is still shared
+ * with a snapshot, then only drop the reference.
+ */
+static void
+hashmap_destroy(lpm_t *lpm, lpm_hmap_t *hmap, lpm_dtor_t dtor, void *arg)
+{
+	const bool release = hmap->shared == NULL || hashmap_unshare(hmap);
+
+	if (release) {
+		lpm_hashmap_free(lpm, hmap->bloom,
+		    hmap->bloomsize * sizeof(uint64_t));
+		lpm_hashmap_settle(lpm, hmap);
+	} else {
+		lpm->memused -= hashmap_memsize(hmap);
+	}
+	for (unsigned i = 0; i < hmap->hashsize; i++) {
+		lpm_ent_t *entry = hmap->bucket[i];
+
+		while (entry) {
+			lpm_ent_t *next = entry->next;
+
+			if (dtor) {
+				dtor(arg, entry->key, entry->len, entry->val);
+			}
+			if (release) {
+				lpm_hashmap_free_entry(lpm, hmap, entry);
+			}
+			entry = next;
+		}
+	}
+	if (release) {
+		lpm_hashmap_free(lpm, hmap->bucket,
+		    hmap->hashsize * sizeof(lpm_ent_t *));
+		ASSERT(hmap->slab == NULL && hmap->entsize == 0);
+	}
+	memset(hmap, 0, sizeof(lpm_hmap_t));
+}
+
+static void
+lpm_clear_replica(lpm_t *lpm, lpm_dtor_t dtor, void *arg)
 {
 	for (unsigned n = 0; n <= LPM_MAX_PREFIX; n++) {
 		lpm_hmap_t *hmap = &lpm->prefix[n];
 
 		if (!hmap->hashsize) {
-			ASSERT(!hmap->bucket);
+			ASSERT(!hmap->bucket && !hmap->bloom);
 			continue;
 		}
-		for (unsigned i = 0; i < hmap->hashsize; i++) {
-			lpm_ent_t *entry = hmap->bucket[i];
+		hashmap_destroy(lpm, hmap, dtor, arg);
+	}
+	for (unsigned len = 1; dtor && len <= LPM_MAX_KEYLEN; len++) {
+		if (lpm->defvals[len]) {
+			dtor(arg, zero_address, len, lpm->defvals[len]);
+		}
+	}
+	memset(lpm->bitmask, 0, sizeof(lpm->bitmask));
+	memset(lpm->defvals, 0, sizeof(lpm->defvals));
+}
 
-			while (entry) {
-				lpm_ent_t *next = entry->next;
+void
+lpm_clear(lpm_t *lpm, lpm_dtor_t dtor, void *arg)
+{
+	/*
+	 * Note: the replicas share the values, therefore the destructor
+	 * is called only for the first replica.
+	 */
+	ASSERT(!lpm->snapshot);
+	lpm->gen = lpm_gen_next();
+	for (unsigned i = 0; i < LPM_NREPLICAS(lpm); i++) {
+		lpm_clear_replica(LPM_REPLICA(lpm, i),
+		    i ? NULL : dtor, arg);
+	}
+}
 
-				if (dtor) {
-					dtor(arg, entry->key,
-					    entry->len, entry->val);
-				}
-				free(entry);
-				entry = next;
+void
+lpm_destroy(lpm_t *lpm)
+{
+	lpm_clear(lpm, NULL, NULL);
+#ifdef LPM_NUMA
+	if (lpm->node >= 0) {
+		lpm_t **replicas = lpm->replicas;
+		const unsigned nreplicas = lpm->nreplicas;
+
+		free(lpm->cpu_replica);
+		for (unsigned i = 0; i < nreplicas; i++) {
+			lpm_t *replica = replicas[i];
+
+			while (replica->chunks) {
+				lpm_chunk_t *chunk = replica->chunks;
+				replica->chunks = chunk->next;
+				numa_free(chunk, LPM_NUMA_CHUNK);
 			}
+			numa_free(replica, sizeof(lpm_t));
+		}
+		free(replicas);
+		return;
+	}
+#endif
+	free(lpm);
+}
+
+static inline unsigned
+hashmap_index(const lpm_t *lpm, const lpm_ent_t *entry, unsigned hashsize)
+{
+	/* Recompute the hash if the cached bits are not enough. */
+	const uint32_t hash = hashsize <= (1U << LPM_HASH_BITS) ?
+	    entry->hash : lpm_hash(lpm, entry->key, entry->len);
+	return hash & (hashsize - 1);
+}
+
+/*
+ * hashmap_migrate: move up to the given number of the buckets from the
+ * old array to the new one; release the old array once it is empty.
+ */
+static void
+hashmap_migrate(lpm_t *lpm, lpm_hmap_t *hmap, unsigned nbuckets)
+{
+
+	while (nbuckets-- && hmap->migrated < hmap->oldsize) {
+		lpm_ent_t *list = hmap->oldbucket[hmap->migrated];
+
+		hmap->oldbucket[hmap->migrated++] = NULL;
+		while (list) {
+			lpm_ent_t *entry = list;
+			const unsigned i = hashmap_index(lpm, entry,
+			    hmap->hashsize);
+
+			list = entry->next;
+			entry->next = hmap->bucket[i];
+			hmap->bucket[i] = entry;
 		}
-		free(hmap->bucket);
-		hmap->bucket = NULL;
-		hmap->hashsize = 0;
-		hmap->nitems = 0;
 	}
-	if (dtor) {
-		dtor(arg, zero_address, 4, lpm->defvals[0]);
-		dtor(arg, zero_address, 16, lpm->defvals[1]);
+	if (hmap->migrated == hmap->oldsize) {
+		LPM_TRACE2(rehash__done, hmap, hmap->hashsize);
+		lpm_hashmap_free(lpm, hmap->oldbucket,
+		    hmap->oldsize * sizeof(lpm_ent_t *));
+		hmap->oldbucket = NULL;
+		hmap->oldsize = 0;
+		hmap->migrated = 0;
 	}
-	memset(lpm->bitmask, 0, sizeof(lpm->bitmask));
-	memset(lpm->defvals, 0, sizeof(lpm->defvals));
 }
 
-void
-lpm_destroy(lpm_t *lpm)
+/*
+ * lpm_hashmap_settle: complete the resize in progress, if any.
+ *
+ * => A shared hash map never has a resize in progress, see lpm_snapshot().
+ */
+void
+lpm_hashmap_settle(lpm_t *lpm, lpm_hmap_t *hmap)
+{
+	if (hmap->oldbucket) {
+		hashmap_migrate(lpm, hmap, UINT_MAX);
+	}
+}
+
+/*
+ * hashmap_grow: start the resize to at least the given size.
+ */
+static bool
+hashmap_grow(lpm_t *lpm, lpm_hmap_t *hmap, unsigned size)
+{
+	lpm_ent_t **bucket;
+	unsigned hashsize;
+
+	for (hashsize = 1; hashsize < size; hashsize <<= 1) {
+		continue;
+	}
+	bucket = lpm_hashmap_alloc(lpm, hashsize * sizeof(lpm_ent_t *), true);
+	if (bucket == NULL) {
+		return false;
+	}
+	lpm_hashmap_settle(lpm, hmap);
+	LPM_TRACE4(rehash, hmap, hmap->hashsize, hashsize, hmap->nitems);
+	if (hmap->bucket) {
+		hmap->oldbucket = hmap->bucket;
+		hmap->oldsize = hmap->hashsize;
+		hmap->migrated = 0;
+	}
+	hmap->hashsize = hashsize;
+	hmap->bucket = bucket;
+	return true;
+}
+
+/*
+ * lpm_hashmap_size: the number of buckets for the given number of items
+ * to stay within the maximum load factor.
+ */
+unsigned
+lpm_hashmap_size(const lpm_t *lpm, unsigned nitems)
+{
+	const uint64_t size = ((uint64_t)nitems * 100 + lpm->max_load - 1) /
+	    lpm->max_load;
+
+	if (size < LPM_HASH_STEP) {
+		return LPM_HASH_STEP;
+	}
+	return size < (1U << 31) ? size : (1U << 31);
+}
+
+/*
+ * lpm_hashmap_rehash: resize the hash map to at least the given size
+ * at once.
+ */
+bool
+lpm_hashmap_rehash(lpm_t *lpm, lpm_hmap_t *hmap, unsigned size)
+{
+	if (!lpm_hashmap_own(lpm, hmap) || !hashmap_grow(lpm, hmap, size)) {
+		return false;
+	}
+	lpm_hashmap_settle(lpm, hmap);
+	return true;
+}
+
+/*
+ * lpm_hashmap_reserve: pre-size the hash map for the given number of
+ * items, so there is no resize until it is exceeded.
+ */
+bool
+lpm_hashmap_reserve(lpm_t *lpm, lpm_hmap_t *hmap, unsigned nitems)
+{
+	const unsigned size = lpm_hashmap_size(lpm, nitems);
+	return hmap->hashsize >= size || lpm_hashmap_rehash(lpm, hmap, size);
+}
+
+lpm_ent_t *
+lpm_hashmap_insert(lpm_t *lpm, lpm_hmap_t *hmap, const void *key, size_t len)
+{
+	const size_t entlen = offsetof(lpm_ent_t, key[len]);
+	lpm_ent_t *entry;
+	uint32_t hash;
+
+	/* Note: the caller may update the existing entry. */
+	if (!lpm_hashmap_own(lpm, hmap)) {
+		return NULL;
+	}
+	if ((entry = hashmap_lookup(lpm, hmap, key, len)) != NULL) {
+		return entry;
+	}
+	if (hmap->oldbucket) {
+		hashmap_migrate(lpm, hmap, LPM_REHASH_STEP);
+	}
+	if ((uint64_t)(hmap->nitems + 1) * 100 >
+	    (uint64_t)hmap->hashsize * lpm->max_load) {
+		/* Grow geometrically, but at least to fit the load factor. */
+		unsigned size = lpm_hashmap_size(lpm, hmap->nitems + 1);
+
+		if (size < (hmap->hashsize << lpm->growth_shift)) {
+			size = hmap->hashsize << lpm->growth_shift;
+		}
+		if (!hashmap_grow(lpm, hmap, size)) {
+			return NULL;
+		}
+	}
+
+	if ((entry = lpm_hashmap_alloc(lpm, entlen, false)) != NULL) {
+		const unsigned i = (hash = lpm_hash(lpm, key, len)) &
+		    (hmap->hashsize - 1);
+
+		memcpy(entry->key, key, len);
+		entry->next = hmap->bucket[i];
+		entry->len = len;
+		entry->hash = hash;
+
+		hmap->bucket[i] = entry;
+		hmap->nitems++;
+		hmap->entsize += entlen;
+	}
+	return entry;
+}
+
+static lpm_ent_t *
+hashmap_unlink(lpm_ent_t **pp, const void *key, size_t len)
+{
+	lpm_ent_t *entry;
+
+	while ((entry = *pp) != NULL) {
+		if (entry->len == len && memcmp(entry->key, key, len) == 0) {
+			*pp = entry->next;
+			return entry;
+		}
+		pp = &entry->next;
+	}
+	return NULL;
+}
+
+int
+lpm_hashmap_remove(lpm_t *lpm, lpm_hmap_t *hmap, const void *key, size_t len)
+{
+	const uint32_t hash = lpm_hash(lpm, key, len);
+	lpm_ent_t *entry;
+
+	if (hmap->hashsize == 0) {
+		return -1;
+	}
+	/* Do not copy the shared hash map just to find nothing. */
+	if (hmap->shared && (hashmap_lookup(lpm, hmap, key, len) == NULL ||
+	    !lpm_hashmap_own(lpm, hmap))) {
+		return -1;
+	}
+	entry = hashmap_unlink(&hmap->bucket[hash & (hmap->hashsize - 1)],
+	    key, len);
+	if (entry == NULL && hmap->oldbucket) {
+		entry = hashmap_unlink(
+		    &hmap->oldbucket[hash & (hmap->oldsize - 1)], key, len);
+	}
+	if (entry == NULL) {
+		return -1;
+	}
+	hmap->nitems--;
+	lpm_hashmap_free_entry(lpm, hmap, entry);
+	if (hmap->oldbucket) {
+		hashmap_migrate(lpm, hmap, LPM_REHASH_STEP);
+	}
+	return 0;
+}
+
+/*
+ * lpm_bloom_rebuild: construct the Bloom filter of the hash map, sized
+ * for its current number of items.
+ *
+ * => The bits cannot be cleared on removal, so the filter is rebuilt
+ *    once the removals since the last build exceed the items.
+ * => On allocation failure, there is no filter: every key may match.
+ */
+void
+lpm_bloom_rebuild(lpm_t *lpm, lpm_hmap_t *hmap)
+{
+	unsigned size = LPM_BLOOM_MINSIZE;
+	uint64_t *bloom;
+
+	ASSERT(hmap->shared == NULL);
+	lpm_hashmap_free(lpm, hmap->bloom, hmap->bloomsize * sizeof(uint64_t));
+	hmap->bloom = NULL;
+	hmap->bloomsize = 0;
+	hmap->bloomstale = 0;
+
+	if (hmap->nitems == 0) {
+		return;
+	}
+	while ((uint64_t)size * 64 < (uint64_t)hmap->nitems * LPM_BLOOM_BITS) {
+		size <<= 1;
+	}
+	bloom = lpm_hashmap_alloc(lpm, size * sizeof(uint64_t), true);
+	if (bloom == NULL) {
+		return;
+	}
+	for (unsigned i = 0; i < hmap->hashsize + hmap->oldsize; i++) {
+		lpm_ent_t *entry = i < hmap->hashsize ? hmap->bucket[i] :
+		    hmap->oldbucket[i - hmap->hashsize];
+
+		for (; entry; entry = entry->next) {
+			const uint32_t hash = lpm_hash(lpm, entry->key, entry->len);
+			bloom[hash & (size - 1)] |= lpm_bloom_mask(hash);
+		}
+	}
+	hmap->bloom = bloom;
+	hmap->bloomsize = size;
+}
+
+static void
+bloom_add(lpm_t *lpm, lpm_hmap_t *hmap, const void *key, size_t len)
+{
+	const uint32_t hash = lpm_hash(lpm, key, len);
+
+	/* Grow (or retry after a failure) once over the capacity. */
+	if (hmap->bloom == NULL || (uint64_t)hmap->nitems * LPM_BLOOM_BITS >
+	    (uint64_t)hmap->bloomsize * 64) {
+		lpm_bloom_rebuild(lpm, hmap);
+		return;
+	}
+	hmap->bloom[hash & (hmap->bloomsize - 1)] |= lpm_bloom_mask(hash);
+}
+
+static int
+lpm_insert_replica(lpm_t *lpm, const void *addr,
+    size_t len, unsigned preflen, void *val)
+{
+	const unsigned nwords = LPM_TO_WORDS(len);
+	uint32_t prefix[nwords];
+	lpm_hmap_t *hmap;
+	lpm_ent_t *entry;
+	unsigned nitems;
+
+	if (preflen == 0) {
+		/* 0-length prefix is a special case. */
+		lpm->defvals[len] = val;
+		return 0;
+	}
+	compute_prefix(len, addr, preflen, prefix);
+	hmap = &lpm->prefix[preflen];
+	nitems = hmap->nitems;
+	entry = lpm_hashmap_insert(lpm, hmap, prefix, len);
+	if (entry) {
+		const unsigned n = --preflen >> 5;
+
+		if ((lpm->flags & LPM_F_BLOOM) != 0 && hmap->nitems != nitems) {
+			bloom_add(lpm, hmap, prefix, len);
+		}
+		lpm->bitmask[n] |= 0x80000000U >> (preflen & 31);
+		entry->val = val;
+		return 0;
+	}
+	return -1;
+}
+
+static int
+lpm_remove_replica(lpm_t *lpm, const void *addr, size_t len, unsigned preflen)
+{
+	const unsigned nwords = LPM_TO_WORDS(len);
+	uint32_t prefix[nwords];
+	lpm_hmap_t *hmap;
+
+	if (preflen == 0) {
+		lpm->defvals[len] = NULL;
+		return 0;
+	}
+	compute_prefix(len, addr, preflen, prefix);
+	hmap = &lpm->prefix[preflen];
+	if (lpm_hashmap_remove(lpm, hmap, prefix, len) == -1) {
+		return -1;
+	}
+	if (hmap->bloom && ++hmap->bloomstale > hmap->nitems) {
+		/* Mostly the stale bits: rebuild (or release) the filter. */
+		lpm_bloom_rebuild(lpm, hmap);
+	}
+	if (hmap->nitems == 0) {
+		/* The last entry of this length: stop probing it. */
+		const unsigned n = --preflen >> 5;
+		lpm->bitmask[n] &= ~(0x80000000U >> (preflen & 31));
+	}
+	return 0;
+}
+
+lpm_ent_t *
+lpm_lookup_entry(lpm_t *lpm, const void *addr, size_t len, unsigned preflen)
+{
+	const unsigned nwords = LPM_TO_WORDS(len);
+	uint32_t prefix[nwords];
+
+	ASSERT(preflen > 0);
+	compute_prefix(len, addr, preflen, prefix);
+	return hashmap_lookup(lpm, &lpm->prefix[preflen], prefix, len);
+}
+
+/*
+ * lpm_insert: insert the CIDR into the LPM table.
+ *
+ * => Returns zero on success and -1 on failure.
+ */
+int
+lpm_insert(lpm_t *lpm, const void *addr,
+    size_t len, unsigned preflen, void *val)
+{
+	lpm_ent_t *entry;
+	void *oldval;
+	ASSERT(LPM_VALID_LEN(len) && preflen <= len * 8);
+	ASSERT(!lpm->snapshot);
+
+	lpm->gen = lpm_gen_next();
+	if (!lpm->nreplicas) {
+		return lpm_insert_replica(lpm, addr, len, preflen, val);
+	}
+	if (preflen == 0) {
+		for (unsigned i = 0; i < lpm->nreplicas; i++) {
+			lpm_insert_replica(lpm->replicas[i], addr, len, 0, val);
+		}
+		return 0;
+	}
+
+	/*
+	 * Apply to all replicas.  On failure, roll back the replicas
+	 * which were already updated.
+	 */
+	entry = lpm_lookup_entry(lpm, addr, len, preflen);
+	oldval = entry ? entry->val : NULL;
+
+	for (unsigned i = 0; i < lpm->nreplicas; i++) {
+		if (lpm_insert_replica(lpm->replicas[i],
+		    addr, len, preflen, val) == 0) {
+			continue;
+		}
+		while (i--) {
+			lpm_t *replica = lpm->replicas[i];
+
+			if (entry) {
+				lpm_insert_replica(replica,
+				    addr, len, preflen, oldval);
+			} else {
+				lpm_remove_replica(replica,
+				    addr, len, preflen);
+			}
+		}
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * lpm_remove: remove the specified prefix.
+ */
+int
+lpm_remove(lpm_t *lpm, const void *addr, size_t len, unsigned preflen)
+{
+	int ret = 0;
+	ASSERT(LPM_VALID_LEN(len) && preflen <= len * 8);
+	ASSERT(!lpm->snapshot);
+
+	lpm->gen = lpm_gen_next();
+	for (unsigned i = 0; i < LPM_NREPLICAS(lpm); i++) {
+		lpm_t *replica = LPM_REPLICA(lpm, i);
+		ret = lpm_remove_replica(replica, addr, len, preflen);
+	}
+	LPM_TRACE4(remove, addr, len, preflen, ret);
+	return ret;
+}
+
+/*
+ * lpm_lookup_words: find the longest matching prefix of the lengths in
+ * the given words of the bitmask, from the n-th (exclusive) down to the
+ * last one.
+ */
+static __always_inline lpm_ent_t *
+lpm_lookup_words(lpm_t *lpm, const void *addr, const size_t len,
+    unsigned n, const unsigned last)
+{
+	const unsigned nwords = LPM_TO_WORDS(len);
+	uint32_t prefix[nwords];
+	unsigned i;
+
+	while (n-- > last) {
+		uint32_t bitmask = lpm_bitmask(lpm, len, n);
+
+		while ((i = ffs(bitmask)) != 0) {
+			const unsigned preflen = (32 * n) + (32 - --i);
+			lpm_hmap_t *hmap = &lpm->prefix[preflen];
+			lpm_ent_t *entry;
+			uint32_t hash;
+
+			compute_prefix(len, addr, preflen, prefix);
+			hash = lpm_hash(lpm, prefix, len);
+			if (lpm_bloom_test(hmap, hash)) {
+				entry = hashmap_lookup_hash(hmap, hash, prefix, len);
+				LPM_TRACE2(lookup__probe, preflen, entry != NULL);
+				if (entry) {
+					return entry;
+				}
+			}
+			bitmask &= ~(1U << i);
+		}
+	}
+	return NULL;
+}
+
+static __always_inline void *
+lpm_lookup_len(lpm_t *lpm, const void *addr, const size_t len)
+{
+	lpm_ent_t *entry;
+
+	entry = lpm_lookup_words(lpm, addr, len, LPM_TO_WORDS(len), 0);
+	return entry ? entry->val : lpm->defvals[len];
+}
+
+/*
+ * lpm_mapped: whether the IPv6 address is IPv4-mapped or within the
+ * NAT64 prefix, see LPM_F_MAPPED.
+ */
+static __always_inline bool
+lpm_mapped(const lpm_t *lpm, const void *addr)
+{
+	uint32_t a[3];
+
+	memcpy(a, addr, sizeof(a));
+	for (unsigned i = 0; i < lpm->nmapped; i++) {
+		if (memcmp(a, lpm->mapped[i], sizeof(a)) == 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * lpm_lookup_mapped: lookup the IPv4-mapped (or NAT64) IPv6 address: an
+ * IPv6 prefix longer than /96, if any, then the IPv4 address in the IPv4
+ * prefixes and, failing that, the IPv6 prefixes up to /96.
+ */
+static void *
+lpm_lookup_mapped(lpm_t *lpm, const void *addr)
+{
+	lpm_ent_t *entry;
+	void *val;
+
+	if ((entry = lpm_lookup_words(lpm, addr, 16, 4, 3)) != NULL) {
+		return entry->val;
+	}
+	if ((val = lpm_lookup_len(lpm, (const uint8_t *)addr + 12, 4)) != NULL) {
+		return val;
+	}
+	entry = lpm_lookup_words(lpm, addr, 16, 3, 0);
+	return entry ? entry->val : lpm->defvals[16];
+}
+
+/*
+ * Sampling of the lookups: each thread records its samples in its own
+ * histogram, therefore no synchronisation is needed.
+ */
+static __thread lpm_hist_t *	lpm_hist;
+static __thread unsigned	lpm_sample_countdown;
+
+static inline bool
+lpm_sample_due(const lpm_t *lpm)
+{
+	if (lpm_hist == NULL || lpm_sample_countdown-- > 1) {
+		return false;
+	}
+	lpm_sample_countdown = lpm->sample_period;
+	return true;
+}
+
+static inline unsigned
+lpm_hist_bucket(unsigned n)
+{
+	const unsigned b = n ? 32 - __builtin_clz(n) : 0;
+	return b < LPM_HIST_BUCKETS ? b : LPM_HIST_BUCKETS - 1;
+}
+
+static void *
+lpm_sample_record(unsigned nprobes, unsigned nchain, void *val)
+{
+	lpm_hist->nsamples++;
+	lpm_hist->probes[lpm_hist_bucket(nprobes)]++;
+	lpm_hist->chain[lpm_hist_bucket(nchain)]++;
+	return val;
+}
+
+static lpm_ent_t *
+hashmap_chain_count(lpm_ent_t *entry, const void *key, size_t len,
+    unsigned *nchain)
+{
+	for (; entry; entry = entry->next) {
+		(*nchain)++;
+		if (entry->len == len && memcmp(entry->key, key, len) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * lpm_lookup_sampled: lpm_lookup_len() counting the hash map probes and
+ * the chain entries visited, recorded in the histogram of the thread.
+ */
+static void *
+lpm_lookup_sampled(lpm_t *lpm, const void *addr, const size_t len)
+{
+	const unsigned nwords = LPM_TO_WORDS(len);
+	unsigned i, n = nwords, nprobes = 0, nchain = 0;
+	uint32_t prefix[nwords];
+
+	while (n--) {
+		uint32_t bitmask = lpm_bitmask(lpm, len, n);
+
+		while ((i = ffs(bitmask)) != 0) {
+			const unsigned preflen = (32 * n) + (32 - --i);
+			lpm_hmap_t *hmap = &lpm->prefix[preflen];
+			lpm_ent_t *entry = NULL;
+			uint32_t hash;
+
+			compute_prefix(len, addr, preflen, prefix);
+			hash = lpm_hash(lpm, prefix, len);
+			if (!lpm_bloom_test(hmap, hash)) {
+				bitmask &= ~(1U << i);
+				continue;
+			}
+			nprobes++;
+			if (hmap->hashsize) {
+				entry = hashmap_chain_count(hmap->bucket[hash &
+				    (hmap->hashsize - 1)], prefix, len, &nchain);
+			}
+			if (entry == NULL && hmap->oldbucket) {
+				entry = hashmap_chain_count(hmap->oldbucket[hash &
+				    (hmap->oldsize - 1)], prefix, len, &nchain);
+			}
+			if (entry) {
+				return lpm_sample_record(nprobes,
+				    nchain, entry->val);
+			}
+			bitmask &= ~(1U << i);
+		}
+	}
+	return lpm_sample_record(nprobes, nchain, lpm->defvals[len]);
+}
+
+/*
+ * lpm_lookup: find the longest matching prefix given the IP address.
+ *
+ * => Returns the associated value on success or NULL on failure.
+ */
+void *
+lpm_lookup(lpm_t *lpm, const void *addr, size_t len)
+{
+	void *val;
+
+	ASSERT(LPM_VALID_LEN(len));
+	LPM_TRACE2(lookup__entry, addr, len);
+
+	lpm = lpm_local_replica(lpm);
+	if (__predict_false(lpm->nmapped) && len == 16 &&
+	    lpm_mapped(lpm, addr)) {
+		val = lpm_lookup_mapped(lpm, addr);
+		LPM_TRACE2(lookup__return, addr, val);
+		return val;
+	}
+	if (__predict_false(lpm->sample_period) && lpm_sample_due(lpm)) {
+		val = lpm_lookup_sampled(lpm, addr, len);
+		LPM_TRACE2(lookup__return, addr, val);
+		return val;
+	}
+
+	/* Specialise the common cases: IPv4 and IPv6. */
+	switch (len) {
+	case 4:
+		val = lpm_lookup_len(lpm, addr, 4);
+		break;
+	case 16:
+		val = lpm_lookup_len(lpm, addr, 16);
+		break;
+	default:
+		val = lpm_lookup_len(lpm, addr, len);
+		break;
+	}
+	LPM_TRACE2(lookup__return, addr, val);
+	return val;
+}
+
+/*
+ * lpm_lookup_group: lpm_lookup_len() of the group of addresses at once.
+ *
+ * All addresses are probed at each populated prefix length, so there is
+ * a single walk of the bitmask and the probes of the addresses are done
+ * in stages: hash all keys, load all bucket heads, then walk the chains.
+ * The memory accesses of the addresses are independent of each other,
+ * therefore they overlap instead of stalling one after another.
+ */
+static __always_inline void
+lpm_lookup_group(lpm_t *lpm, const void *const *addrs, const size_t len,
+    void **vals, const unsigned k)
+{
+	const unsigned nwords = LPM_TO_WORDS(len);
+	uint32_t prefix[LPM_LOOKUP_GROUP][nwords];
+	uint32_t hash[LPM_LOOKUP_GROUP];
+	lpm_ent_t *heads[LPM_LOOKUP_GROUP];
+	unsigned i, n = nwords, pending = (1U << k) - 1;
+
+	while (n--) {
+		uint32_t bitmask = lpm_bitmask(lpm, len, n);
+
+		while ((i = ffs(bitmask)) != 0) {
+			const unsigned preflen = (32 * n) + (32 - --i);
+			lpm_hmap_t *hmap = &lpm->prefix[preflen];
+			unsigned probe = 0;
+
+			bitmask &= ~(1U << i);
+			if (hmap->hashsize == 0) {
+				continue;
+			}
+			for (unsigned j = 0; j < k; j++) {
+				if ((pending & (1U << j)) == 0) {
+					continue;
+				}
+				compute_prefix(len, addrs[j], preflen, prefix[j]);
+				hash[j] = lpm_hash(lpm, prefix[j], len);
+				if (lpm_bloom_test(hmap, hash[j])) {
+					probe |= 1U << j;
+				}
+			}
+			for (unsigned j = 0; j < k; j++) {
+				if (probe & (1U << j)) {
+					heads[j] = hmap->bucket[hash[j] &
+					    (hmap->hashsize - 1)];
+					__builtin_prefetch(heads[j]);
+				}
+			}
+			for (unsigned j = 0; j < k; j++) {
+				lpm_ent_t *entry;
+
+				if ((probe & (1U << j)) == 0) {
+					continue;
+				}
+				entry = hashmap_chain_lookup(heads[j],
+				    prefix[j], len);
+				if (__predict_false(!entry && hmap->oldbucket)) {
+					entry = hashmap_chain_lookup(
+					    hmap->oldbucket[hash[j] &
+					    (hmap->oldsize - 1)], prefix[j], len);
+				}
+				LPM_TRACE2(lookup__probe, preflen, entry != NULL);
+				if (entry) {
+					vals[j] = entry->val;
+					pending &= ~(1U << j);
+				}
+			}
+			if (pending == 0) {
+				return;
+			}
+		}
+	}
+	for (unsigned j = 0; j < k; j++) {
+		if (pending & (1U << j)) {
+			vals[j] = lpm->defvals[len];
+		}
+	}
+}
+
+/*
+ * lpm_lookup_group_mapped: lpm_lookup_group() of the IPv6 addresses,
+ * some of which may be IPv4-mapped: those are looked up one by one.
+ */
+static void
+lpm_lookup_group_mapped(lpm_t *lpm, const void *const *addrs, void **vals,
+    unsigned k)
+{
+	const void *group[LPM_LOOKUP_GROUP];
+	void *gvals[LPM_LOOKUP_GROUP];
+	unsigned idx[LPM_LOOKUP_GROUP], n = 0;
+
+	for (unsigned j = 0; j < k; j++) {
+		if (lpm_mapped(lpm, addrs[j])) {
+			vals[j] = lpm_lookup_mapped(lpm, addrs[j]);
+			continue;
+		}
+		idx[n] = j;
+		group[n++] = addrs[j];
+	}
+	if (n == 0) {
+		return;
+	}
+	lpm_lookup_group(lpm, group, 16, gvals, n);
+	for (unsigned j = 0; j < n; j++) {
+		vals[idx[j]] = gvals[j];
+	}
+}
+
+static void
+lpm_lookup_groups(lpm_t *lpm, const void *const *addrs, size_t len,
+    void **vals, unsigned k)
+{
+	/* Specialise for IPv4 and IPv6. */
+	switch (len) {
+	case 4:
+		lpm_lookup_group(lpm, addrs, 4, vals, k);
+		break;
+	case 16:
+		if (__predict_false(lpm->nmapped)) {
+			lpm_lookup_group_mapped(lpm, addrs, vals, k);
+			break;
+		}
+		lpm_lookup_group(lpm, addrs, 16, vals, k);
+		break;
+	default:
+		lpm_lookup_group(lpm, addrs, len, vals, k);
+		break;
+	}
+}
+
+/*
+ * lpm_lookup2: find the longest matching prefixes of the source and the
+ * destination address in a single pass.
+ *
+ * => Equivalent to two lpm_lookup() calls, but cheaper.
+ * => The values (or NULL) are stored in sval and dval.
+ */
+void
+lpm_lookup2(lpm_t *lpm, const void *src, const void *dst, size_t len,
+    void **sval, void **dval)
+{
+	const void *addrs[2] = { src, dst };
+	void *vals[2];
+
+	ASSERT(LPM_VALID_LEN(len));
+
+	lpm = lpm_local_replica(lpm);
+	lpm_lookup_groups(lpm, addrs, len, vals, 2);
+	*sval = vals[0];
+	*dval = vals[1];
+}
+
+/*
+ * lpm_lookup2_batch: lpm_lookup2() of the n address pairs, looking up
+ * LPM_LOOKUP_GROUP addresses at once.
+ */
+void
+lpm_lookup2_batch(lpm_t *lpm, const void *const *src, const void *const *dst,
+    size_t len, void **svals, void **dvals, unsigned n)
+{
+	const unsigned npairs = LPM_LOOKUP_GROUP / 2;
+
+	ASSERT(LPM_VALID_LEN(len));
+
+	lpm = lpm_local_replica(lpm);
+	for (unsigned i = 0; i < n; i += npairs) {
+		const unsigned k = n - i < npairs ? n - i : npairs;
+		const void *addrs[LPM_LOOKUP_GROUP];
+		void *vals[LPM_LOOKUP_GROUP];
+
+		for (unsigned j = 0; j < k; j++) {
+			addrs[2 * j] = src[i + j];
+			addrs[2 * j + 1] = dst[i + j];
+		}
+		lpm_lookup_groups(lpm, addrs, len, vals, 2 * k);
+		for (unsigned j = 0; j < k; j++) {
+			svals[i + j] = vals[2 * j];
+			dvals[i + j] = vals[2 * j + 1];
+		}
+	}
+}
+
+/*
+ * lpm_set_sampling: sample every n-th lookup of each thread which has
+ * registered a histogram, see lpm_hist_register().
+ *
+ * => Zero disables the sampling, which is the default.
+ */
+void
+lpm_set_sampling(lpm_t *lpm, unsigned period)
+{
+	for (unsigned i = 0; i < LPM_NREPLICAS(lpm); i++) {
+		LPM_REPLICA(lpm, i)->sample_period = period;
+	}
+}
+
+/*
+ * lpm_hist_register: set the histogram where the sampled lookups of the
+ * calling thread are recorded; NULL stops the recording.
+ *
+ * => The histogram is updated only by the thread itself, without any
+ *    synchronisation: the other threads may read it, but the counters
+ *    are not consistent with each other.
+ */
+void
+lpm_hist_register(lpm_hist_t *hist)
+{
+	lpm_hist = hist;
+	lpm_sample_countdown = 0;
+}
+
+/*
+ * lpm_lookup_all: find all matching prefixes given the IP address.
+ *
+ * => The matches are stored from the longest to the shortest prefix,
+ *    including the 0-length default, if set, but no more than the given
+ *    maximum.
+ * => Returns the number of the stored matches.
+ */
+unsigned
+lpm_lookup_all(lpm_t *lpm, const void *addr, size_t len,
+    lpm_match_t *matches, unsigned max)
+{
+	const unsigned nwords = LPM_TO_WORDS(len);
+	unsigned i, n = nwords, count = 0;
+	uint32_t prefix[nwords];
+	void *defval;
+
+	ASSERT(LPM_VALID_LEN(len));
+
+	lpm = lpm_local_replica(lpm);
+	while (n--) {
+		uint32_t bitmask = lpm_bitmask(lpm, len, n);
+
+		while ((i = ffs(bitmask)) != 0) {
+			const unsigned preflen = (32 * n) + (32 - --i);
+			lpm_hmap_t *hmap = &lpm->prefix[preflen];
+			lpm_ent_t *entry;
+			uint32_t hash;
+
+			if (count == max) {
+				return count;
+			}
+			compute_prefix(len, addr, preflen, prefix);
+			hash = lpm_hash(lpm, prefix, len);
+			entry = lpm_bloom_test(hmap, hash) ?
+			    hashmap_lookup_hash(hmap, hash, prefix, len) : NULL;
+			if (entry) {
+				matches[count].val = entry->val;
+				matches[count].preflen = preflen;
+				count++;
+			}
+			bitmask &= ~(1U << i);
+		}
+	}
+	defval = lpm->defvals[len];
+	if (defval && count < max) {
+		matches[count].val = defval;
+		matches[count].preflen = 0;
+		count++;
+	}
+	return count;
+}
+
+/*
+ * lpm_lookup_prefix: return the value associated with a prefix
+ *
+ * => Returns the associated value on success or NULL on failure.
+ */
+void *
+lpm_lookup_prefix(lpm_t *lpm, const void *addr, size_t len, unsigned preflen)
+{
+	lpm_ent_t *entry;
+	ASSERT(LPM_VALID_LEN(len) && preflen <= len * 8);
+
+	lpm = lpm_local_replica(lpm);
+	if (preflen == 0) {
+		return lpm->defvals[len];
+	}
+	entry = lpm_lookup_entry(lpm, addr, len, preflen);
+	if (entry) {
+		return entry->val;
+	}
+	return NULL;
+}
+
+/*
+ * Lookup cache: a small 2-way set-associative cache of the lookup results
+ * keyed by the full address.  It is meant to be private to a thread, i.e.
+ * no synchronisation is performed.  The entries are tagged with the table
+ * generation, so any update of the table invalidates them all.
+ */
+
+typedef struct {
+	uint64_t	gen;
+	void *		val;
+	uint32_t	len;
+	uint32_t	key[LPM_MAX_WORDS];
+} lpm_centry_t;
+
+struct lpm_cache {
+	const lpm_t *	lpm;
+	unsigned	mask;
+	uint64_t	seed[2];
+	uint64_t	hits;
+	uint64_t	misses;
+	lpm_centry_t	entries[];
+};
+
+/*
+ * lpm_cache_create: construct a lookup cache of the given number of
+ * entries, rounded up to a power of two.
+ */
+lpm_cache_t *
+lpm_cache_create(unsigned nentries)
+{
+	lpm_cache_t *cache;
+	unsigned nsets;
+
+	for (nsets = 1; nsets * 2 < nentries; nsets <<= 1) {
+		continue;
+	}
+	cache = calloc(1, offsetof(lpm_cache_t, entries[nsets * 2]));
+	if (cache == NULL) {
+		return NULL;
+	}
+	cache->mask = nsets - 1;
+	lpm_hash_init(cache->seed, 0);
+	return cache;
+}
+
+void
+lpm_cache_destroy(lpm_cache_t *cache)
+{
+	free(cache);
+}
+
+void
+lpm_cache_stats(const lpm_cache_t *cache, uint64_t *hits, uint64_t *misses)
+{
+	*hits = cache->hits;
+	*misses = cache->misses;
+}
+
+/*
+ * lpm_lookup_cached: lpm_lookup() through the given lookup cache.
+ */
+void *
+lpm_lookup_cached(lpm_t *lpm, lpm_cache_t *cache, const void *addr, size_t len)
+{
+	const uint64_t gen = lpm->gen;
+	lpm_centry_t *set, tmp;
+	uint32_t hash;
+	void *val;
+
+	ASSERT(LPM_VALID_LEN(len));
+
+	if (__predict_false(cache->lpm != lpm)) {
+		/* Switched to another table: invalidate all entries. */
+		memset(cache->entries, 0,
+		    (cache->mask + 1) * 2 * sizeof(lpm_centry_t));
+		cache->lpm = lpm;
+	}
+	hash = lpm_hash_seed(cache->seed, addr, len);
+	set = &cache->entries[(hash & cache->mask) * 2];
+
+	for (unsigned i = 0; i < 2; i++) {
+		lpm_centry_t *ce = &set[i];
+
+		if (ce->gen != gen || ce->len != len ||
+		    memcmp(ce->key, addr, len) != 0) {
+			continue;
+		}
+		val = ce->val;
+		if (i) {
+			/* Keep the most recently used entry first. */
+			tmp = set[0];
+			set[0] = set[1];
+			set[1] = tmp;
+		}
+		cache->hits++;
+		return val;
+	}
+	cache->misses++;
+
+	val = lpm_lookup(lpm, addr, len);
+	set[1] = set[0];
+	set[0].gen = gen;
+	set[0].val = val;
+	set[0].len = len;
+	memcpy(set[0].key, addr, len);
+	return val;
+}
+
+/*
+ * lpm_walk: iterate all entries (except the 0-length defaults), calling
+ * the given function with the entry and its prefix length.
+ *
+ * => The function may remove the entry it was given, but not others,
+ *    and must not insert into the table.
+ * => A non-zero return value stops the walk and is passed to the caller.
+ */
+int
+lpm_walk(lpm_t *lpm, int (*func)(lpm_ent_t *, unsigned, void *), void *arg)
+{
+	for (unsigned n = 1; n <= LPM_MAX_PREFIX; n++) {
+		lpm_hmap_t *hmap = &lpm->prefix[n];
+		lpm_hmap_t pinned;
+		int ret = 0;
+
+		/*
+		 * Complete any resize, so there is a single bucket array.
+		 * A snapshot is never modified: its hash maps are settled
+		 * and held by its own reference.  Do not write to it, as it
+		 * may be walked by several threads concurrently.
+		 */
+		if (!lpm->snapshot) {
+			lpm_hashmap_settle(lpm, hmap);
+		}
+
+		/*
+		 * If the hash map is shared, then a removal by the function
+		 * makes a copy and the walk continues in it.  Hold a reference,
+		 * so that the entries being walked stay valid meanwhile.
+		 */
+		pinned = *hmap;
+		if (lpm->snapshot) {
+			pinned.shared = NULL;
+		}
+		if (pinned.shared) {
+			__atomic_add_fetch(pinned.shared, 1, __ATOMIC_RELAXED);
+			lpm->memused += hashmap_memsize(&pinned);
+		}
+		for (unsigned i = 0; i < hmap->hashsize && !ret; i++) {
+			lpm_ent_t *entry = hmap->bucket[i];
+
+			while (entry && !ret) {
+				lpm_ent_t *next = entry->next;
+
+				ret = func(entry, n, arg);
+				entry = next;
+			}
+		}
+		if (pinned.shared) {
+			hashmap_destroy(lpm, &pinned, NULL, NULL);
+		}
+		if (ret) {
+			return ret;
+		}
+	}
+	return 0;
+}
+
+typedef struct {
+	lpm_t *		lpm;
+	lpm_t *		other;
+	lpm_diff_t	func;
+	void *		arg;
+	lpm_dtor_t	dtor;
+	void *		dtor_arg;
+} lpm_diff_ctx_t;
+
+static int
+lpm_diff_removed(lpm_ent_t *entry, unsigned preflen, void *arg)
+{
+	lpm_diff_ctx_t *ctx = arg;
+	lpm_ent_t *other;
+
+	other = hashmap_lookup(ctx->other, &ctx->other->prefix[preflen],
+	    entry->key, entry->len);
+	if (other == NULL) {
+		return ctx->func(ctx->arg, LPM_DIFF_REMOVE,
+		    entry->key, entry->len, preflen, entry->val, NULL);
+	}
+	if (other->val != entry->val) {
+		return ctx->func(ctx->arg, LPM_DIFF_CHANGE,
+		    entry->key, entry->len, preflen, entry->val, other->val);
+	}
+	return 0;
+}
+
+static int
+lpm_diff_added(lpm_ent_t *entry, unsigned preflen, void *arg)
+{
+	lpm_diff_ctx_t *ctx = arg;
+
+	if (hashmap_lookup(ctx->other, &ctx->other->prefix[preflen],
+	    entry->key, entry->len) == NULL) {
+		return ctx->func(ctx->arg, LPM_DIFF_ADD,
+		    entry->key, entry->len, preflen, NULL, entry->val);
+	}
+	return 0;
+}
+
+/*
+ * lpm_diff: compute the difference between the two LPM tables, calling
+ * the given function for every prefix which has to be added, removed
+ * or changed in the old table to make it identical to the new one.
+ *
+ * => Values are compared by the pointer identity.
+ * => The function must not modify either table.
+ * => Returns 0 on success or the non-zero value the function returned.
+ */
+int
+lpm_diff(lpm_t *old, lpm_t *new, lpm_diff_t func, void *arg)
+{
+	lpm_diff_ctx_t ctx = { .func = func, .arg = arg };
+	int ret;
+
+	for (unsigned len = 1; len <= LPM_MAX_KEYLEN; len++) {
+		void *oval = old->defvals[len];
+		void *nval = new->defvals[len];
+		unsigned op;
+
+		if (oval == nval) {
+			continue;
+		}
+		op = !oval ? LPM_DIFF_ADD :
+		    (!nval ? LPM_DIFF_REMOVE : LPM_DIFF_CHANGE);
+		if ((ret = func(arg, op, zero_address, len, 0, oval, nval)) != 0) {
+			return ret;
+		}
+	}
+
+	ctx.other = new;
+	if ((ret = lpm_walk(old, lpm_diff_removed, &ctx)) != 0) {
+		return ret;
+	}
+	ctx.other = old;
+	return lpm_walk(new, lpm_diff_added, &ctx);
+}
+
+static int
+lpm_apply_removed(lpm_ent_t *entry, unsigned preflen, void *arg)
+{
+	lpm_diff_ctx_t *ctx = arg;
+	lpm_t *dst = ctx->lpm;
+	lpm_ent_t *other;
+	uint8_t key[LPM_MAX_KEYLEN];
+	unsigned len;
+	void *val;
+
+	/*
+	 * Note: the walk is over the destination table, therefore update
+	 * the value in-place; the insert path might rehash the table.
+	 *
+	 * The destructor is called only once the old value is no longer
+	 * reachable: the update may fail (e.g. cloning a map shared with
+	 * a snapshot), leaving the value in the table.
+	 */
+	other = hashmap_lookup(ctx->other, &ctx->other->prefix[preflen],
+	    entry->key, entry->len);
+	if (other == NULL) {
+		len = entry->len;
+		val = entry->val;
+		memcpy(key, entry->key, len);
+		if (lpm_remove(dst, key, len, preflen) != 0) {
+			return -1;
+		}
+		if (ctx->dtor) {
+			ctx->dtor(ctx->dtor_arg, key, len, val);
+		}
+		return 0;
+	}
+	if (other->val != entry->val) {
+		val = entry->val;
+		dst->gen = lpm_gen_next();
+		for (unsigned i = 0; i < LPM_NREPLICAS(dst); i++) {
+			lpm_t *replica = LPM_REPLICA(dst, i);
+
+			/* The entry may be shared with a snapshot. */
+			if (!lpm_hashmap_own(replica, &replica->prefix[preflen])) {
+				return -1;
+			}
+			entry = lpm_lookup_entry(replica,
+			    other->key, other->len, preflen);
+			entry->val = other->val;
+		}
+		if (ctx->dtor) {
+			ctx->dtor(ctx->dtor_arg, other->key, other->len, val);
+		}
+	}
+	return 0;
+}
+
+static int
+lpm_apply_added(lpm_ent_t *entry, unsigned preflen, void *arg)
+{
+	lpm_diff_ctx_t *ctx = arg;
+	lpm_t *dst = ctx->lpm;
+
+	if (hashmap_lookup(dst, &dst->prefix[preflen],
+	    entry->key, entry->len) != NULL) {
+		return 0;
+	}
+	return lpm_insert(dst, entry->key, entry->len, preflen, entry->val);
+}
+
+/*
+ * lpm_apply_diff: update the destination table to be identical to the
+ * source table, performing only the necessary insertions and removals.
+ * The destructor, if not NULL, is called for every value which is being
+ * removed or replaced in the destination table.
+ *
+ * => Values are compared by the pointer identity.
+ * => Returns 0 on success or -1 on failure (the destination table may
+ *    be partially updated in such case).
+ */
+int
+lpm_apply_diff(lpm_t *dst, lpm_t *src, lpm_dtor_t dtor, void *arg)
+{
+	lpm_diff_ctx_t ctx = {
+		.lpm = dst, .other = src, .dtor = dtor, .dtor_arg = arg
+	};
+
+	for (unsigned len = 1; len <= LPM_MAX_KEYLEN; len++) {
+		if (dst->defvals[len] == src->defvals[len]) {
+			continue;
+		}
+		if (dtor && dst->defvals[len]) {
+			dtor(arg, zero_address, len, dst->defvals[len]);
+		}
+		lpm_insert(dst, zero_address, len, 0, src->defvals[len]);
+	}
+
+	/* First, the removals and changes; then, the additions. */
+	if (lpm_walk(dst, lpm_apply_removed, &ctx) != 0) {
+		return -1;
+	}
+	if (lpm_walk(src, lpm_apply_added, &ctx) != 0) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Route aggregation using the Optimal Routing Table Constructor (ORTC)
+ * algorithm by Draves et al.  A binary trie is built for each address
+ * family and then processed in three passes:
+ *
+ * 1) Normalisation: every node gets either zero or two children, where
+ *    the added leaves inherit the value of the closest prefix above.
+ * 2) Post-order: each leaf gets the set of its single value; each inner
+ *    node gets the intersection of its children sets, if non-empty, or
+ *    their union otherwise.
+ * 3) Pre-order: a node emits a prefix only if the value inherited from
+ *    the parent is not in its set.
+ *
+ * The absence of a route is represented by the NULL value, matching the
+ * lpm_lookup() semantics; therefore NULL values may be emitted to shadow
+ * the shorter prefixes.
+ */
+
+typedef struct lpm_onode {
+	struct lpm_onode *child[2];
+	void *		val;
+	bool		has_val;
+	unsigned	nset;
+	void **		set;
+} lpm_onode_t;
+
+typedef struct {
+	lpm_cmp_t	cmp;
+	void *		arg;
+	lpm_onode_t *	root;
+	size_t		len;
+	lpm_t *		out;
+	bool		failed;
+} lpm_ortc_t;
+
+static inline bool
+ortc_equal(const lpm_ortc_t *ortc, const void *a, const void *b)
+{
+	if (a == b) {
+		return true;
+	}
+	return ortc->cmp && a && b && ortc->cmp(ortc->arg, a, b) == 0;
+}
+
+static bool
+ortc_set_has(const lpm_ortc_t *ortc, const lpm_onode_t *node, const void *val)
+{
+	for (unsigned i = 0; i < node->nset; i++) {
+		if (ortc_equal(ortc, node->set[i], val)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static lpm_onode_t *
+ortc_node_alloc(void)
+{
+	return calloc(1, sizeof(lpm_onode_t));
+}
+
+static void
+ortc_node_free(lpm_onode_t *node)
+{
+	if (node == NULL) {
+		return;
+	}
+	ortc_node_free(node->child[0]);
+	ortc_node_free(node->child[1]);
+	free(node->set);
+	free(node);
+}
+
+static int
+ortc_add_prefix(lpm_ent_t *entry, unsigned preflen, void *arg)
+{
+	lpm_ortc_t *ortc = arg;
+	lpm_onode_t *node = ortc->root;
+
+	if (entry->len != ortc->len) {
+		return 0;
+	}
+	for (unsigned i = 0; i < preflen; i++) {
+		const unsigned bit = (entry->key[i >> 3] >> (7 - (i & 7))) & 1;
+
+		if (node->child[bit] == NULL &&
+		    (node->child[bit] = ortc_node_alloc()) == NULL) {
+			return -1;
+		}
+		node = node->child[bit];
+	}
+	node->val = entry->val;
+	node->has_val = true;
+	return 0;
+}
+
+static int
+ortc_keylen(lpm_ent_t *entry, unsigned preflen, void *arg)
+{
+	uint64_t *keylens = arg;
+
+	*keylens |= UINT64_C(1) << entry->len;
+	(void)preflen;
+	return 0;
+}
+
+/*
+ * ortc_merge: the second pass, including the normalisation.
+ */
+static bool
+ortc_merge(lpm_ortc_t *ortc, lpm_onode_t *node, void *inherited)
+{
+	lpm_onode_t *c0, *c1;
+
+	if (node->has_val) {
+		inherited = node->val;
+	}
+	if (!node->child[0] && !node->child[1]) {
+		if ((node->set = malloc(sizeof(void *))) == NULL) {
+			return false;
+		}
+		node->set[0] = inherited;
+		node->nset = 1;
+		return true;
+	}
+	for (unsigned i = 0; i < 2; i++) {
+		if (!node->child[i] &&
+		    (node->child[i] = ortc_node_alloc()) == NULL) {
+			return false;
+		}
+		if (!ortc_merge(ortc, node->child[i], inherited)) {
+			return false;
+		}
+	}
+	c0 = node->child[0];
+	c1 = node->child[1];
+
+	node->set = malloc((c0->nset + c1->nset) * sizeof(void *));
+	if (node->set == NULL) {
+		return false;
+	}
+	for (unsigned i = 0; i < c0->nset; i++) {
+		if (ortc_set_has(ortc, c1, c0->set[i])) {
+			node->set[node->nset++] = c0->set[i];
+		}
+	}
+	if (node->nset) {
+		return true;
+	}
+	for (unsigned i = 0; i < c0->nset; i++) {
+		node->set[node->nset++] = c0->set[i];
+	}
+	for (unsigned i = 0; i < c1->nset; i++) {
+		if (!ortc_set_has(ortc, c0, c1->set[i])) {
+			node->set[node->nset++] = c1->set[i];
+		}
+	}
+	return true;
+}
+
+/*
+ * ortc_select: the third pass, emitting the prefixes into the output.
+ */
+static void
+ortc_select(lpm_ortc_t *ortc, lpm_onode_t *node, uint8_t *key,
+    unsigned depth, void *inherited)
+{
+	if (depth == 0 || !ortc_set_has(ortc, node, inherited)) {
+		inherited = node->set[0];
+		if (lpm_insert(ortc->out, key, ortc->len, depth, inherited)) {
+			ortc->failed = true;
+			return;
+		}
+	}
+	for (unsigned i = 0; i < 2; i++) {
+		const unsigned byte = depth >> 3, bit = 0x80 >> (depth & 7);
+
+		if (node->child[i] == NULL) {
+			continue;
+		}
+		key[byte] = i ? (key[byte] | bit) : (key[byte] & ~bit);
+		ortc_select(ortc, node->child[i], key, depth + 1, inherited);
+		key[byte] &= ~bit;
+	}
+}
+
+/*
+ * The distinct values of a table, sorted by the pointer, each with the
+ * key of one of its prefixes: used to release the values dropped by the
+ * optimisation once it is complete.
+ */
+
+typedef struct {
+	void *		val;
+	unsigned	len;
+	uint8_t		key[LPM_MAX_KEYLEN];
+} ortc_val_t;
+
+typedef struct {
+	ortc_val_t *	vals;
+	size_t		n;
+} ortc_vals_t;
+
+static void
+ortc_vals_add(ortc_vals_t *vals, const void *key, unsigned len, void *val)
+{
+	ortc_val_t *v = &vals->vals[vals->n++];
+
+	v->val = val;
+	v->len = len;
+	memcpy(v->key, key, len);
+}
+
+static int
+ortc_vals_walk(lpm_ent_t *entry, unsigned preflen, void *arg)
+{
+	if (entry->val) {
+		ortc_vals_add(arg, entry->key, entry->len, entry->val);
+	}
+	(void)preflen;
+	return 0;
+}
+
+static int
+ortc_val_cmp(const void *p1, const void *p2)
+{
+	const uintptr_t a = (uintptr_t)((const ortc_val_t *)p1)->val;
+	const uintptr_t b = (uintptr_t)((const ortc_val_t *)p2)->val;
+
+	return (a > b) - (a < b);
+}
+
+static bool
+ortc_vals_collect(lpm_t *lpm, ortc_vals_t *vals)
+{
+	size_t n = LPM_MAX_KEYLEN, k = 0;
+
+	for (unsigned p = 1; p <= LPM_MAX_PREFIX; p++) {
+		n += lpm->prefix[p].nitems;
+	}
+	if ((vals->vals = malloc(n * sizeof(ortc_val_t))) == NULL) {
+		return false;
+	}
+	vals->n = 0;
+	for (unsigned len = 1; len <= LPM_MAX_KEYLEN; len++) {
+		if (lpm->defvals[len]) {
+			ortc_vals_add(vals, zero_address, len,
+			    lpm->defvals[len]);
+		}
+	}
+	lpm_walk(lpm, ortc_vals_walk, vals);
+	ASSERT(vals->n <= n);
+
+	/* Sort and keep a single occurrence of each value. */
+	qsort(vals->vals, vals->n, sizeof(ortc_val_t), ortc_val_cmp);
+	for (size_t i = 0; i < vals->n; i++) {
+		if (k == 0 || vals->vals[i].val != vals->vals[k - 1].val) {
+			vals->vals[k++] = vals->vals[i];
+		}
+	}
+	vals->n = k;
+	return true;
+}
+
+/*
+ * lpm_optimize: replace the table contents with a semantically equivalent
+ * set of the minimum number of prefixes, i.e. lpm_lookup() returns the
+ * same (or equivalent) value for any address.
+ *
+ * => The values are compared using the given function, which must return
+ *    zero if the values are equivalent, or by the pointer identity if NULL.
+ * => The destructor, if not NULL, is called once for each value which is
+ *    no longer in the table (i.e. merged into an equivalent value), with
+ *    the key of one of its prefixes, after the table is updated.
+ * => Returns 0 on success or -1 on failure.
+ */
+int
+lpm_optimize(lpm_t *lpm, lpm_cmp_t cmp, lpm_dtor_t dtor, void *arg)
+{
+	lpm_ortc_t ortc = { .cmp = cmp, .arg = arg };
+	ortc_vals_t old = { NULL, 0 }, kept = { NULL, 0 };
+	uint64_t keylens = 0;
+	int ret = -1;
+
+	/* Build a trie for each key length in use. */
+	lpm_walk(lpm, ortc_keylen, &keylens);
+	for (unsigned len = 1; len <= LPM_MAX_KEYLEN; len++) {
+		if (lpm->defvals[len]) {
+			keylens |= UINT64_C(1) << len;
+		}
+	}
+
+	if ((ortc.out = lpm_create()) == NULL) {
+		return -1;
+	}
+	for (unsigned len = 1; len <= LPM_MAX_KEYLEN; len++) {
+		uint32_t key[LPM_MAX_WORDS] = { 0 };
+
+		if ((keylens & (UINT64_C(1) << len)) == 0) {
+			continue;
+		}
+		if ((ortc.root = ortc_node_alloc()) == NULL) {
+			goto out;
+		}
+		ortc.len = len;
+		ortc.root->val = lpm->defvals[len];
+		ortc.root->has_val = true;
+
+		if (lpm_walk(lpm, ortc_add_prefix, &ortc) != 0 ||
+		    !ortc_merge(&ortc, ortc.root, NULL)) {
+			ortc_node_free(ortc.root);
+			goto out;
+		}
+		ortc_select(&ortc, ortc.root, (uint8_t *)key, 0, NULL);
+		ortc_node_free(ortc.root);
+		if (ortc.failed) {
+			goto out;
+		}
+	}
+	if (dtor && (!ortc_vals_collect(lpm, &old) ||
+	    !ortc_vals_collect(ortc.out, &kept))) {
+		goto out;
+	}
+	if ((ret = lpm_apply_diff(lpm, ortc.out, NULL, NULL)) != 0) {
+		/* Partially updated: the values may still be referenced. */
+		goto out;
+	}
+	for (size_t i = 0; i < old.n; i++) {
+		const ortc_val_t *v = &old.vals[i];
+
+		if (!bsearch(v, kept.vals, kept.n,
+		    sizeof(ortc_val_t), ortc_val_cmp)) {
+			dtor(arg, v->key, v->len, v->val);
+		}
+	}
+out:
+	free(old.vals);
+	free(kept.vals);
+	lpm_destroy(ortc.out);
+	return ret;
+}
+
+static int
+compact_entry_cmp(const void *p1, const void *p2)
 {
-	lpm_clear(lpm, NULL, NULL);
-	free(lpm);
+	const lpm_ent_t *a = *(lpm_ent_t * const *)p1;
+	const lpm_ent_t *b = *(lpm_ent_t * const *)p2;
+
+	if (a->len != b->len) {
+		return a->len < b->len ? -1 : 1;
+	}
+	return memcmp(a->key, b->key, a->len);
 }
 
 /*
- * fnv1a_hash: Fowler-Noll-Vo hash function (FNV-1a variant).
+ * hashmap_compact: move the entries of the hash map into a single slab,
+ * in the key order, and right-size the bucket array.
  */
-static uint32_t
-fnv1a_hash(const void *buf, size_t len)
+static bool
+hashmap_compact(lpm_t *lpm, lpm_hmap_t *hmap)
 {
-	uint32_t hash = 2166136261UL;
-	const uint8_t *p = buf;
+	const unsigned nitems = hmap->nitems;
+	lpm_ent_t **entries, **bucket;
+	unsigned hashsize, target, k = 0;
+	lpm_slab_t *slab;
+	size_t size, off;
 
-	while (len--) {
-		hash ^= *p++;
-		hash *= 16777619U;
+	if (!lpm_hashmap_own(lpm, hmap)) {
+		return false;
 	}
-	return hash;
-}
-
-static bool
-hashmap_rehash(lpm_hmap_t *hmap, unsigned size)
-{
-	lpm_ent_t **bucket;
-	unsigned hashsize;
+	lpm_hashmap_settle(lpm, hmap);
+	if (nitems == 0) {
+		/* Just release the bucket array left by the removals. */
+		lpm_hashmap_free(lpm, hmap->bucket,
+		    hmap->hashsize * sizeof(lpm_ent_t *));
+		hmap->bucket = NULL;
+		hmap->hashsize = 0;
+		return true;
+	}
+	if ((entries = malloc(nitems * sizeof(lpm_ent_t *))) == NULL) {
+		return false;
+	}
+	size = LPM_SLAB_ALIGN(sizeof(lpm_slab_t));
+	for (unsigned i = 0; i < hmap->hashsize; i++) {
+		for (lpm_ent_t *e = hmap->bucket[i]; e; e = e->next) {
+			size += LPM_SLAB_ALIGN(offsetof(lpm_ent_t, key[e->len]));
+			entries[k++] = e;
+		}
+	}
+	ASSERT(k == nitems);
+	qsort(entries, nitems, sizeof(lpm_ent_t *), compact_entry_cmp);
 
-	for (hashsize = 1; hashsize < size; hashsize <<= 1) {
+	target = lpm_hashmap_size(lpm, nitems + LPM_HASH_STEP);
+	for (hashsize = 1; hashsize < target; hashsize <<= 1) {
 		continue;
 	}
-	if ((bucket = calloc(1, hashsize * sizeof(lpm_ent_t *))) == NULL) {
+	bucket = lpm_hashmap_alloc(lpm, hashsize * sizeof(lpm_ent_t *), true);
+	slab = bucket ? lpm_hashmap_alloc(lpm, size, false) : NULL;
+	if (bucket == NULL || slab == NULL) {
+		lpm_hashmap_free(lpm, bucket, hashsize * sizeof(lpm_ent_t *));
+		lpm_hashmap_free(lpm, slab, size);
+		free(entries);
 		return false;
 	}
-	for (unsigned n = 0; n < hmap->hashsize; n++) {
-		lpm_ent_t *list = hmap->bucket[n];
 
-		while (list) {
-			lpm_ent_t *entry = list;
-			uint32_t hash = fnv1a_hash(entry->key, entry->len);
-			const unsigned i = hash & (hashsize - 1);
+	/*
+	 * Copy the entries and insert them in the reverse order, so that
+	 * the chains are also in the key order.
+	 */
+	off = LPM_SLAB_ALIGN(sizeof(lpm_slab_t));
+	for (unsigned i = 0; i < nitems; i++) {
+		const size_t entlen = offsetof(lpm_ent_t, key[entries[i]->len]);
+		lpm_ent_t *old = entries[i];
 
-			list = entry->next;
-			entry->next = bucket[i];
-			bucket[i] = entry;
-		}
+		entries[i] = (lpm_ent_t *)((uint8_t *)slab + off);
+		memcpy(entries[i], old, entlen);
+		lpm_hashmap_free_entry(lpm, hmap, old);
+		off += LPM_SLAB_ALIGN(entlen);
 	}
+	for (unsigned i = nitems; i-- > 0;) {
+		lpm_ent_t *entry = entries[i];
+		const unsigned n = hashmap_index(lpm, entry, hashsize);
+
+		entry->next = bucket[n];
+		bucket[n] = entry;
+	}
+	free(entries);
+
+	ASSERT(hmap->slab == NULL && hmap->entsize == 0);
+	slab->size = size;
+	slab->nitems = nitems;
+	hmap->slab = slab;
+	hmap->entsize = size;
+
+	lpm_hashmap_free(lpm, hmap->bucket, hmap->hashsize * sizeof(lpm_ent_t *));
 	hmap->hashsize = hashsize;
-	free(hmap->bucket); // may be NULL
 	hmap->bucket = bucket;
 	return true;
 }
 
-static lpm_ent_t *
-hashmap_insert(lpm_hmap_t *hmap, const void *key, size_t len)
+/*
+ * lpm_reserve: pre-size the hash map of the given prefix length for the
+ * given number of prefixes, e.g. for the /24 or /48 tables known to be
+ * large.  The key lengths share the hash map of a prefix length.
+ *
+ * => Returns 0 on success or -1 on failure.
+ */
+int
+lpm_reserve(lpm_t *lpm, size_t len, unsigned preflen, unsigned n)
 {
-	const unsigned target = hmap->nitems + LPM_HASH_STEP;
-	const size_t entlen = offsetof(lpm_ent_t, key[len]);
-	uint32_t hash, i;
-	lpm_ent_t *entry;
+	ASSERT(LPM_VALID_LEN(len) && preflen <= len * 8);
+	(void)len;
 
-	if (hmap->hashsize < target && !hashmap_rehash(hmap, target)) {
-		return NULL;
+	if (preflen == 0) {
+		return 0;
 	}
+	for (unsigned r = 0; r < LPM_NREPLICAS(lpm); r++) {
+		lpm_t *replica = LPM_REPLICA(lpm, r);
+		lpm_hmap_t *hmap = &replica->prefix[preflen];
 
-	hash = fnv1a_hash(key, len);
-	i = hash & (hmap->hashsize - 1);
-	entry = hmap->bucket[i];
-	while (entry) {
-		if (entry->len == len && memcmp(entry->key, key, len) == 0) {
-			return entry;
+		lpm_hashmap_settle(replica, hmap);
+		if (!lpm_hashmap_reserve(replica, hmap, n)) {
+			return -1;
 		}
-		entry = entry->next;
-	}
-
-	if ((entry = malloc(entlen)) != NULL) {
-		memcpy(entry->key, key, len);
-		entry->next = hmap->bucket[i];
-		entry->len = len;
-
-		hmap->bucket[i] = entry;
-		hmap->nitems++;
 	}
-	return entry;
+	return 0;
 }
 
-static lpm_ent_t *
-hashmap_lookup(lpm_hmap_t *hmap, const void *key, size_t len)
+/*
+ * lpm_memory_usage: the number of bytes of the hash maps of the table,
+ * i.e. the bucket arrays, the entries and the Bloom filters, summed over
+ * the replicas.  If the array is given, break them down by the prefix
+ * length, up to the given number of its elements.
+ *
+ * => The memory shared with the snapshots is accounted to each of them.
+ * => The allocator overhead is not included.
+ */
+size_t
+lpm_memory_usage(lpm_t *lpm, lpm_memuse_t *usage, unsigned n)
 {
-	const uint32_t hash = fnv1a_hash(key, len);
-	const unsigned i = hash & (hmap->hashsize - 1);
-	lpm_ent_t *entry;
+	size_t total = 0;
 
-	if (hmap->hashsize == 0) {
-		return NULL;
+	if (usage) {
+		memset(usage, 0, n * sizeof(lpm_memuse_t));
 	}
-	entry = hmap->bucket[i];
+	for (unsigned r = 0; r < LPM_NREPLICAS(lpm); r++) {
+		const lpm_t *replica = LPM_REPLICA(lpm, r);
 
-	while (entry) {
-		if (entry->len == len && memcmp(entry->key, key, len) == 0) {
-			return entry;
+		total += replica->memused;
+		if (usage == NULL) {
+			continue;
+		}
+		for (unsigned p = 1; p < n && p <= LPM_MAX_PREFIX; p++) {
+			const lpm_hmap_t *hmap = &replica->prefix[p];
+
+			usage[p].buckets += (size_t)(hmap->hashsize +
+			    hmap->oldsize) * sizeof(lpm_ent_t *);
+			usage[p].entries += hmap->entsize;
+			usage[p].filters += hmap->bloomsize * sizeof(uint64_t);
 		}
-		entry = entry->next;
 	}
-	return NULL;
+	return total;
 }
 
-static int
-hashmap_remove(lpm_hmap_t *hmap, const void *key, size_t len)
+/*
+ * lpm_memory_estimate: the number of bytes the table would grow by with
+ * the given number of the new prefixes of the given key and prefix
+ * length, replaying the growth of the hash map (and its filter).
+ *
+ * => An upper bound if some of the prefixes are already in the table.
+ * => The old bucket array is retained during a resize, not counted.
+ */
+size_t
+lpm_memory_estimate(lpm_t *lpm, size_t len, unsigned preflen, unsigned n)
 {
-	const uint32_t hash = fnv1a_hash(key, len);
-	const unsigned i = hash & (hmap->hashsize - 1);
-	lpm_ent_t *prev = NULL, *entry;
+	const lpm_hmap_t *hmap = &lpm->prefix[preflen];
+	const uint64_t nitems = (uint64_t)hmap->nitems + n;
+	unsigned hashsize = hmap->hashsize;
+	size_t bytes;
 
-	if (hmap->hashsize == 0) {
-		return -1;
+	ASSERT(LPM_VALID_LEN(len) && preflen <= len * 8);
+	if (preflen == 0 || n == 0) {
+		return 0;
 	}
-	entry = hmap->bucket[i];
+	bytes = (size_t)n * offsetof(lpm_ent_t, key[len]);
 
-	while (entry) {
-		if (entry->len == len && memcmp(entry->key, key, len) == 0) {
-			if (prev) {
-				prev->next = entry->next;
-			} else {
-				hmap->bucket[i] = entry->next;
-			}
-			free(entry);
-			return 0;
+	/* A shared hash map is copied first, see lpm_hashmap_own(). */
+	if (hmap->shared && __atomic_load_n(hmap->shared,
+	    __ATOMIC_ACQUIRE) > 1) {
+		bytes += hashmap_memsize(hmap);
+	}
+	while (nitems * 100 > (uint64_t)hashsize * lpm->max_load &&
+	    hashsize < (1U << 31)) {
+		/* The resize at the first item over the load factor. */
+		const unsigned at = (uint64_t)hashsize * lpm->max_load / 100;
+		unsigned size = lpm_hashmap_size(lpm, at + 1), newsize;
+
+		if (size < (hashsize << lpm->growth_shift)) {
+			size = hashsize << lpm->growth_shift;
+		}
+		for (newsize = 1; newsize < size; newsize <<= 1) {
+			continue;
 		}
-		prev = entry;
-		entry = entry->next;
+		hashsize = newsize;
 	}
-	return -1;
+	bytes += (size_t)(hashsize - hmap->hashsize) * sizeof(lpm_ent_t *);
+
+	if ((lpm->flags & LPM_F_BLOOM) != 0) {
+		unsigned size = LPM_BLOOM_MINSIZE;
+
+		while ((uint64_t)size * 64 < nitems * LPM_BLOOM_BITS) {
+			size <<= 1;
+		}
+		if (size > hmap->bloomsize) {
+			bytes += (size_t)(size - hmap->bloomsize) *
+			    sizeof(uint64_t);
+		}
+	}
+	return bytes * LPM_NREPLICAS(lpm);
 }
 
 /*
- * compute_prefix: given the address and prefix length, compute and
- * return the address prefix.
+ * lpm_compact: reallocate the entries of each hash map contiguously, in
+ * the key order, and right-size the bucket arrays, e.g. after a heavy
+ * churn.  This improves the cache locality of the lookups and releases
+ * the memory.
+ *
+ * => Same as the other updates, must be serialised with the lookups.
+ * => Returns 0 on success or -1 on failure (the table stays valid).
  */
-static inline void
-compute_prefix(const unsigned nwords, const uint32_t *addr,
-    unsigned preflen, uint32_t *prefix)
+int
+lpm_compact(lpm_t *lpm)
 {
-	uint32_t addr2[4];
+	for (unsigned r = 0; r < LPM_NREPLICAS(lpm); r++) {
+		lpm_t *replica = LPM_REPLICA(lpm, r);
 
-	if ((uintptr_t)addr & 3) {
-		/* Unaligned address: just copy for now. */
-		memcpy(addr2, addr, nwords * 4);
-		addr = addr2;
-	}
-	for (unsigned i = 0; i < nwords; i++) {
-		if (preflen == 0) {
-			prefix[i] = 0;
-			continue;
-		}
-		if (preflen < 32) {
-			uint32_t mask = htonl(0xffffffff << (32 - preflen));
-			prefix[i] = addr[i] & mask;
-			preflen = 0;
-		} else {
-			prefix[i] = addr[i];
-			preflen -= 32;
+		for (unsigned n = 1; n <= LPM_MAX_PREFIX; n++) {
+			lpm_hmap_t *hmap = &replica->prefix[n];
+
+			if (!hashmap_compact(replica, hmap)) {
+				return -1;
+			}
+			if (hmap->bloomstale) {
+				/* Also drop the stale bits of the filter. */
+				lpm_bloom_rebuild(replica, hmap);
+			}
 		}
 	}
+#ifdef __GLIBC__
+	/* Return the freed memory to the OS. */
+	malloc_trim(0);
+#endif
+	return 0;
 }
 
 /*
- * lpm_insert: insert the CIDR into the LPM table.
- *
- * => Returns zero on success and -1 on failure.
+ * hashmap_clone: copy the hash map with its entries and the filter,
+ * preserving the layout of the buckets.
  */
-int
-lpm_insert(lpm_t *lpm, const void *addr,
-    size_t len, unsigned preflen, void *val)
+static bool
+hashmap_clone(lpm_t *lpm, const lpm_hmap_t *hmap, lpm_hmap_t *copy)
 {
-	const unsigned nwords = LPM_TO_WORDS(len);
-	uint32_t prefix[nwords];
-	lpm_ent_t *entry;
-	ASSERT(len == 4 || len == 16);
+	memset(copy, 0, sizeof(lpm_hmap_t));
+	ASSERT(hmap->oldbucket == NULL);
 
-	if (preflen == 0) {
-		/* 0-length prefix is a special case. */
-		lpm->defvals[LPM_LEN_IDX(len)] = val;
-		return 0;
+	copy->bucket = lpm_hashmap_alloc(lpm,
+	    hmap->hashsize * sizeof(lpm_ent_t *), true);
+	if (copy->bucket == NULL) {
+		return false;
 	}
-	compute_prefix(nwords, addr, preflen, prefix);
-	entry = hashmap_insert(&lpm->prefix[preflen], prefix, len);
-	if (entry) {
-		const unsigned n = --preflen >> 5;
-		lpm->bitmask[n] |= 0x80000000U >> (preflen & 31);
-		entry->val = val;
-		return 0;
+	copy->hashsize = hmap->hashsize;
+	for (unsigned i = 0; i < hmap->hashsize; i++) {
+		lpm_ent_t **tail = &copy->bucket[i];
+
+		for (lpm_ent_t *e = hmap->bucket[i]; e; e = e->next) {
+			const size_t entlen = offsetof(lpm_ent_t, key[e->len]);
+			lpm_ent_t *entry;
+
+			entry = lpm_hashmap_alloc(lpm, entlen, false);
+			if (entry == NULL) {
+				goto err;
+			}
+			memcpy(entry, e, entlen);
+			copy->entsize += entlen;
+			entry->next = NULL;
+			*tail = entry;
+			tail = &entry->next;
+			copy->nitems++;
+		}
 	}
-	return -1;
+	if (hmap->bloom) {
+		const size_t size = hmap->bloomsize * sizeof(uint64_t);
+
+		copy->bloom = lpm_hashmap_alloc(lpm, size, false);
+		if (copy->bloom == NULL) {
+			goto err;
+		}
+		memcpy(copy->bloom, hmap->bloom, size);
+		copy->bloomsize = hmap->bloomsize;
+		copy->bloomstale = hmap->bloomstale;
+	}
+	return true;
+err:
+	hashmap_destroy(lpm, copy, NULL, NULL);
+	return false;
 }
 
 /*
- * lpm_remove: remove the specified prefix.
+ * lpm_hashmap_own: make the hash map private to the table before it is
+ * modified, i.e. copy it if it is shared with a snapshot.
+ *
+ * => Returns false on failure (the hash map stays shared).
  */
-int
-lpm_remove(lpm_t *lpm, const void *addr, size_t len, unsigned preflen)
+bool
+lpm_hashmap_own(lpm_t *lpm, lpm_hmap_t *hmap)
 {
-	const unsigned nwords = LPM_TO_WORDS(len);
-	uint32_t prefix[nwords];
-	ASSERT(len == 4 || len == 16);
+	lpm_hmap_t copy;
 
-	if (preflen == 0) {
-		lpm->defvals[LPM_LEN_IDX(len)] = NULL;
-		return 0;
+	if (hmap->shared == NULL) {
+		return true;
+	}
+	if (__atomic_load_n(hmap->shared, __ATOMIC_ACQUIRE) == 1) {
+		/* The snapshots were released: this is the last reference. */
+		free(hmap->shared);
+		hmap->shared = NULL;
+		return true;
+	}
+	if (!hashmap_clone(lpm, hmap, &copy)) {
+		return false;
 	}
-	compute_prefix(nwords, addr, preflen, prefix);
-	return hashmap_remove(&lpm->prefix[preflen], prefix, len);
+	if (hashmap_unshare(hmap)) {
+		/* The snapshots were released meanwhile. */
+		hashmap_destroy(lpm, hmap, NULL, NULL);
+	} else {
+		/* The snapshots keep it: no longer accounted here. */
+		lpm->memused -= hashmap_memsize(hmap);
+	}
+	*hmap = copy;
+	return true;
 }
 
 /*
- * lpm_lookup: find the longest matching prefix given the IP address.
+ * lpm_snapshot: take a read-only, point-in-time view of the table.
  *
- * => Returns the associated value on success or NULL on failure.
+ * The snapshot is an LPM object sharing the hash maps with the table:
+ * a hash map of a prefix length is copied by the table on its first
+ * modification (copy-on-write), while the snapshot keeps the original.
+ * Therefore, taking a snapshot is cheap and the memory is duplicated
+ * only for the prefix lengths which are modified.
+ *
+ * => Same as the updates, must be serialised with the updates of the
+ *    table.  The snapshot itself is never modified, therefore it can
+ *    be used by any thread (e.g. lpm_lookup, lpm_diff or the builds of
+ *    the other lookup structures), concurrently with the updates.
+ * => The values are shared: they must stay valid while referenced by
+ *    a snapshot, even if removed from the table.
+ * => Not supported for the replicated tables (LPM_F_NUMA), including
+ *    a single replica: its entries are in the node-local chunks.
+ * => Returns the snapshot or NULL on failure.
  */
-void *
-lpm_lookup(lpm_t *lpm, const void *addr, size_t len)
+lpm_t *
+lpm_snapshot(lpm_t *lpm)
 {
-	const unsigned nwords = LPM_TO_WORDS(len);
-	unsigned i, n = nwords;
-	uint32_t prefix[nwords];
+	lpm_t *snap;
 
-	while (n--) {
-		uint32_t bitmask = lpm->bitmask[n];
+	if (lpm->node >= 0 || lpm->nreplicas != 0) {
+		return NULL;
+	}
+	if ((snap = calloc(1, sizeof(lpm_t))) == NULL) {
+		return NULL;
+	}
+	memcpy(snap->bitmask, lpm->bitmask, sizeof(lpm->bitmask));
+	memcpy(snap->defvals, lpm->defvals, sizeof(lpm->defvals));
+	memcpy(snap->seed, lpm->seed, sizeof(lpm->seed));
+	memcpy(snap->mapped, lpm->mapped, sizeof(lpm->mapped));
+	snap->nmapped = lpm->nmapped;
+	snap->flags = lpm->flags;
+	snap->snapshot = true;
+	snap->gen = lpm_gen_next();
+	snap->max_load = lpm->max_load;
+	snap->growth_shift = lpm->growth_shift;
+	snap->node = -1;
 
-		while ((i = ffs(bitmask)) != 0) {
-			const unsigned preflen = (32 * n) + (32 - --i);
-			lpm_hmap_t *hmap = &lpm->prefix[preflen];
-			lpm_ent_t *entry;
+	for (unsigned n = 1; n <= LPM_MAX_PREFIX; n++) {
+		lpm_hmap_t *hmap = &lpm->prefix[n];
 
-			compute_prefix(nwords, addr, preflen, prefix);
-			entry = hashmap_lookup(hmap, prefix, len);
-			if (entry) {
-				return entry->val;
+		if (hmap->hashsize == 0) {
+			continue;
+		}
+		/* Complete any resize: the shared hash maps are immutable. */
+		lpm_hashmap_settle(lpm, hmap);
+		if (hmap->shared == NULL) {
+			if ((hmap->shared = malloc(sizeof(unsigned))) == NULL) {
+				lpm_snapshot_release(snap);
+				return NULL;
 			}
-			bitmask &= ~(1U << i);
+			*hmap->shared = 1;
 		}
+		__atomic_add_fetch(hmap->shared, 1, __ATOMIC_RELAXED);
+		snap->prefix[n] = *hmap;
+		snap->memused += hashmap_memsize(hmap);
 	}
-	return lpm->defvals[LPM_LEN_IDX(len)];
+	return snap;
 }
 
 /*
- * lpm_lookup_prefix: return the value associated with a prefix
+ * lpm_snapshot_release: release the snapshot; the memory which is not
+ * shared with the table (or the other snapshots) is freed.
  *
- * => Returns the associated value on success or NULL on failure.
+ * => May be called by any thread, concurrently with the updates.
  */
-void *
-lpm_lookup_prefix(lpm_t *lpm, const void *addr, size_t len, unsigned preflen)
+void
+lpm_snapshot_release(lpm_t *snap)
 {
-	const unsigned nwords = LPM_TO_WORDS(len);
-	uint32_t prefix[nwords];
-	lpm_ent_t *entry;
-	ASSERT(len == 4 || len == 16);
+	ASSERT(snap->snapshot);
 
-	if (preflen == 0) {
-		return lpm->defvals[LPM_LEN_IDX(len)];
-	}
-	compute_prefix(nwords, addr, preflen, prefix);
-	entry = hashmap_lookup(&lpm->prefix[preflen], prefix, len);
-	if (entry) {
-		return entry->val;
+	for (unsigned n = 1; n <= LPM_MAX_PREFIX; n++) {
+		lpm_hmap_t *hmap = &snap->prefix[n];
+
+		if (hmap->hashsize) {
+			hashmap_destroy(snap, hmap, NULL, NULL);
+		}
 	}
-	return NULL;
+	free(snap);
 }
 
 /*
@@ -393,28 +2579,236 @@ int
 lpm_strtobin(const char *cidr, void *addr, size_t *len, unsigned *preflen)
 {
 	char *p, buf[INET6_ADDRSTRLEN];
+	int pref = -1;
 
 	strncpy(buf, cidr, sizeof(buf));
 	buf[sizeof(buf) - 1] = '\0';
 
 	if ((p = strchr(buf, '/')) != NULL) {
 		const ptrdiff_t off = p - buf;
-		*preflen = atoi(&buf[off + 1]);
+		pref = atoi(&buf[off + 1]);
 		buf[off] = '\0';
-	} else {
-		*preflen = LPM_MAX_PREFIX;
 	}
 
 	if (inet_pton(AF_INET6, buf, addr) == 1) {
+		*preflen = pref < 0 ? 128 : pref;
 		*len = 16;
 		return 0;
 	}
 	if (inet_pton(AF_INET, buf, addr) == 1) {
-		if (*preflen == LPM_MAX_PREFIX) {
-			*preflen = 32;
-		}
+		*preflen = pref < 0 ? 32 : pref;
 		*len = 4;
 		return 0;
 	}
 	return -1;
 }
+
+/*
+ * lpm_parse_ipv4: parse the dotted-decimal IPv4 address of the given
+ * length, accepting the same forms as inet_pton(3).
+ */
+static int
+lpm_parse_ipv4(const char *s, size_t n, uint8_t *addr)
+{
+	unsigned octets = 0, val = 0, ndigits = 0;
+
+	for (size_t i = 0; i < n; i++) {
+		const unsigned d = (unsigned char)s[i] - '0';
+
+		if (d < 10) {
+			/* No leading zeros. */
+			if (ndigits && val == 0) {
+				return -1;
+			}
+			val = val * 10 + d;
+			if (++ndigits > 3 || val > 255) {
+				return -1;
+			}
+			continue;
+		}
+		if (s[i] != '.' || ndigits == 0 || octets == 3) {
+			return -1;
+		}
+		addr[octets++] = val;
+		val = ndigits = 0;
+	}
+	if (ndigits == 0 || octets != 3) {
+		return -1;
+	}
+	addr[3] = val;
+	return 0;
+}
+
+static inline int
+lpm_hexval(int c)
+{
+	if (c >= '0' && c <= '9') {
+		return c - '0';
+	}
+	c |= 0x20;
+	return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+/*
+ * lpm_parse_ipv6: parse the IPv6 address of the given length, with the
+ * zero compression and the trailing dotted-decimal IPv4 address, if any,
+ * accepting the same forms as inet_pton(3).
+ */
+static int
+lpm_parse_ipv6(const char *s, size_t n, uint8_t *addr)
+{
+	unsigned nbytes = 0;
+	int gap = -1;
+	size_t i = 0;
+
+	if (n >= 2 && s[0] == ':' && s[1] == ':') {
+		gap = 0;
+		i = 2;
+	}
+	while (i < n) {
+		const size_t start = i;
+		unsigned val = 0;
+		int d;
+
+		while (i < n && i - start < 5 && (d = lpm_hexval(s[i])) >= 0) {
+			val = (val << 4) | d;
+			i++;
+		}
+		if (i < n && s[i] == '.') {
+			/* The IPv4 address must be the last part. */
+			if (nbytes > 12 || lpm_parse_ipv4(&s[start],
+			    n - start, &addr[nbytes]) == -1) {
+				return -1;
+			}
+			nbytes += 4;
+			break;
+		}
+		if (i == start || i - start > 4 || nbytes == 16) {
+			return -1;
+		}
+		addr[nbytes++] = val >> 8;
+		addr[nbytes++] = val & 0xff;
+		if (i == n) {
+			break;
+		}
+		if (s[i++] != ':' || i == n) {
+			return -1;
+		}
+		if (s[i] == ':') {
+			if (gap >= 0) {
+				return -1;
+			}
+			gap = nbytes;
+			i++;
+		}
+	}
+	if (gap < 0) {
+		return nbytes == 16 ? 0 : -1;
+	}
+	if (nbytes == 16) {
+		return -1;
+	}
+	memmove(&addr[16 - (nbytes - gap)], &addr[gap], nbytes - gap);
+	memset(&addr[gap], 0, 16 - nbytes);
+	return 0;
+}
+
+/*
+ * lpm_parse_addr: parse the IPv4 or IPv6 address of the given length.
+ *
+ * => Returns the address length or 0 on failure.
+ */
+static size_t
+lpm_parse_addr(const char *s, size_t n, void *addr)
+{
+	size_t i = 0;
+
+	/* An IPv4 address has a dot after at most three digits. */
+	while (i < n && i < 4 && (unsigned)(s[i] - '0') < 10) {
+		i++;
+	}
+	if (i < n && s[i] == '.') {
+		return lpm_parse_ipv4(s, n, addr) == 0 ? 4 : 0;
+	}
+	return lpm_parse_ipv6(s, n, addr) == 0 ? 16 : 0;
+}
+
+/*
+ * lpm_lookup_str: lpm_lookup() of the IPv4 or IPv6 address given as the
+ * string of the given length, which need not be NUL-terminated.
+ *
+ * => Returns NULL if the string is not a valid address.
+ */
+void *
+lpm_lookup_str(lpm_t *lpm, const char *s, size_t n)
+{
+	uint32_t addr[4];
+	size_t len;
+
+	if ((len = lpm_parse_addr(s, n, addr)) == 0) {
+		return NULL;
+	}
+	return lpm_lookup(lpm, addr, len);
+}
+
+/*
+ * lpm_lookup_str_batch: lpm_lookup_str() of each line of the buffer, up
+ * to the given number of lines.  The last line need not end with the
+ * newline; a trailing carriage return is ignored.
+ *
+ * => The value of an empty or invalid line is NULL.
+ * => Returns the number of lines looked up and, if consumed is not NULL,
+ *    sets it to the length of those lines, including the newlines.
+ */
+unsigned
+lpm_lookup_str_batch(lpm_t *lpm, const char *buf, size_t n, void **vals,
+    unsigned max, size_t *consumed)
+{
+	const char *p = buf, *end = buf + n;
+	unsigned nlines = 0;
+
+	lpm = lpm_local_replica(lpm);
+	while (nlines < max && p < end) {
+		const void *addrs[2][LPM_LOOKUP_GROUP];
+		unsigned idx[2][LPM_LOOKUP_GROUP], count[2] = { 0, 0 };
+		uint32_t addr[LPM_LOOKUP_GROUP][4];
+		void *gvals[LPM_LOOKUP_GROUP];
+		unsigned k = 0;
+
+		/* Parse a group of the lines, split by the length. */
+		while (k < LPM_LOOKUP_GROUP && nlines + k < max && p < end) {
+			const char *nl = memchr(p, '\n', end - p);
+			const char *eol = nl ? nl : end;
+			size_t len;
+
+			if (eol > p && eol[-1] == '\r') {
+				eol--;
+			}
+			len = lpm_parse_addr(p, eol - p, addr[k]);
+			vals[nlines + k] = NULL;
+			if (len) {
+				const unsigned f = len == 16;
+
+				idx[f][count[f]] = nlines + k;
+				addrs[f][count[f]++] = addr[k];
+			}
+			p = nl ? nl + 1 : end;
+			k++;
+		}
+		for (unsigned f = 0; f < 2; f++) {
+			if (count[f] == 0) {
+				continue;
+			}
+			lpm_lookup_groups(lpm, addrs[f], f ? 16 : 4,
+			    gvals, count[f]);
+			for (unsigned j = 0; j < count[f]; j++) {
+				vals[idx[f][j]] = gvals[j];
+			}
+		}
+		nlines += k;
+	}
+	if (consumed) {
+		*consumed = p - buf;
+	}
+	return nlines;
+}
@@ -11,16 +11,140 @@
 __BEGIN_DECLS
 
 typedef struct lpm lpm_t;
+typedef struct lpm_cache lpm_cache_t;
+typedef struct lpm_vrf lpm_vrf_t;
+typedef struct lpm_ivtab lpm_ivtab_t;
+typedef struct lpm_ctab lpm_ctab_t;
+typedef struct lpm_flow lpm_flow_t;
+typedef struct lpm_queue lpm_queue_t;
+
+typedef struct {
+	void *		val;
+	unsigned	preflen;
+} lpm_match_t;
+
+typedef struct {
+	unsigned	flags;
+	unsigned	max_load;	// max. load factor of the hash maps, %
+	unsigned	growth;		// growth factor of the hash maps
+	const unsigned *sizes;		// initial sizes, indexed by prefix length
+	unsigned	nsizes;
+	uint64_t	seed;		// hash seed, zero means random
+	const void *	nat64;		// NAT64 /96 prefix, see LPM_F_MAPPED
+	size_t		memlimit;	// memory limit in bytes, zero means none
+} lpm_conf_t;
+
+typedef struct {
+	size_t		buckets;	// bucket arrays
+	size_t		entries;	// entries
+	size_t		filters;	// Bloom filters
+} lpm_memuse_t;
+
+typedef struct {
+	const void *	addr;
+	size_t		len;
+	unsigned	preflen;
+	void *		val;
+} lpm_prefix_t;
+
+#define	LPM_F_NUMA		0x01
+#define	LPM_F_BLOOM		0x02
+#define	LPM_F_MAPPED		0x04
+
+/*
+ * Histograms of the sampled lookups: the number of the hash map probes
+ * and the number of the chain entries visited.  The bucket i counts the
+ * values in the range [2^(i-1), 2^i), with the last one open-ended.
+ */
+#define	LPM_HIST_BUCKETS	16
+
+typedef struct {
+	uint64_t	nsamples;
+	uint64_t	probes[LPM_HIST_BUCKETS];
+	uint64_t	chain[LPM_HIST_BUCKETS];
+} lpm_hist_t;
+
 typedef void (*lpm_dtor_t)(void *, const void *, size_t, void *);
+typedef int (*lpm_cmp_t)(void *, const void *, const void *);
+typedef int (*lpm_diff_t)(void *, unsigned, const void *, size_t,
+    unsigned, void *, void *);
+typedef void (*lpm_publish_t)(void *, lpm_t *, uint64_t);
+
+#define	LPM_DIFF_ADD		1
+#define	LPM_DIFF_REMOVE		2
+#define	LPM_DIFF_CHANGE		3
 
 lpm_t *		lpm_create(void);
+lpm_t *		lpm_create_ex(const lpm_conf_t *);
 void		lpm_destroy(lpm_t *);
 void		lpm_clear(lpm_t *, lpm_dtor_t, void *);
 
 int		lpm_insert(lpm_t *, const void *, size_t, unsigned, void *);
+int		lpm_reserve(lpm_t *, size_t, unsigned, unsigned);
+size_t		lpm_memory_usage(lpm_t *, lpm_memuse_t *, unsigned);
+size_t		lpm_memory_estimate(lpm_t *, size_t, unsigned, unsigned);
+int		lpm_insert_bulk(lpm_t *, const lpm_prefix_t *, size_t, unsigned);
 int		lpm_remove(lpm_t *, const void *, size_t, unsigned);
 void *		lpm_lookup(lpm_t *, const void *, size_t);
+void		lpm_lookup2(lpm_t *, const void *, const void *, size_t,
+		    void **, void **);
+void		lpm_lookup2_batch(lpm_t *, const void *const *,
+		    const void *const *, size_t, void **, void **, unsigned);
+unsigned	lpm_lookup_all(lpm_t *, const void *, size_t,
+		    lpm_match_t *, unsigned);
 void *		lpm_lookup_prefix(lpm_t *, const void *, size_t, unsigned);
+lpm_cache_t *	lpm_cache_create(unsigned);
+void		lpm_cache_destroy(lpm_cache_t *);
+void		lpm_cache_stats(const lpm_cache_t *, uint64_t *, uint64_t *);
+void *		lpm_lookup_cached(lpm_t *, lpm_cache_t *, const void *, size_t);
+void *		lpm_lookup_str(lpm_t *, const char *, size_t);
+unsigned	lpm_lookup_str_batch(lpm_t *, const char *, size_t, void **,
+		    unsigned, size_t *);
+void		lpm_set_sampling(lpm_t *, unsigned);
+void		lpm_hist_register(lpm_hist_t *);
+
+int		lpm_diff(lpm_t *, lpm_t *, lpm_diff_t, void *);
+int		lpm_apply_diff(lpm_t *, lpm_t *, lpm_dtor_t, void *);
+int		lpm_compact(lpm_t *);
+int		lpm_optimize(lpm_t *, lpm_cmp_t, lpm_dtor_t, void *);
+lpm_t *		lpm_snapshot(lpm_t *);
+void		lpm_snapshot_release(lpm_t *);
+
+lpm_vrf_t *	lpm_vrf_create(void);
+void		lpm_vrf_destroy(lpm_vrf_t *);
+void		lpm_vrf_clear(lpm_vrf_t *, lpm_dtor_t, void *);
+int		lpm_vrf_insert(lpm_vrf_t *, uint32_t, const void *, size_t,
+		    unsigned, void *);
+int		lpm_vrf_remove(lpm_vrf_t *, uint32_t, const void *, size_t,
+		    unsigned);
+void *		lpm_vrf_lookup(lpm_vrf_t *, uint32_t, const void *, size_t);
+void *		lpm_vrf_lookup_prefix(lpm_vrf_t *, uint32_t, const void *,
+		    size_t, unsigned);
+
+lpm_ivtab_t *	lpm_ivtab_build(lpm_t *);
+void		lpm_ivtab_destroy(lpm_ivtab_t *);
+void *		lpm_ivtab_lookup(const lpm_ivtab_t *, const void *, size_t);
+
+lpm_ctab_t *	lpm_ctab_build(lpm_t *);
+void		lpm_ctab_destroy(lpm_ctab_t *);
+void *		lpm_ctab_lookup(const lpm_ctab_t *, const void *, size_t);
+
+lpm_flow_t *	lpm_flow_create(lpm_t *, unsigned);
+void		lpm_flow_destroy(lpm_flow_t *);
+void		lpm_flow_lookup(lpm_flow_t *, const void *, const void *,
+		    size_t, void *[2]);
+void		lpm_flow_stats(const lpm_flow_t *, uint64_t *, uint64_t *);
+
+lpm_queue_t *	lpm_queue_create(lpm_t *, lpm_publish_t, void *);
+void		lpm_queue_destroy(lpm_queue_t *);
+uint64_t	lpm_queue_insert(lpm_queue_t *, const void *, size_t,
+		    unsigned, void *);
+uint64_t	lpm_queue_remove(lpm_queue_t *, const void *, size_t,
+		    unsigned);
+void		lpm_queue_wait(lpm_queue_t *, uint64_t);
+void		lpm_queue_stats(const lpm_queue_t *, uint64_t *, uint64_t *,
+		    uint64_t *);
+
 int		lpm_strtobin(const char *, void *, size_t *, unsigned *);
 
 __END_DECLS
@@ -0,0 +1,340 @@
+/*
+ * Copyright (c) 2016 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Parallel bulk insertion.
+ *
+ * The hash maps are pre-sized for the whole input, so there is no rehash
+ * during the insertion.  The buckets are then partitioned across the
+ * worker threads: a worker owns every bucket whose index, modulo the
+ * number of workers, equals its ID.  Hence, no locking is needed.
+ *
+ * The build runs in three phases, each running all workers:
+ *
+ * - Each worker computes the prefixes and hashes for its slice of the
+ *   input and counts the prefixes for each owner.
+ * - Each worker scatters the indices of its slice into the per-owner
+ *   partitions, preserving the input order.
+ * - Each worker inserts the prefixes of its own partition.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "lpm.h"
+#include "lpm_impl.h"
+
+#define	LPM_BULK_MAXTHREADS	(64)
+#define	LPM_BULK_MINSLICE	(4096)
+
+typedef struct lpm_bulk lpm_bulk_t;
+
+typedef struct {
+	pthread_t	thread;
+	lpm_bulk_t *	bulk;
+	unsigned	id;
+	bool		failed;
+	size_t		count[LPM_BULK_MAXTHREADS];
+	unsigned	nitems[LPM_MAX_PREFIX + 1];
+	size_t		entsize[LPM_MAX_PREFIX + 1];
+} lpm_bulk_worker_t;
+
+struct lpm_bulk {
+	lpm_t *			lpm;
+	const lpm_prefix_t *	input;
+	size_t			n;
+	unsigned		nworkers;
+	uint32_t *		hashes;
+	size_t *		order;
+	size_t			offset[LPM_BULK_MAXTHREADS + 1];
+	lpm_bulk_worker_t	workers[LPM_BULK_MAXTHREADS];
+};
+
+static inline unsigned
+bulk_owner(const lpm_bulk_t *bulk, const lpm_prefix_t *p, uint32_t hash)
+{
+	const lpm_hmap_t *hmap = &bulk->lpm->prefix[p->preflen];
+	return (hash & (hmap->hashsize - 1)) % bulk->nworkers;
+}
+
+/*
+ * bulk_positions: compute the position of each worker's share within
+ * the partition of each owner.
+ */
+static void
+bulk_positions(lpm_bulk_t *bulk)
+{
+	size_t pos = 0;
+
+	for (unsigned o = 0; o < bulk->nworkers; o++) {
+		bulk->offset[o] = pos;
+		for (unsigned w = 0; w < bulk->nworkers; w++) {
+			lpm_bulk_worker_t *worker = &bulk->workers[w];
+			const size_t count = worker->count[o];
+
+			worker->count[o] = pos;
+			pos += count;
+		}
+	}
+	bulk->offset[bulk->nworkers] = pos;
+}
+
+static void
+bulk_insert(lpm_bulk_worker_t *worker, const lpm_prefix_t *p, uint32_t hash)
+{
+	lpm_t *lpm = worker->bulk->lpm;
+	lpm_hmap_t *hmap = &lpm->prefix[p->preflen];
+	const size_t entlen = offsetof(lpm_ent_t, key[p->len]);
+	const unsigned i = hash & (hmap->hashsize - 1);
+	uint32_t prefix[LPM_MAX_WORDS];
+	lpm_ent_t *entry;
+
+	compute_prefix(p->len, p->addr, p->preflen, prefix);
+	for (entry = hmap->bucket[i]; entry; entry = entry->next) {
+		if (entry->len == p->len &&
+		    memcmp(entry->key, prefix, p->len) == 0) {
+			entry->val = p->val;
+			return;
+		}
+	}
+	entry = lpm_alloc(lpm, entlen);
+	if (entry == NULL) {
+		worker->failed = true;
+		return;
+	}
+	memcpy(entry->key, prefix, p->len);
+	entry->len = p->len;
+	entry->hash = hash;
+	entry->val = p->val;
+	entry->next = hmap->bucket[i];
+	hmap->bucket[i] = entry;
+	worker->nitems[p->preflen]++;
+	worker->entsize[p->preflen] += entlen;
+}
+
+static void *
+bulk_hash(void *arg)
+{
+	lpm_bulk_worker_t *worker = arg;
+	lpm_bulk_t *bulk = worker->bulk;
+	const size_t start = bulk->n * worker->id / bulk->nworkers;
+	const size_t end = bulk->n * (worker->id + 1) / bulk->nworkers;
+
+	for (size_t i = start; i < end; i++) {
+		const lpm_prefix_t *p = &bulk->input[i];
+		uint32_t prefix[LPM_MAX_WORDS];
+
+		if (p->preflen == 0) {
+			continue;
+		}
+		compute_prefix(p->len, p->addr, p->preflen, prefix);
+		bulk->hashes[i] = lpm_hash(bulk->lpm, prefix, p->len);
+		worker->count[bulk_owner(bulk, p, bulk->hashes[i])]++;
+	}
+	return NULL;
+}
+
+static void *
+bulk_scatter(void *arg)
+{
+	lpm_bulk_worker_t *worker = arg;
+	lpm_bulk_t *bulk = worker->bulk;
+	const size_t start = bulk->n * worker->id / bulk->nworkers;
+	const size_t end = bulk->n * (worker->id + 1) / bulk->nworkers;
+
+	for (size_t i = start; i < end; i++) {
+		const lpm_prefix_t *p = &bulk->input[i];
+		unsigned o;
+
+		if (p->preflen == 0) {
+			continue;
+		}
+		o = bulk_owner(bulk, p, bulk->hashes[i]);
+		bulk->order[worker->count[o]++] = i;
+	}
+	return NULL;
+}
+
+static void *
+bulk_build(void *arg)
+{
+	lpm_bulk_worker_t *worker = arg;
+	lpm_bulk_t *bulk = worker->bulk;
+
+	for (size_t j = bulk->offset[worker->id];
+	    j < bulk->offset[worker->id + 1]; j++) {
+		const size_t i = bulk->order[j];
+		bulk_insert(worker, &bulk->input[i], bulk->hashes[i]);
+	}
+	return NULL;
+}
+
+/*
+ * bulk_phase: run the phase on all workers and wait for them.  If a
+ * thread cannot be created, then just run its share in this thread.
+ */
+static void
+bulk_phase(lpm_bulk_t *bulk, void *(*func)(void *))
+{
+	bool started[LPM_BULK_MAXTHREADS] = { false };
+
+	for (unsigned w = 1; w < bulk->nworkers; w++) {
+		lpm_bulk_worker_t *worker = &bulk->workers[w];
+
+		if (pthread_create(&worker->thread, NULL, func, worker) == 0) {
+			started[w] = true;
+		} else {
+			func(worker);
+		}
+	}
+	func(&bulk->workers[0]);
+	for (unsigned w = 1; w < bulk->nworkers; w++) {
+		if (started[w]) {
+			pthread_join(bulk->workers[w].thread, NULL);
+		}
+	}
+}
+
+/*
+ * bulk_run: pre-size the hash maps and run the phases.
+ *
+ * => The entries are charged against the memory limit upfront, as if
+ *    all prefixes were new; the excess is returned at the end.
+ */
+static int
+bulk_run(lpm_bulk_t *bulk)
+{
+	lpm_t *lpm = bulk->lpm;
+	unsigned counts[LPM_MAX_PREFIX + 1] = { 0 };
+	size_t charged = 0, used = 0;
+	int ret = 0;
+
+	for (size_t i = 0; i < bulk->n; i++) {
+		const lpm_prefix_t *p = &bulk->input[i];
+
+		ASSERT(LPM_VALID_LEN(p->len) && p->preflen <= p->len * 8);
+		if (p->preflen == 0) {
+			lpm->defvals[p->len] = p->val;
+		} else {
+			charged += offsetof(lpm_ent_t, key[p->len]);
+		}
+		counts[p->preflen]++;
+	}
+	for (unsigned n = 1; n <= LPM_MAX_PREFIX; n++) {
+		lpm_hmap_t *hmap = &lpm->prefix[n];
+
+		/* Also complete any resize: a single bucket array. */
+		lpm_hashmap_settle(lpm, hmap);
+		if (counts[n] && (!lpm_hashmap_own(lpm, hmap) ||
+		    !lpm_hashmap_reserve(lpm, hmap, hmap->nitems + counts[n]))) {
+			return -1;
+		}
+	}
+	if (!lpm_mem_charge(lpm, charged)) {
+		return -1;
+	}
+	for (unsigned w = 0; w < bulk->nworkers; w++) {
+		bulk->workers[w].bulk = bulk;
+		bulk->workers[w].id = w;
+	}
+
+	bulk_phase(bulk, bulk_hash);
+	bulk_positions(bulk);
+	bulk_phase(bulk, bulk_scatter);
+	bulk_phase(bulk, bulk_build);
+
+	/* Update the counters and the bitmask. */
+	for (unsigned w = 0; w < bulk->nworkers; w++) {
+		const lpm_bulk_worker_t *worker = &bulk->workers[w];
+
+		for (unsigned n = 1; n <= LPM_MAX_PREFIX; n++) {
+			lpm->prefix[n].nitems += worker->nitems[n];
+			lpm->prefix[n].entsize += worker->entsize[n];
+			used += worker->entsize[n];
+		}
+		if (worker->failed) {
+			ret = -1;
+		}
+	}
+	lpm->memused -= charged - used;
+	for (unsigned n = 1; n <= LPM_MAX_PREFIX; n++) {
+		if (lpm->prefix[n].nitems) {
+			const unsigned i = n - 1;
+			lpm->bitmask[i >> 5] |= 0x80000000U >> (i & 31);
+		}
+		if (counts[n] && (lpm->flags & LPM_F_BLOOM) != 0) {
+			lpm_bloom_rebuild(lpm, &lpm->prefix[n]);
+		}
+	}
+	return ret;
+}
+
+/*
+ * lpm_insert_bulk: insert the given prefixes using the specified number
+ * of threads (zero means the number of the online CPUs).
+ *
+ * => Equivalent to calling lpm_insert() for each prefix in the order.
+ * => On failure, some of the prefixes may have been inserted.
+ * => Returns 0 on success or -1 on failure.
+ */
+int
+lpm_insert_bulk(lpm_t *lpm, const lpm_prefix_t *prefixes, size_t n,
+    unsigned nthreads)
+{
+	lpm_bulk_t *bulk;
+	int ret = -1;
+
+	if (nthreads == 0) {
+		long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+		nthreads = ncpus > 0 ? ncpus : 1;
+	}
+	if (nthreads > LPM_BULK_MAXTHREADS) {
+		nthreads = LPM_BULK_MAXTHREADS;
+	}
+	if (nthreads > n / LPM_BULK_MINSLICE) {
+		nthreads = n / LPM_BULK_MINSLICE;
+	}
+
+	/*
+	 * Small input or the replicated table, even with a single replica
+	 * (its node-local allocator is not thread-safe): just insert one
+	 * by one.
+	 */
+	if (nthreads <= 1 || lpm->node >= 0 || lpm->nreplicas != 0) {
+		for (size_t i = 0; i < n; i++) {
+			const lpm_prefix_t *p = &prefixes[i];
+
+			if (lpm_insert(lpm, p->addr, p->len,
+			    p->preflen, p->val) == -1) {
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	if ((bulk = calloc(1, sizeof(lpm_bulk_t))) == NULL) {
+		return -1;
+	}
+	bulk->lpm = lpm;
+	bulk->input = prefixes;
+	bulk->n = n;
+	bulk->nworkers = nthreads;
+	bulk->hashes = malloc(n * sizeof(uint32_t));
+	bulk->order = malloc(n * sizeof(size_t));
+	if (bulk->hashes && bulk->order) {
+		lpm->gen = lpm_gen_next();
+		ret = bulk_run(bulk);
+	}
+	free(bulk->hashes);
+	free(bulk->order);
+	free(bulk);
+	return ret;
+}
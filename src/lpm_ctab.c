@@ -0,0 +1,363 @@
+/*
+ * Copyright (c) 2016 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Immutable compact table: the same per-prefix-length hash maps as the
+ * LPM table, but without the per-entry pointers, built from an LPM table.
+ *
+ * Each hash map is a single array of the fixed-size slots, grouped by
+ * the bucket, and an array of the bucket offsets into it (i.e. a bucket
+ * is the range between the two adjacent offsets).  A slot is the key,
+ * zero-padded to the words, followed by the 32-bit index of the value:
+ * the values are stored once, in a side array, as there are usually few
+ * distinct ones (e.g. the next-hops).  The key length is implied by the
+ * set the hash map belongs to.  There are two entries per bucket on
+ * average, therefore an IPv4 entry takes 10-12 bytes and an IPv6 entry
+ * 22-24 bytes.
+ *
+ * The lookup is the same as in the LPM table: the populated prefix
+ * lengths are probed from the longest, while a probe scans the slots of
+ * the bucket, which are contiguous.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <strings.h>
+
+#include "lpm.h"
+#include "lpm_impl.h"
+
+typedef struct {
+	unsigned	mask;		// the number of buckets - 1
+	uint32_t *	offsets;	// mask + 2 offsets
+	uint32_t *	slots;		// key words, then the value index
+} lpm_ctmap_t;
+
+typedef struct {
+	uint32_t	bitmask[LPM_MAX_WORDS];
+	void *		defval;
+	lpm_ctmap_t	maps[];		// indexed by the prefix length
+} lpm_ctset_t;
+
+struct lpm_ctab {
+	lpm_ctset_t *	sets[LPM_MAX_KEYLEN + 1];
+	void **		vals;
+	size_t		nvals;
+	uint64_t	seed[2];	// of the hash function
+};
+
+typedef struct {
+	lpm_ctab_t *	ctab;
+	unsigned	count[LPM_MAX_KEYLEN + 1][LPM_MAX_PREFIX + 1];
+	void **		vals;
+	size_t		nvals;
+	bool		place;
+} lpm_ctbuild_t;
+
+#define	CTAB_STRIDE(len)	(LPM_TO_WORDS(len) + 1)
+
+static int
+ctab_count(lpm_ent_t *entry, unsigned preflen, void *arg)
+{
+	lpm_ctbuild_t *b = arg;
+
+	b->count[entry->len][preflen]++;
+	b->nvals++;
+	return 0;
+}
+
+static int
+ctab_collect_val(lpm_ent_t *entry, unsigned preflen, void *arg)
+{
+	lpm_ctbuild_t *b = arg;
+
+	b->vals[b->nvals++] = entry->val;
+	(void)preflen;
+	return 0;
+}
+
+static int
+ctab_val_cmp(const void *p1, const void *p2)
+{
+	const uintptr_t a = (uintptr_t)*(void *const *)p1;
+	const uintptr_t b = (uintptr_t)*(void *const *)p2;
+	return (a > b) - (a < b);
+}
+
+/*
+ * ctab_val_index: find the index of the value in the sorted array.
+ */
+static uint32_t
+ctab_val_index(const lpm_ctab_t *ctab, void *val)
+{
+	void **v = bsearch(&val, ctab->vals, ctab->nvals,
+	    sizeof(void *), ctab_val_cmp);
+
+	ASSERT(v != NULL);
+	return v - ctab->vals;
+}
+
+/*
+ * ctab_fill: on the first pass, count the entries of each bucket; on
+ * the second pass, store the entries at the bucket offsets.
+ */
+static int
+ctab_fill(lpm_ent_t *entry, unsigned preflen, void *arg)
+{
+	lpm_ctbuild_t *b = arg;
+	const unsigned len = entry->len, nwords = LPM_TO_WORDS(len);
+	lpm_ctmap_t *map = &b->ctab->sets[len]->maps[preflen];
+	const unsigned i = lpm_hash_seed(b->ctab->seed, entry->key, len) &
+	    map->mask;
+	uint32_t *slot;
+
+	if (!b->place) {
+		map->offsets[i + 1]++;
+		return 0;
+	}
+	slot = &map->slots[map->offsets[i]++ * CTAB_STRIDE(len)];
+	slot[nwords - 1] = 0;
+	memcpy(slot, entry->key, len);
+	slot[nwords] = ctab_val_index(b->ctab, entry->val);
+	return 0;
+}
+
+/*
+ * ctab_alloc_set: allocate the set of the given key length and the
+ * hash maps of its populated prefix lengths.
+ */
+static int
+ctab_alloc_set(lpm_ctab_t *ctab, const unsigned *count, size_t len,
+    void *defval)
+{
+	const unsigned maxpref = len * 8;
+	lpm_ctset_t *set;
+
+	set = calloc(1, offsetof(lpm_ctset_t, maps[maxpref + 1]));
+	if ((ctab->sets[len] = set) == NULL) {
+		return -1;
+	}
+	set->defval = defval;
+	for (unsigned n = 1; n <= maxpref; n++) {
+		lpm_ctmap_t *map = &set->maps[n];
+		const unsigned i = n - 1;
+		unsigned nbuckets = 1;
+
+		if (count[n] == 0) {
+			continue;
+		}
+		while (nbuckets * 2 < count[n]) {
+			nbuckets <<= 1;
+		}
+		map->mask = nbuckets - 1;
+		map->offsets = calloc(nbuckets + 1, sizeof(uint32_t));
+		map->slots = malloc(count[n] * CTAB_STRIDE(len) *
+		    sizeof(uint32_t));
+		if (map->offsets == NULL || map->slots == NULL) {
+			return -1;
+		}
+		set->bitmask[i >> 5] |= 0x80000000U >> (i & 31);
+	}
+	return 0;
+}
+
+/*
+ * ctab_offsets: convert the bucket counts into the start offsets, or
+ * the end offsets (after the second fill) back into the start offsets.
+ */
+static void
+ctab_offsets(lpm_ctab_t *ctab, bool start)
+{
+	for (unsigned len = 1; len <= LPM_MAX_KEYLEN; len++) {
+		lpm_ctset_t *set = ctab->sets[len];
+
+		for (unsigned n = 1; set && n <= len * 8; n++) {
+			lpm_ctmap_t *map = &set->maps[n];
+			const unsigned nbuckets = map->mask + 1;
+
+			if (map->offsets == NULL) {
+				continue;
+			}
+			if (start) {
+				for (unsigned i = 1; i <= nbuckets; i++) {
+					map->offsets[i] += map->offsets[i - 1];
+				}
+				continue;
+			}
+			memmove(&map->offsets[1], &map->offsets[0],
+			    nbuckets * sizeof(uint32_t));
+			map->offsets[0] = 0;
+		}
+	}
+}
+
+static int
+ctab_build(lpm_ctab_t *ctab, lpm_t *lpm, lpm_ctbuild_t *b)
+{
+	size_t n = 0;
+
+	lpm_walk(lpm, ctab_count, b);
+	if (b->nvals > UINT32_MAX) {
+		return -1;
+	}
+
+	/* The distinct values, sorted for the index lookup. */
+	if ((b->vals = malloc((b->nvals + 1) * sizeof(void *))) == NULL) {
+		return -1;
+	}
+	b->nvals = 0;
+	lpm_walk(lpm, ctab_collect_val, b);
+	if (b->nvals) {
+		qsort(b->vals, b->nvals, sizeof(void *), ctab_val_cmp);
+	}
+	for (size_t i = 0; i < b->nvals; i++) {
+		if (n == 0 || b->vals[i] != b->vals[n - 1]) {
+			b->vals[n++] = b->vals[i];
+		}
+	}
+	if ((ctab->vals = realloc(b->vals, (n + 1) * sizeof(void *))) == NULL) {
+		return -1;
+	}
+	ctab->nvals = n;
+	b->vals = NULL;
+
+	for (unsigned len = 1; len <= LPM_MAX_KEYLEN; len++) {
+		bool populated = lpm->defvals[len] != NULL;
+
+		for (unsigned p = 1; p <= len * 8 && !populated; p++) {
+			populated = b->count[len][p] != 0;
+		}
+		if (populated && ctab_alloc_set(ctab, b->count[len],
+		    len, lpm->defvals[len]) == -1) {
+			return -1;
+		}
+	}
+
+	/* Count the entries of each bucket, then store them. */
+	lpm_walk(lpm, ctab_fill, b);
+	ctab_offsets(ctab, true);
+	b->place = true;
+	lpm_walk(lpm, ctab_fill, b);
+	ctab_offsets(ctab, false);
+	return 0;
+}
+
+/*
+ * lpm_ctab_build: construct the compact table with the contents of the
+ * given LPM table, answering the lookups identically.
+ *
+ * => The tables with LPM_F_MAPPED are not supported: the fallthrough of
+ *    the mapped addresses to the IPv4 prefixes is not implemented.
+ * => Returns the new compact table or NULL on failure.
+ */
+lpm_ctab_t *
+lpm_ctab_build(lpm_t *lpm)
+{
+	lpm_ctbuild_t *b;
+	lpm_ctab_t *ctab;
+	int ret;
+
+	if ((lpm->flags & LPM_F_MAPPED) != 0) {
+		return NULL;
+	}
+	if ((ctab = calloc(1, sizeof(lpm_ctab_t))) == NULL) {
+		return NULL;
+	}
+	if ((b = calloc(1, sizeof(lpm_ctbuild_t))) == NULL) {
+		free(ctab);
+		return NULL;
+	}
+	b->ctab = ctab;
+	lpm_hash_init(ctab->seed, 0);
+	ret = ctab_build(ctab, lpm, b);
+	free(b->vals);
+	free(b);
+	if (ret == -1) {
+		lpm_ctab_destroy(ctab);
+		return NULL;
+	}
+	return ctab;
+}
+
+void
+lpm_ctab_destroy(lpm_ctab_t *ctab)
+{
+	for (unsigned len = 1; len <= LPM_MAX_KEYLEN; len++) {
+		lpm_ctset_t *set = ctab->sets[len];
+
+		if (set == NULL) {
+			continue;
+		}
+		for (unsigned n = 1; n <= len * 8; n++) {
+			free(set->maps[n].offsets);
+			free(set->maps[n].slots);
+		}
+		free(set);
+	}
+	free(ctab->vals);
+	free(ctab);
+}
+
+static __always_inline void *
+lpm_ctab_lookup_len(const lpm_ctab_t *ctab, const lpm_ctset_t *set,
+    const void *addr, const size_t len)
+{
+	const unsigned nwords = LPM_TO_WORDS(len);
+	unsigned i, n = nwords;
+	uint32_t prefix[nwords];
+
+	while (n--) {
+		uint32_t bitmask = set->bitmask[n];
+
+		while ((i = ffs(bitmask)) != 0) {
+			const unsigned preflen = (32 * n) + (32 - --i);
+			const lpm_ctmap_t *map = &set->maps[preflen];
+			const uint32_t *slot, *end;
+			unsigned b;
+
+			compute_prefix(len, addr, preflen, prefix);
+			b = lpm_hash_seed(ctab->seed, prefix, len) & map->mask;
+			slot = &map->slots[map->offsets[b] * (nwords + 1)];
+			end = &map->slots[map->offsets[b + 1] * (nwords + 1)];
+			for (; slot < end; slot += nwords + 1) {
+				if (memcmp(slot, prefix, nwords * 4) == 0) {
+					return ctab->vals[slot[nwords]];
+				}
+			}
+			bitmask &= ~(1U << i);
+		}
+	}
+	return set->defval;
+}
+
+/*
+ * lpm_ctab_lookup: find the longest matching prefix given the address.
+ *
+ * => Returns the associated value on success or NULL on failure.
+ */
+void *
+lpm_ctab_lookup(const lpm_ctab_t *ctab, const void *addr, size_t len)
+{
+	const lpm_ctset_t *set;
+
+	ASSERT(LPM_VALID_LEN(len));
+	if (__predict_false((set = ctab->sets[len]) == NULL)) {
+		return NULL;
+	}
+
+	/* Specialise for IPv4 and IPv6. */
+	switch (len) {
+	case 4:
+		return lpm_ctab_lookup_len(ctab, set, addr, 4);
+	case 16:
+		return lpm_ctab_lookup_len(ctab, set, addr, 16);
+	default:
+		return lpm_ctab_lookup_len(ctab, set, addr, len);
+	}
+}
@@ -0,0 +1,190 @@
+/*
+ * Copyright (c) 2016 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Flow table: an exact-match table of the (source, destination) address
+ * pairs in front of the LPM table, holding the lookup results for both
+ * addresses.  A flow hit costs a single hash map probe instead of two
+ * longest-prefix searches.
+ *
+ * The table has a fixed number of entries, chained in the buckets using
+ * the hash function of the LPM hash maps with its own seed (the flows are
+ * chosen by the senders).  The flows are added on every miss and evicted
+ * using the CLOCK algorithm: an entry gets its reference bit set on a hit
+ * and the hand clears the bits, evicting the first entry which was not
+ * referenced since the last sweep.  The new entries start unreferenced,
+ * so the flows seen once are the first to go and the hot flows stay.
+ *
+ * The entries are tagged with the generation of the LPM table: an entry
+ * of an older generation is refreshed in place on its next lookup, so the
+ * updates do not need to flush the table.
+ *
+ * Same as the lookup cache, it is meant to be private to a thread.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+
+#include "lpm.h"
+#include "lpm_impl.h"
+
+typedef struct {
+	uint32_t	next;		// index + 1 of the next entry, 0 if none
+	uint8_t		len;		// address length
+	bool		ref;		// CLOCK reference bit
+	uint64_t	gen;
+	void *		vals[2];
+	uint32_t	key[LPM_MAX_WORDS];	// source, then destination
+} lpm_flow_ent_t;
+
+struct lpm_flow {
+	lpm_t *		lpm;
+	unsigned	nentries;
+	unsigned	nused;
+	unsigned	hand;
+	unsigned	mask;
+	uint32_t *	bucket;
+	lpm_flow_ent_t *entries;
+	uint64_t	seed[2];	// of the hash function
+	uint64_t	hits;
+	uint64_t	misses;
+};
+
+/*
+ * lpm_flow_create: construct a flow table of the given maximum number of
+ * flows in front of the given LPM table.
+ */
+lpm_flow_t *
+lpm_flow_create(lpm_t *lpm, unsigned nflows)
+{
+	lpm_flow_t *flow;
+	unsigned nbuckets;
+
+	if (nflows == 0 || nflows > (1U << 31)) {
+		return NULL;
+	}
+	for (nbuckets = 1; nbuckets < nflows; nbuckets <<= 1) {
+		continue;
+	}
+	if ((flow = calloc(1, sizeof(lpm_flow_t))) == NULL) {
+		return NULL;
+	}
+	flow->lpm = lpm;
+	flow->nentries = nflows;
+	flow->mask = nbuckets - 1;
+	lpm_hash_init(flow->seed, 0);
+	flow->bucket = calloc(nbuckets, sizeof(uint32_t));
+	flow->entries = malloc(nflows * sizeof(lpm_flow_ent_t));
+	if (flow->bucket == NULL || flow->entries == NULL) {
+		lpm_flow_destroy(flow);
+		return NULL;
+	}
+	return flow;
+}
+
+void
+lpm_flow_destroy(lpm_flow_t *flow)
+{
+	free(flow->bucket);
+	free(flow->entries);
+	free(flow);
+}
+
+void
+lpm_flow_stats(const lpm_flow_t *flow, uint64_t *hits, uint64_t *misses)
+{
+	*hits = flow->hits;
+	*misses = flow->misses;
+}
+
+/*
+ * flow_evict: advance the hand of the clock to the entry to reuse and
+ * unlink it from its chain.
+ */
+static lpm_flow_ent_t *
+flow_evict(lpm_flow_t *flow)
+{
+	lpm_flow_ent_t *victim;
+	uint32_t *p;
+
+	for (;;) {
+		victim = &flow->entries[flow->hand];
+		if (++flow->hand == flow->nentries) {
+			flow->hand = 0;
+		}
+		if (!victim->ref) {
+			break;
+		}
+		victim->ref = false;
+	}
+
+	p = &flow->bucket[lpm_hash_seed(flow->seed, victim->key,
+	    2 * victim->len) & flow->mask];
+	while (&flow->entries[*p - 1] != victim) {
+		p = &flow->entries[*p - 1].next;
+	}
+	*p = victim->next;
+	return victim;
+}
+
+/*
+ * lpm_flow_lookup: find the longest matching prefixes of the source and
+ * the destination address, storing the values in the given array.
+ */
+void
+lpm_flow_lookup(lpm_flow_t *flow, const void *src, const void *dst,
+    size_t len, void *vals[2])
+{
+	const uint64_t gen = flow->lpm->gen;
+	uint32_t key[LPM_MAX_WORDS];
+	lpm_flow_ent_t *ent;
+	uint32_t hash, i;
+
+	ASSERT(LPM_VALID_LEN(2 * len));
+
+	memcpy(key, src, len);
+	memcpy((uint8_t *)key + len, dst, len);
+	hash = lpm_hash_seed(flow->seed, key, 2 * len);
+
+	for (i = flow->bucket[hash & flow->mask]; i; i = ent->next) {
+		ent = &flow->entries[i - 1];
+		if (ent->len != len || memcmp(ent->key, key, 2 * len) != 0) {
+			continue;
+		}
+		if (__predict_false(ent->gen != gen)) {
+			/* The table was updated: refresh the results. */
+			break;
+		}
+		ent->ref = true;
+		vals[0] = ent->vals[0];
+		vals[1] = ent->vals[1];
+		flow->hits++;
+		return;
+	}
+	flow->misses++;
+
+	lpm_lookup2(flow->lpm, src, dst, len, &vals[0], &vals[1]);
+
+	if (i == 0) {
+		/* New flow: take a free entry or evict one. */
+		if (flow->nused < flow->nentries) {
+			ent = &flow->entries[flow->nused++];
+		} else {
+			ent = flow_evict(flow);
+		}
+		memcpy(ent->key, key, 2 * len);
+		ent->len = len;
+		ent->ref = false;
+		ent->next = flow->bucket[hash & flow->mask];
+		flow->bucket[hash & flow->mask] = (ent - flow->entries) + 1;
+	}
+	ent->gen = gen;
+	ent->vals[0] = vals[0];
+	ent->vals[1] = vals[1];
+}
@@ -0,0 +1,443 @@
+/*
+ * Copyright (c) 2016 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Internal definitions of the LPM library, shared by its modules.
+ */
+
+#ifndef _LPM_IMPL_H_
+#define _LPM_IMPL_H_
+
+#include <arpa/inet.h>
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <assert.h>
+
+#ifdef LPM_NUMA
+#include <sched.h>
+#endif
+
+#include "lpm.h"
+
+/*
+ * The keys are of arbitrary length up to 32 bytes (e.g. a VRF ID followed
+ * by an IPv6 address), although the common IPv4 and IPv6 cases are still
+ * specialised on lookup.
+ */
+#define	LPM_MAX_KEYLEN		(32)
+#define	LPM_MAX_PREFIX		(LPM_MAX_KEYLEN * 8)
+#define	LPM_MAX_WORDS		(LPM_MAX_PREFIX >> 5)
+#define	LPM_TO_WORDS(x)		(((x) + 3) >> 2)
+#define	LPM_VALID_LEN(len)	((len) > 0 && (len) <= LPM_MAX_KEYLEN)
+#define	LPM_HASH_STEP		(8)
+#define	LPM_MAX_LOAD		(100)
+
+#ifndef __arraycount
+#define	__arraycount(__x)	(sizeof(__x) / sizeof(__x[0]))
+#endif
+
+#ifndef __predict_false
+#define	__predict_false(x)	__builtin_expect((x) != 0, 0)
+#endif
+
+#ifndef __always_inline
+#define	__always_inline		inline __attribute__((always_inline))
+#endif
+
+#ifdef DEBUG
+#define	ASSERT			assert
+#else
+#define	ASSERT(x)
+#endif
+
+/*
+ * Static tracepoints (USDT), for perf and bpftrace.  They are compiled in
+ * only if built with USDT=1 (requires <sys/sdt.h>); otherwise, no code.
+ */
+#ifdef LPM_USDT
+#include <sys/sdt.h>
+#define	LPM_TRACE2(name, a, b)		DTRACE_PROBE2(lpm, name, a, b)
+#define	LPM_TRACE3(name, a, b, c)	DTRACE_PROBE3(lpm, name, a, b, c)
+#define	LPM_TRACE4(name, a, b, c, d)	DTRACE_PROBE4(lpm, name, a, b, c, d)
+#else
+#define	LPM_TRACE2(name, a, b)
+#define	LPM_TRACE3(name, a, b, c)
+#define	LPM_TRACE4(name, a, b, c, d)
+#endif
+
+/*
+ * The entry caches the low bits of its hash, so that the resize does not
+ * need to recompute it, while still fitting in the space of the length.
+ */
+#define	LPM_HASH_BITS		(24)
+
+typedef struct lpm_ent {
+	struct lpm_ent *next;
+	void *		val;
+	unsigned	len : 8;	// up to LPM_MAX_KEYLEN
+	unsigned	hash : LPM_HASH_BITS;
+	uint8_t		key[];
+} lpm_ent_t;
+
+/*
+ * The hash map grows incrementally: on resize, the old bucket array is
+ * kept and its buckets are migrated to the new array a few at a time by
+ * the subsequent updates.  Until then, the lookups check both arrays.
+ */
+#define	LPM_REHASH_STEP		(8)
+
+/*
+ * Bloom filter of the hash map (LPM_F_BLOOM): a blocked filter, where
+ * a key sets three bits within a single 64-bit word.  There are
+ * about LPM_BLOOM_BITS bits per item, i.e. a few percent of false positives.
+ */
+#define	LPM_BLOOM_BITS		(8)
+#define	LPM_BLOOM_MINSIZE	(8)
+
+/*
+ * The number of the addresses looked up at once by the batch lookups.
+ */
+#define	LPM_LOOKUP_GROUP	(8)
+
+typedef struct {
+	unsigned	hashsize;
+	unsigned	nitems;
+	lpm_ent_t **	bucket;
+	uint64_t *	bloom;
+	unsigned	bloomsize;	// in words
+	unsigned	bloomstale;	// removals since the (re)build
+	lpm_ent_t **	oldbucket;
+	unsigned	oldsize;
+	unsigned	migrated;
+	void *		slab;	// contiguous entries, see lpm_compact()
+	size_t		entsize;	// bytes of the entries (and the slab)
+	unsigned *	shared;	// reference count, see lpm_snapshot()
+} lpm_hmap_t;
+
+/*
+ * Node-local memory allocator for the NUMA replicas: small objects are
+ * carved out of the chunks allocated on the node and recycled using the
+ * per-size-class free lists; larger objects are allocated directly.
+ */
+#define	LPM_NUMA_CHUNK		(64 * 1024)
+#define	LPM_NUMA_CLASS_SHIFT	(4)
+#define	LPM_NUMA_CLASSES	(16)
+#define	LPM_NUMA_MAXOBJ		(LPM_NUMA_CLASSES << LPM_NUMA_CLASS_SHIFT)
+
+typedef struct lpm_chunk {
+	struct lpm_chunk *next;
+} lpm_chunk_t;
+
+struct lpm {
+	uint32_t	bitmask[LPM_MAX_WORDS];
+	void *		defvals[LPM_MAX_KEYLEN + 1];
+	unsigned	flags;
+	bool		snapshot;	// read-only, see lpm_snapshot()
+
+	/* The secret seed of the hash function, see lpm_hash(). */
+	uint64_t	seed[2];
+
+	/* The /96 prefixes looked up as IPv4, see LPM_F_MAPPED. */
+	uint32_t	mapped[2][3];
+	unsigned	nmapped;
+
+	/* Generation: renewed on every update, see lpm_lookup_cached(). */
+	uint64_t	gen;
+
+	/*
+	 * Replicated mode: the lookups are served by the replica of the
+	 * NUMA node the calling thread runs on.  The table itself is the
+	 * first replica, therefore the cpu_replica array may point to it.
+	 */
+	lpm_t **	cpu_replica;
+	unsigned	ncpus;
+
+	lpm_hmap_t	prefix[LPM_MAX_PREFIX + 1];
+
+	/* Hash map tunables: max. load factor (%) and the growth shift. */
+	unsigned	max_load;
+	unsigned	growth_shift;
+
+	/* Sample every n-th lookup of a thread, see lpm_set_sampling(). */
+	unsigned	sample_period;
+
+	/* Bytes of the hash maps and the limit, see lpm_memory_usage(). */
+	size_t		memused;
+	size_t		memlimit;
+
+	lpm_t **	replicas;
+	unsigned	nreplicas;
+	int		node;
+
+	void *		freelist[LPM_NUMA_CLASSES];
+	lpm_chunk_t *	chunks;
+	size_t		chunk_used;
+};
+
+/*
+ * Replicas of the table: the table itself, if it is not replicated.
+ */
+#define	LPM_NREPLICAS(lpm)	((lpm)->nreplicas ? (lpm)->nreplicas : 1)
+#define	LPM_REPLICA(lpm, i)	((lpm)->nreplicas ? (lpm)->replicas[i] : (lpm))
+
+static inline lpm_t *
+lpm_local_replica(lpm_t *lpm)
+{
+#ifdef LPM_NUMA
+	if (__predict_false(lpm->cpu_replica)) {
+		const int cpu = sched_getcpu();
+
+		if ((unsigned)cpu < lpm->ncpus) {
+			return lpm->cpu_replica[cpu];
+		}
+	}
+#endif
+	return lpm;
+}
+
+/*
+ * fnv1a_hash: Fowler-Noll-Vo hash function (FNV-1a variant).
+ */
+static __always_inline uint32_t
+fnv1a_hash(const void *buf, size_t len)
+{
+	uint32_t hash = 2166136261UL;
+	const uint8_t *p = buf;
+
+	while (len--) {
+		hash ^= *p++;
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+/*
+ * Seeded hash function of the hash maps, with a secret random seed per
+ * table, so that the collisions cannot be crafted (e.g. a prefix list
+ * turning a bucket into a long chain).  The key is consumed 16 bytes at
+ * a time and mixed with the seed using either the AES rounds (if built
+ * with AES-NI) or the folded 64x64->128-bit multiplication.  Either way,
+ * an IPv4 or IPv6 key takes a single step.
+ *
+ * Note: CRC32C is not used, although cheap, as it is linear, i.e. the
+ * colliding keys collide regardless of the seed.
+ */
+#if defined(__AES__) && defined(__x86_64__)
+#include <wmmintrin.h>
+
+static __always_inline uint32_t
+lpm_hash_seed(const uint64_t *seed, const void *buf, size_t len)
+{
+	const __m128i key = _mm_loadu_si128((const __m128i *)seed);
+	__m128i h = _mm_xor_si128(key, _mm_cvtsi32_si128(len));
+	const uint8_t *p = buf;
+
+	for (;;) {
+		const size_t n = len < 16 ? len : 16;
+		uint64_t w[2] = { 0, 0 };
+
+		/* Note: the words, not a block, avoid the store forwarding. */
+		memcpy(w, p, n);
+		h = _mm_xor_si128(h, _mm_set_epi64x(w[1], w[0]));
+		h = _mm_aesenc_si128(h, key);
+		if ((len -= n) == 0) {
+			break;
+		}
+		p += n;
+	}
+	h = _mm_aesenc_si128(h, key);
+	return _mm_cvtsi128_si32(h);
+}
+#else
+static __always_inline uint64_t
+lpm_hash_mum(uint64_t a, uint64_t b)
+{
+#ifdef __SIZEOF_INT128__
+	const __uint128_t r = (__uint128_t)a * b;
+	return (uint64_t)r ^ (uint64_t)(r >> 64);
+#else
+	const uint64_t ha = a >> 32, la = (uint32_t)a;
+	const uint64_t hb = b >> 32, lb = (uint32_t)b;
+	const uint64_t m0 = ha * lb, m1 = la * hb, l = la * lb;
+	const uint64_t t = l + (m0 << 32), lo = t + (m1 << 32);
+	const uint64_t hi = ha * hb + (m0 >> 32) + (m1 >> 32) +
+	    (t < l) + (lo < t);
+	return lo ^ hi;
+#endif
+}
+
+static __always_inline uint32_t
+lpm_hash_seed(const uint64_t *seed, const void *buf, size_t len)
+{
+	uint64_t h = seed[0] ^ len;
+	const uint8_t *p = buf;
+
+	for (;;) {
+		const size_t n = len < 16 ? len : 16;
+		uint64_t w[2] = { 0, 0 };
+
+		memcpy(w, p, n);
+		h = lpm_hash_mum(w[0] ^ seed[1], w[1] ^ h);
+		if ((len -= n) == 0) {
+			break;
+		}
+		p += n;
+	}
+	h = lpm_hash_mum(h ^ seed[0], seed[1]);
+	return (uint32_t)(h ^ (h >> 32));
+}
+#endif
+
+static __always_inline uint32_t
+lpm_hash(const lpm_t *lpm, const void *buf, size_t len)
+{
+	return lpm_hash_seed(lpm->seed, buf, len);
+}
+
+static __always_inline lpm_ent_t *
+hashmap_chain_lookup(lpm_ent_t *entry, const void *key, size_t len)
+{
+	while (entry) {
+		if (entry->len == len && memcmp(entry->key, key, len) == 0) {
+			return entry;
+		}
+		entry = entry->next;
+	}
+	return NULL;
+}
+
+static __always_inline lpm_ent_t *
+hashmap_lookup_hash(lpm_hmap_t *hmap, uint32_t hash, const void *key,
+    size_t len)
+{
+	const unsigned i = hash & (hmap->hashsize - 1);
+	lpm_ent_t *entry;
+
+	if (hmap->hashsize == 0) {
+		return NULL;
+	}
+	entry = hashmap_chain_lookup(hmap->bucket[i], key, len);
+	if (__predict_false(entry == NULL && hmap->oldbucket)) {
+		/* Resize in progress: the entry may not be migrated yet. */
+		const unsigned j = hash & (hmap->oldsize - 1);
+		entry = hashmap_chain_lookup(hmap->oldbucket[j], key, len);
+	}
+	return entry;
+}
+
+static __always_inline lpm_ent_t *
+hashmap_lookup(const lpm_t *lpm, lpm_hmap_t *hmap, const void *key,
+    size_t len)
+{
+	return hashmap_lookup_hash(hmap, lpm_hash(lpm, key, len), key, len);
+}
+
+static __always_inline uint64_t
+lpm_bloom_mask(uint32_t hash)
+{
+	/* The word is selected by the low bits; remix for the bits. */
+	const uint32_t h = hash * 0x9e3779b1U;
+	return (1ULL << (h >> 26)) | (1ULL << ((h >> 20) & 63)) |
+	    (1ULL << ((h >> 14) & 63));
+}
+
+/*
+ * lpm_bloom_test: whether the key with the given hash may be in the
+ * hash map; true if there is no filter.
+ */
+static __always_inline bool
+lpm_bloom_test(const lpm_hmap_t *hmap, uint32_t hash)
+{
+	const uint64_t mask = lpm_bloom_mask(hash);
+
+	if (hmap->bloom == NULL) {
+		return true;
+	}
+	return (hmap->bloom[hash & (hmap->bloomsize - 1)] & mask) == mask;
+}
+
+/*
+ * compute_prefix: given the key and prefix length, compute and
+ * return the key prefix.  The buffer must have LPM_TO_WORDS(len)
+ * words; any trailing bytes past the key length are zeroed.
+ */
+static __always_inline void
+compute_prefix(const size_t len, const void *addr,
+    unsigned preflen, uint32_t *prefix)
+{
+	const unsigned nwords = LPM_TO_WORDS(len);
+	uint32_t addr2[LPM_MAX_WORDS];
+	const uint32_t *a = addr;
+
+	if ((len & 3) != 0 || ((uintptr_t)addr & 3) != 0) {
+		/* Partial word or unaligned address: just copy for now. */
+		addr2[nwords - 1] = 0;
+		memcpy(addr2, addr, len);
+		a = addr2;
+	}
+	for (unsigned i = 0; i < nwords; i++) {
+		if (preflen == 0) {
+			prefix[i] = 0;
+			continue;
+		}
+		if (preflen < 32) {
+			uint32_t mask = htonl(0xffffffff << (32 - preflen));
+			prefix[i] = a[i] & mask;
+			preflen = 0;
+		} else {
+			prefix[i] = a[i];
+			preflen -= 32;
+		}
+	}
+}
+
+/*
+ * lpm_bitmask: return the n-th word of the bitmask of the populated
+ * prefix lengths, masking the lengths exceeding the key length.
+ */
+static __always_inline uint32_t
+lpm_bitmask(const lpm_t *lpm, const size_t len, unsigned n)
+{
+	const unsigned rem = (len & 3) * 8;
+	uint32_t bitmask = lpm->bitmask[n];
+
+	if (rem && n == LPM_TO_WORDS(len) - 1) {
+		bitmask &= 0xffffffffU << (32 - rem);
+	}
+	return bitmask;
+}
+
+/*
+ * Internal interfaces.
+ */
+
+void *		lpm_alloc(lpm_t *, size_t);
+void *		lpm_zalloc(lpm_t *, size_t);
+void		lpm_free(lpm_t *, void *, size_t);
+bool		lpm_mem_charge(lpm_t *, size_t);
+uint64_t	lpm_gen_next(void);
+
+void		lpm_hash_init(uint64_t *, uint64_t);
+bool		lpm_hashmap_rehash(lpm_t *, lpm_hmap_t *, unsigned);
+bool		lpm_hashmap_reserve(lpm_t *, lpm_hmap_t *, unsigned);
+unsigned	lpm_hashmap_size(const lpm_t *, unsigned);
+void		lpm_hashmap_settle(lpm_t *, lpm_hmap_t *);
+bool		lpm_hashmap_own(lpm_t *, lpm_hmap_t *);
+lpm_ent_t *	lpm_hashmap_insert(lpm_t *, lpm_hmap_t *, const void *, size_t);
+int		lpm_hashmap_remove(lpm_t *, lpm_hmap_t *, const void *, size_t);
+void *		lpm_hashmap_alloc(lpm_t *, size_t, bool);
+void		lpm_hashmap_free(lpm_t *, void *, size_t);
+void		lpm_hashmap_free_entry(lpm_t *, lpm_hmap_t *, lpm_ent_t *);
+void		lpm_bloom_rebuild(lpm_t *, lpm_hmap_t *);
+
+lpm_ent_t *	lpm_lookup_entry(lpm_t *, const void *, size_t, unsigned);
+int		lpm_walk(lpm_t *, int (*)(lpm_ent_t *, unsigned, void *), void *);
+
+#endif
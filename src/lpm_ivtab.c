@@ -0,0 +1,384 @@
+/*
+ * Copyright (c) 2016 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Immutable interval table: an alternative lookup structure for the
+ * large, flat prefix sets (e.g. the blocklists of mostly /32 and /128
+ * entries), built from an LPM table.
+ *
+ * The prefixes of each key length are converted into a sorted array of
+ * the non-overlapping intervals, where an interval is represented by its
+ * start (the boundary) and the value covering it.  The keys are stored
+ * as the host byte order words, so that they can be compared as numbers.
+ *
+ * The boundaries are stored in the Eytzinger (BFS) order: the search is
+ * a branchless descent over an implicit binary tree, where the top levels
+ * share the cache lines and the next levels can be prefetched.  The search
+ * finds the first boundary greater than the key; each boundary is stored
+ * with the value of the interval preceding it, while the slot 0 holds the
+ * value of the last interval (the search ends there if there is no such
+ * boundary).  Therefore, the lookup is a single search per key.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <strings.h>
+
+#include "lpm.h"
+#include "lpm_impl.h"
+
+typedef struct {
+	unsigned	nwords;
+	size_t		n;
+	uint32_t *	keys;
+	void **		vals;
+} lpm_ivset_t;
+
+struct lpm_ivtab {
+	lpm_ivset_t	sets[LPM_MAX_KEYLEN + 1];
+};
+
+/*
+ * The prefix or the boundary during the construction.
+ */
+typedef struct {
+	uint32_t	start[LPM_MAX_WORDS];
+	unsigned	preflen;
+	void *		val;
+} lpm_ivpfx_t;
+
+typedef struct {
+	lpm_ivpfx_t *	pfx[LPM_MAX_KEYLEN + 1];
+	size_t		count[LPM_MAX_KEYLEN + 1];
+} lpm_ivbuild_t;
+
+/*
+ * ivtab_key: convert the key into the host byte order words, zero-padded.
+ */
+static __always_inline void
+ivtab_key(const size_t len, const void *addr, uint32_t *words)
+{
+	const unsigned nwords = LPM_TO_WORDS(len);
+
+	words[nwords - 1] = 0;
+	memcpy(words, addr, len);
+	for (unsigned i = 0; i < nwords; i++) {
+		words[i] = ntohl(words[i]);
+	}
+}
+
+static inline int
+ivtab_cmp(const uint32_t *a, const uint32_t *b, unsigned nwords)
+{
+	for (unsigned i = 0; i < nwords; i++) {
+		if (a[i] != b[i]) {
+			return a[i] < b[i] ? -1 : 1;
+		}
+	}
+	return 0;
+}
+
+static int
+ivtab_pfx_cmp(const void *p1, const void *p2)
+{
+	const lpm_ivpfx_t *a = p1, *b = p2;
+	int ret;
+
+	/* Order by the start; the enclosing (shorter) prefix first. */
+	if ((ret = ivtab_cmp(a->start, b->start, LPM_MAX_WORDS)) != 0) {
+		return ret;
+	}
+	return (a->preflen > b->preflen) - (a->preflen < b->preflen);
+}
+
+/*
+ * ivtab_end: compute the last key covered by the prefix.
+ */
+static void
+ivtab_end(const lpm_ivpfx_t *p, size_t len, uint32_t *end)
+{
+	const unsigned nwords = LPM_TO_WORDS(len);
+	unsigned preflen = p->preflen;
+
+	for (unsigned i = 0; i < nwords; i++) {
+		if (preflen >= 32) {
+			end[i] = p->start[i];
+			preflen -= 32;
+		} else {
+			end[i] = p->start[i] | (0xffffffffU >> preflen);
+			preflen = 0;
+		}
+	}
+	/* Clear the padding of a partial last word. */
+	if (len & 3) {
+		end[nwords - 1] &= 0xffffffffU << ((4 - (len & 3)) * 8);
+	}
+}
+
+/*
+ * ivtab_next: compute the key following the given one.
+ *
+ * => Returns false on overflow, i.e. if the key was the last one.
+ */
+static bool
+ivtab_next(const uint32_t *key, size_t len, uint32_t *next)
+{
+	const unsigned nwords = LPM_TO_WORDS(len);
+	uint32_t step = 1U << ((len & 3) ? (4 - (len & 3)) * 8 : 0);
+
+	memcpy(next, key, nwords * sizeof(uint32_t));
+	for (unsigned i = nwords; i-- > 0;) {
+		next[i] += step;
+		if (next[i] >= step) {
+			return true;
+		}
+		step = 1;
+	}
+	return false;
+}
+
+static int
+ivtab_count(lpm_ent_t *entry, unsigned preflen, void *arg)
+{
+	lpm_ivbuild_t *b = arg;
+
+	b->count[entry->len]++;
+	(void)preflen;
+	return 0;
+}
+
+static int
+ivtab_collect(lpm_ent_t *entry, unsigned preflen, void *arg)
+{
+	lpm_ivbuild_t *b = arg;
+	lpm_ivpfx_t *p = &b->pfx[entry->len][b->count[entry->len]++];
+
+	memset(p->start, 0, sizeof(p->start));
+	ivtab_key(entry->len, entry->key, p->start);
+	p->preflen = preflen;
+	p->val = entry->val;
+	return 0;
+}
+
+static void
+ivtab_emit(lpm_ivpfx_t *out, size_t *m, const uint32_t *start,
+    unsigned nwords, void *val)
+{
+	/* A later boundary at the same key overrides. */
+	if (*m && ivtab_cmp(out[*m - 1].start, start, nwords) == 0) {
+		out[*m - 1].val = val;
+		return;
+	}
+	memcpy(out[*m].start, start, nwords * sizeof(uint32_t));
+	out[(*m)++].val = val;
+}
+
+static size_t
+ivtab_fill(lpm_ivset_t *set, const lpm_ivpfx_t *bounds, size_t i, size_t k)
+{
+	const unsigned nwords = set->nwords;
+
+	if (k <= set->n) {
+		i = ivtab_fill(set, bounds, i, 2 * k);
+		memcpy(&set->keys[k * nwords], bounds[i + 1].start,
+		    nwords * sizeof(uint32_t));
+		set->vals[k] = bounds[i].val;
+		i = ivtab_fill(set, bounds, i + 1, 2 * k + 1);
+	}
+	return i;
+}
+
+/*
+ * ivtab_build_set: convert the prefixes of the given key length into
+ * the intervals and construct the search array.
+ */
+static int
+ivtab_build_set(lpm_ivset_t *set, lpm_ivpfx_t *pfx, size_t count,
+    size_t len, void *defval)
+{
+	const unsigned nwords = LPM_TO_WORDS(len);
+	const lpm_ivpfx_t *stack[LPM_MAX_PREFIX + 1];
+	uint32_t end[LPM_MAX_WORDS], next[LPM_MAX_WORDS];
+	static const uint32_t zero[LPM_MAX_WORDS];
+	lpm_ivpfx_t *bounds;
+	unsigned depth = 0;
+	size_t m = 0, n = 0;
+
+	/* Each prefix adds at most two boundaries. */
+	if ((bounds = calloc(2 * count + 1, sizeof(lpm_ivpfx_t))) == NULL) {
+		return -1;
+	}
+	if (count) {
+		qsort(pfx, count, sizeof(lpm_ivpfx_t), ivtab_pfx_cmp);
+	}
+
+	/*
+	 * Sweep the prefixes in the order of their start, maintaining
+	 * the stack of the enclosing prefixes.  When a prefix ends, the
+	 * enclosing prefix (or the default) takes over.
+	 */
+	ivtab_emit(bounds, &m, zero, nwords, defval);
+	for (size_t i = 0; i <= count; i++) {
+		while (depth) {
+			const lpm_ivpfx_t *top = stack[depth - 1];
+
+			ivtab_end(top, len, end);
+			if (i < count && ivtab_cmp(end, pfx[i].start, nwords) >= 0) {
+				break;
+			}
+			depth--;
+			if (ivtab_next(end, len, next)) {
+				ivtab_emit(bounds, &m, next, nwords,
+				    depth ? stack[depth - 1]->val : defval);
+			}
+		}
+		if (i < count) {
+			stack[depth++] = &pfx[i];
+			ivtab_emit(bounds, &m, pfx[i].start, nwords, pfx[i].val);
+		}
+	}
+
+	/* Merge the adjacent intervals with the same value. */
+	for (size_t i = 1; i < m; i++) {
+		if (bounds[i].val != bounds[n].val) {
+			bounds[++n] = bounds[i];
+		}
+	}
+
+	/*
+	 * The first boundary is always zero, therefore only the following
+	 * ones are stored.  The slot 0 gets the value of the last interval.
+	 */
+	set->nwords = nwords;
+	set->n = n;
+	set->keys = malloc((n + 1) * nwords * sizeof(uint32_t));
+	set->vals = malloc((n + 1) * sizeof(void *));
+	if (set->keys == NULL || set->vals == NULL) {
+		free(bounds);
+		return -1;
+	}
+	memset(set->keys, 0, nwords * sizeof(uint32_t));
+	set->vals[0] = bounds[n].val;
+	ivtab_fill(set, bounds, 0, 1);
+	free(bounds);
+	return 0;
+}
+
+/*
+ * lpm_ivtab_build: construct the interval table with the contents of
+ * the given LPM table, answering the lookups identically.
+ *
+ * => The tables with LPM_F_MAPPED are not supported: the fallthrough of
+ *    the mapped addresses to the IPv4 prefixes is not expanded.
+ * => Returns the new interval table or NULL on failure.
+ */
+lpm_ivtab_t *
+lpm_ivtab_build(lpm_t *lpm)
+{
+	lpm_ivbuild_t b;
+	lpm_ivtab_t *ivtab;
+	int ret = 0;
+
+	if ((lpm->flags & LPM_F_MAPPED) != 0) {
+		return NULL;
+	}
+	if ((ivtab = calloc(1, sizeof(lpm_ivtab_t))) == NULL) {
+		return NULL;
+	}
+	memset(&b, 0, sizeof(b));
+	lpm_walk(lpm, ivtab_count, &b);
+	for (unsigned len = 1; len <= LPM_MAX_KEYLEN; len++) {
+		if (b.count[len] == 0) {
+			continue;
+		}
+		b.pfx[len] = malloc(b.count[len] * sizeof(lpm_ivpfx_t));
+		if (b.pfx[len] == NULL) {
+			ret = -1;
+		}
+		b.count[len] = 0;
+	}
+	if (ret == 0) {
+		lpm_walk(lpm, ivtab_collect, &b);
+	}
+	for (unsigned len = 1; len <= LPM_MAX_KEYLEN; len++) {
+		void *defval = lpm->defvals[len];
+
+		if (ret == 0 && (b.count[len] || defval)) {
+			ret = ivtab_build_set(&ivtab->sets[len],
+			    b.pfx[len], b.count[len], len, defval);
+		}
+		free(b.pfx[len]);
+	}
+	if (ret == -1) {
+		lpm_ivtab_destroy(ivtab);
+		return NULL;
+	}
+	return ivtab;
+}
+
+void
+lpm_ivtab_destroy(lpm_ivtab_t *ivtab)
+{
+	for (unsigned len = 1; len <= LPM_MAX_KEYLEN; len++) {
+		free(ivtab->sets[len].keys);
+		free(ivtab->sets[len].vals);
+	}
+	free(ivtab);
+}
+
+static __always_inline void *
+lpm_ivtab_lookup_len(const lpm_ivset_t *set, const void *addr,
+    const size_t len)
+{
+	const unsigned nwords = LPM_TO_WORDS(len);
+	const uint32_t *keys = set->keys;
+	uint32_t key[nwords];
+	size_t k = 1;
+
+	ivtab_key(len, addr, key);
+	while (k <= set->n) {
+		/* Prefetch the descendants four levels below. */
+		__builtin_prefetch(&keys[16 * k * nwords]);
+		k = 2 * k + (ivtab_cmp(&keys[k * nwords], key, nwords) <= 0);
+	}
+
+	/*
+	 * Cancel the right turns after the last left turn, i.e. get the
+	 * first boundary greater than the key (or zero if none).
+	 */
+	k >>= __builtin_ffsl(~k);
+	return set->vals[k];
+}
+
+/*
+ * lpm_ivtab_lookup: find the longest matching prefix given the address.
+ *
+ * => Returns the associated value on success or NULL on failure.
+ */
+void *
+lpm_ivtab_lookup(const lpm_ivtab_t *ivtab, const void *addr, size_t len)
+{
+	const lpm_ivset_t *set;
+
+	ASSERT(LPM_VALID_LEN(len));
+	set = &ivtab->sets[len];
+	if (__predict_false(set->vals == NULL)) {
+		return NULL;
+	}
+
+	/* Specialise for IPv4 and IPv6. */
+	switch (len) {
+	case 4:
+		return lpm_ivtab_lookup_len(set, addr, 4);
+	case 16:
+		return lpm_ivtab_lookup_len(set, addr, 16);
+	default:
+		return lpm_ivtab_lookup_len(set, addr, len);
+	}
+}
@@ -0,0 +1,401 @@
+/*
+ * Copyright (c) 2016 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Update queue: the insertions and removals are enqueued by any number of
+ * threads and applied to the table by a single writer thread, in batches.
+ *
+ * The queue is a bounded ring of slots.  A producer takes a ticket (the
+ * sequence number of the update) with a single atomic increment, waits
+ * for the slot of the ticket to be free (i.e. only if the ring is full),
+ * fills it and marks it ready.  The writer consumes the slots in the
+ * ticket order, so the updates are applied in the order of the tickets
+ * and the updates of a thread are applied in its program order.  Hence,
+ * the writer has applied all updates up to the sequence number of the
+ * last slot it consumed, which is what lpm_queue_wait() waits for.
+ *
+ * Each batch is coalesced: only the last update of a prefix is applied,
+ * e.g. an insertion followed by a removal of the same prefix is dropped.
+ * The hash maps are pre-sized for the insertions of the batch and any
+ * incremental resize is completed, so the rehash is done once per batch
+ * instead of spreading over the updates.  Then the publish callback, if
+ * any, is called, e.g. to take a snapshot for the readers.
+ *
+ * The writer sleeps if the queue is empty: a producer wakes it up only
+ * if it has set the sleeping flag, so there is no locking while busy.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "lpm.h"
+#include "lpm_impl.h"
+
+#define	LPM_QUEUE_SLOTS		(64 * 1024)	// must be a power of 2
+#define	LPM_QUEUE_BATCH		(4096)
+#define	LPM_QUEUE_HASHSIZE	(2 * LPM_QUEUE_BATCH)
+
+typedef struct {
+	uint8_t		len;
+	bool		insert;
+	bool		superseded;	// a later update of the prefix
+	bool		inserted;	// an earlier insertion of the prefix
+	uint16_t	preflen;
+	void *		val;
+	uint32_t	key[LPM_MAX_WORDS];
+} lpm_qop_t;
+
+typedef struct {
+	uint64_t	seq;		// ticket + 1 if ready
+	lpm_qop_t	op;
+} lpm_qslot_t;
+
+struct lpm_queue {
+	lpm_t *		lpm;
+	lpm_publish_t	publish;
+	void *		arg;
+	lpm_qslot_t *	slots;
+
+	/* Producers. */
+	uint64_t	tail __attribute__((aligned(64)));
+
+	/* Writer. */
+	uint64_t	head __attribute__((aligned(64)));
+	uint64_t	done;
+	bool		sleeping;
+	bool		stop;
+	pthread_t	thread;
+	pthread_mutex_t	lock;
+	pthread_cond_t	wakeup;
+	pthread_cond_t	applied;
+	lpm_qop_t	batch[LPM_QUEUE_BATCH];
+	int		hash[LPM_QUEUE_HASHSIZE];
+	unsigned	ninserts[LPM_MAX_PREFIX + 1];
+	uint64_t	napplied;
+	uint64_t	ncoalesced;
+	uint64_t	nfailed;
+};
+
+static inline bool
+queue_ready(const lpm_queue_t *q)
+{
+	const lpm_qslot_t *slot = &q->slots[q->head & (LPM_QUEUE_SLOTS - 1)];
+	return __atomic_load_n(&slot->seq, __ATOMIC_SEQ_CST) == q->head + 1;
+}
+
+/*
+ * queue_drain: copy out the ready updates (up to a batch) and free the
+ * slots for the producers.
+ */
+static unsigned
+queue_drain(lpm_queue_t *q)
+{
+	unsigned n = 0;
+
+	while (n < LPM_QUEUE_BATCH && queue_ready(q)) {
+		lpm_qslot_t *slot = &q->slots[q->head & (LPM_QUEUE_SLOTS - 1)];
+
+		q->batch[n++] = slot->op;
+		__atomic_store_n(&slot->seq, q->head + LPM_QUEUE_SLOTS,
+		    __ATOMIC_RELEASE);
+		q->head++;
+	}
+	return n;
+}
+
+static inline bool
+queue_op_equal(const lpm_qop_t *a, const lpm_qop_t *b)
+{
+	return a->len == b->len && a->preflen == b->preflen &&
+	    memcmp(a->key, b->key, a->len) == 0;
+}
+
+/*
+ * queue_coalesce: mark the updates superseded by a later update of the
+ * same prefix and count the remaining insertions of each prefix length.
+ */
+static void
+queue_coalesce(lpm_queue_t *q, unsigned n)
+{
+	const unsigned mask = LPM_QUEUE_HASHSIZE - 1;
+
+	memset(q->hash, 0xff, sizeof(q->hash));
+	memset(q->ninserts, 0, sizeof(q->ninserts));
+
+	for (unsigned i = 0; i < n; i++) {
+		lpm_qop_t *op = &q->batch[i];
+		const uint32_t hash = lpm_hash(q->lpm, op->key, op->len);
+		unsigned h = (hash ^ op->preflen) & mask;
+
+		while (q->hash[h] != -1) {
+			lpm_qop_t *prev = &q->batch[q->hash[h]];
+
+			if (queue_op_equal(prev, op)) {
+				prev->superseded = true;
+				op->inserted = prev->inserted || prev->insert;
+				q->ninserts[prev->preflen] -= prev->insert;
+				q->ncoalesced++;
+				break;
+			}
+			h = (h + 1) & mask;
+		}
+		q->hash[h] = i;
+		q->ninserts[op->preflen] += op->insert;
+	}
+}
+
+/*
+ * queue_reserve: pre-size the hash maps for the insertions, if needed,
+ * growing them geometrically.
+ */
+static void
+queue_reserve(lpm_queue_t *q)
+{
+	lpm_t *lpm = q->lpm;
+
+	for (unsigned n = 1; n <= LPM_MAX_PREFIX; n++) {
+		const lpm_hmap_t *hmap = &lpm->prefix[n];
+		unsigned nitems;
+
+		if (q->ninserts[n] == 0) {
+			continue;
+		}
+		nitems = hmap->nitems + q->ninserts[n];
+		if ((uint64_t)nitems * 100 <=
+		    (uint64_t)hmap->hashsize * lpm->max_load) {
+			continue;
+		}
+		if (nitems < (hmap->nitems << lpm->growth_shift)) {
+			nitems = hmap->nitems << lpm->growth_shift;
+		}
+		/* The key lengths share the hash map; best effort. */
+		(void)lpm_reserve(lpm, LPM_MAX_KEYLEN, n, nitems);
+	}
+}
+
+static void
+queue_apply(lpm_queue_t *q, unsigned n)
+{
+	lpm_t *lpm = q->lpm;
+
+	queue_coalesce(q, n);
+	queue_reserve(q);
+
+	for (unsigned i = 0; i < n; i++) {
+		const lpm_qop_t *op = &q->batch[i];
+		int ret;
+
+		if (op->superseded) {
+			continue;
+		}
+		if (op->insert) {
+			ret = lpm_insert(lpm, op->key, op->len,
+			    op->preflen, op->val);
+		} else {
+			ret = lpm_remove(lpm, op->key, op->len, op->preflen);
+			/* Inserted and removed within the batch: not a failure. */
+			ret = op->inserted ? 0 : ret;
+		}
+		q->nfailed += (ret == -1);
+		q->napplied++;
+	}
+}
+
+static void *
+queue_writer(void *arg)
+{
+	lpm_queue_t *q = arg;
+
+	for (;;) {
+		unsigned n;
+		bool stop;
+
+		if ((n = queue_drain(q)) != 0) {
+			queue_apply(q, n);
+			if (q->publish) {
+				q->publish(q->arg, q->lpm, q->head);
+			}
+			pthread_mutex_lock(&q->lock);
+			__atomic_store_n(&q->done, q->head, __ATOMIC_RELEASE);
+			pthread_cond_broadcast(&q->applied);
+			pthread_mutex_unlock(&q->lock);
+			continue;
+		}
+
+		/*
+		 * Empty: sleep.  Set the flag before checking the queue
+		 * again, while the producer marks the slot ready before
+		 * checking the flag, so one of them sees the other.
+		 */
+		pthread_mutex_lock(&q->lock);
+		__atomic_store_n(&q->sleeping, true, __ATOMIC_SEQ_CST);
+		while (!queue_ready(q) && !q->stop) {
+			pthread_cond_wait(&q->wakeup, &q->lock);
+		}
+		__atomic_store_n(&q->sleeping, false, __ATOMIC_RELAXED);
+		stop = q->stop && !queue_ready(q);
+		pthread_mutex_unlock(&q->lock);
+		if (stop) {
+			break;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * lpm_queue_create: construct the update queue of the given table and
+ * start its writer thread.  The publish callback, if not NULL, is called
+ * by the writer after each batch of the updates.
+ *
+ * => Returns the new queue or NULL on failure.
+ */
+lpm_queue_t *
+lpm_queue_create(lpm_t *lpm, lpm_publish_t publish, void *arg)
+{
+	lpm_queue_t *q;
+
+	if ((q = calloc(1, sizeof(lpm_queue_t))) == NULL) {
+		return NULL;
+	}
+	q->lpm = lpm;
+	q->publish = publish;
+	q->arg = arg;
+	if ((q->slots = malloc(LPM_QUEUE_SLOTS * sizeof(lpm_qslot_t))) == NULL) {
+		free(q);
+		return NULL;
+	}
+	for (unsigned i = 0; i < LPM_QUEUE_SLOTS; i++) {
+		q->slots[i].seq = i;
+	}
+	pthread_mutex_init(&q->lock, NULL);
+	pthread_cond_init(&q->wakeup, NULL);
+	pthread_cond_init(&q->applied, NULL);
+	if (pthread_create(&q->thread, NULL, queue_writer, q) != 0) {
+		pthread_cond_destroy(&q->applied);
+		pthread_cond_destroy(&q->wakeup);
+		pthread_mutex_destroy(&q->lock);
+		free(q->slots);
+		free(q);
+		return NULL;
+	}
+	return q;
+}
+
+/*
+ * lpm_queue_destroy: apply the remaining updates, stop the writer and
+ * destroy the queue.
+ *
+ * => There must be no concurrent enqueue.
+ */
+void
+lpm_queue_destroy(lpm_queue_t *q)
+{
+	pthread_mutex_lock(&q->lock);
+	q->stop = true;
+	pthread_cond_signal(&q->wakeup);
+	pthread_mutex_unlock(&q->lock);
+	pthread_join(q->thread, NULL);
+
+	pthread_cond_destroy(&q->applied);
+	pthread_cond_destroy(&q->wakeup);
+	pthread_mutex_destroy(&q->lock);
+	free(q->slots);
+	free(q);
+}
+
+static uint64_t
+queue_enqueue(lpm_queue_t *q, const void *addr, size_t len,
+    unsigned preflen, void *val, bool insert)
+{
+	const uint64_t ticket = __atomic_fetch_add(&q->tail, 1,
+	    __ATOMIC_RELAXED);
+	lpm_qslot_t *slot = &q->slots[ticket & (LPM_QUEUE_SLOTS - 1)];
+	lpm_qop_t *op = &slot->op;
+
+	ASSERT(LPM_VALID_LEN(len) && preflen <= len * 8);
+
+	/* Wait for the slot, if the ring is full. */
+	while (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ticket) {
+		sched_yield();
+	}
+
+	op->len = len;
+	op->preflen = preflen;
+	op->insert = insert;
+	op->superseded = false;
+	op->inserted = false;
+	op->val = val;
+	compute_prefix(len, addr, preflen, op->key);
+	__atomic_store_n(&slot->seq, ticket + 1, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&q->sleeping, __ATOMIC_SEQ_CST)) {
+		pthread_mutex_lock(&q->lock);
+		pthread_cond_signal(&q->wakeup);
+		pthread_mutex_unlock(&q->lock);
+	}
+	return ticket + 1;
+}
+
+/*
+ * lpm_queue_insert: enqueue the insertion of the prefix, see lpm_insert().
+ *
+ * => Returns the sequence number of the update.
+ */
+uint64_t
+lpm_queue_insert(lpm_queue_t *q, const void *addr, size_t len,
+    unsigned preflen, void *val)
+{
+	return queue_enqueue(q, addr, len, preflen, val, true);
+}
+
+/*
+ * lpm_queue_remove: enqueue the removal of the prefix, see lpm_remove().
+ *
+ * => Returns the sequence number of the update.
+ */
+uint64_t
+lpm_queue_remove(lpm_queue_t *q, const void *addr, size_t len,
+    unsigned preflen)
+{
+	return queue_enqueue(q, addr, len, preflen, NULL, false);
+}
+
+/*
+ * lpm_queue_wait: wait until the update of the given sequence number and
+ * all the preceding ones are applied and published.
+ */
+void
+lpm_queue_wait(lpm_queue_t *q, uint64_t seq)
+{
+	if (__atomic_load_n(&q->done, __ATOMIC_ACQUIRE) >= seq) {
+		return;
+	}
+	pthread_mutex_lock(&q->lock);
+	while (__atomic_load_n(&q->done, __ATOMIC_RELAXED) < seq) {
+		pthread_cond_wait(&q->applied, &q->lock);
+	}
+	pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ * lpm_queue_stats: the number of the updates applied, dropped by the
+ * coalescing and failed (e.g. the removal of a missing prefix).
+ *
+ * => Consistent only after lpm_queue_wait().
+ */
+void
+lpm_queue_stats(const lpm_queue_t *q, uint64_t *applied,
+    uint64_t *coalesced, uint64_t *failed)
+{
+	*applied = q->napplied;
+	*coalesced = q->ncoalesced;
+	*failed = q->nfailed;
+}
@@ -0,0 +1,321 @@
+/*
+ * Copyright (c) 2016 Mindaugas Rasiukevicius <rmind at noxt eu>
+ * All rights reserved.
+ *
+ * Use is subject to license terms, as specified in the LICENSE file.
+ */
+
+/*
+ * Multi-tenant (VRF) LPM table: many logical IPv4/IPv6 tables in one
+ * shared structure.
+ *
+ * The prefixes of all tenants are stored in the per-prefix-length hash
+ * maps of a single LPM table, with the key being the VRF ID followed by
+ * the address.  Each tenant only has a small record with its own bitmap
+ * of the populated prefix lengths and its defaults, found by a single
+ * hash map lookup.  Therefore, the lookup is one traversal of the shared
+ * structure, probing only the prefix lengths used by the tenant.
+ *
+ * Note: the prefix lengths are not cleared from the tenant bitmap on
+ * removal (it would require per-length counters), so a tenant which had
+ * its prefixes removed may probe some empty lengths until it is emptied.
+ */
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <strings.h>
+
+#include "lpm.h"
+#include "lpm_impl.h"
+
+#define	LPM_VRF_IDLEN		(sizeof(uint32_t))
+#define	LPM_VRF_WORDS		(128 >> 5)
+#define	LPM_VRF_MAXKEY		(LPM_VRF_IDLEN + 16)
+#define	LPM_VRF_DEFIDX(len)	((len) >> 4)
+
+typedef struct {
+	uint32_t	bitmask[LPM_VRF_WORDS];
+	void *		defvals[2];
+	unsigned	nitems;
+} lpm_tenant_t;
+
+struct lpm_vrf {
+	lpm_t *		lpm;
+	lpm_hmap_t	tenants;
+};
+
+lpm_vrf_t *
+lpm_vrf_create(void)
+{
+	lpm_vrf_t *vrf;
+
+	if ((vrf = calloc(1, sizeof(lpm_vrf_t))) == NULL) {
+		return NULL;
+	}
+	if ((vrf->lpm = lpm_create()) == NULL) {
+		free(vrf);
+		return NULL;
+	}
+	return vrf;
+}
+
+typedef struct {
+	lpm_dtor_t	dtor;
+	void *		arg;
+} lpm_vrf_dtor_t;
+
+static int
+lpm_vrf_dtor(lpm_ent_t *entry, unsigned preflen, void *arg)
+{
+	lpm_vrf_dtor_t *ctx = arg;
+
+	/* Pass the address without the VRF ID. */
+	ctx->dtor(ctx->arg, entry->key + LPM_VRF_IDLEN,
+	    entry->len - LPM_VRF_IDLEN, entry->val);
+	(void)preflen;
+	return 0;
+}
+
+void
+lpm_vrf_clear(lpm_vrf_t *vrf, lpm_dtor_t dtor, void *arg)
+{
+	lpm_hmap_t *hmap = &vrf->tenants;
+	static const uint32_t zero_address[4];
+
+	if (dtor) {
+		lpm_vrf_dtor_t ctx = { .dtor = dtor, .arg = arg };
+		lpm_walk(vrf->lpm, lpm_vrf_dtor, &ctx);
+	}
+	lpm_clear(vrf->lpm, NULL, NULL);
+
+	lpm_hashmap_settle(vrf->lpm, hmap);
+	for (unsigned i = 0; i < hmap->hashsize; i++) {
+		lpm_ent_t *entry = hmap->bucket[i];
+
+		while (entry) {
+			lpm_ent_t *next = entry->next;
+			lpm_tenant_t *t = entry->val;
+
+			if (dtor && t->defvals[0]) {
+				dtor(arg, zero_address, 4, t->defvals[0]);
+			}
+			if (dtor && t->defvals[1]) {
+				dtor(arg, zero_address, 16, t->defvals[1]);
+			}
+			lpm_hashmap_free(vrf->lpm, t, sizeof(lpm_tenant_t));
+			lpm_hashmap_free_entry(vrf->lpm, hmap, entry);
+			entry = next;
+		}
+	}
+	lpm_hashmap_free(vrf->lpm, hmap->bloom,
+	    hmap->bloomsize * sizeof(uint64_t));
+	lpm_hashmap_free(vrf->lpm, hmap->bucket,
+	    hmap->hashsize * sizeof(lpm_ent_t *));
+	ASSERT(hmap->slab == NULL && hmap->entsize == 0);
+	ASSERT(vrf->lpm->memused == 0);
+	memset(hmap, 0, sizeof(lpm_hmap_t));
+}
+
+void
+lpm_vrf_destroy(lpm_vrf_t *vrf)
+{
+	lpm_vrf_clear(vrf, NULL, NULL);
+	lpm_destroy(vrf->lpm);
+	free(vrf);
+}
+
+static inline lpm_tenant_t *
+lpm_vrf_tenant(lpm_vrf_t *vrf, uint32_t id)
+{
+	lpm_ent_t *entry;
+
+	entry = hashmap_lookup(vrf->lpm, &vrf->tenants, &id, sizeof(id));
+	if (entry == NULL) {
+		return NULL;
+	}
+	return entry->val;
+}
+
+/*
+ * lpm_vrf_tenant_put: release the tenant record if it became empty.
+ */
+static void
+lpm_vrf_tenant_put(lpm_vrf_t *vrf, uint32_t id, lpm_tenant_t *t)
+{
+	if (t->nitems || t->defvals[0] || t->defvals[1]) {
+		return;
+	}
+	lpm_hashmap_remove(vrf->lpm, &vrf->tenants, &id, sizeof(id));
+	lpm_hashmap_free(vrf->lpm, t, sizeof(lpm_tenant_t));
+}
+
+/*
+ * lpm_vrf_insert: insert the CIDR into the table of the given VRF.
+ *
+ * => Returns zero on success and -1 on failure.
+ */
+int
+lpm_vrf_insert(lpm_vrf_t *vrf, uint32_t id, const void *addr,
+    size_t len, unsigned preflen, void *val)
+{
+	uint8_t key[LPM_VRF_MAXKEY];
+	lpm_tenant_t *t;
+	lpm_ent_t *entry;
+	bool existed;
+
+	ASSERT((len == 4 || len == 16) && preflen <= len * 8);
+
+	if ((t = lpm_vrf_tenant(vrf, id)) == NULL) {
+		entry = lpm_hashmap_insert(vrf->lpm,
+		    &vrf->tenants, &id, sizeof(id));
+		if (entry == NULL) {
+			return -1;
+		}
+		t = lpm_hashmap_alloc(vrf->lpm, sizeof(lpm_tenant_t), true);
+		if (t == NULL) {
+			lpm_hashmap_remove(vrf->lpm,
+			    &vrf->tenants, &id, sizeof(id));
+			return -1;
+		}
+		entry->val = t;
+	}
+	if (preflen == 0) {
+		/* Setting NULL on a new VRF: do not keep an empty record. */
+		t->defvals[LPM_VRF_DEFIDX(len)] = val;
+		lpm_vrf_tenant_put(vrf, id, t);
+		return 0;
+	}
+
+	memcpy(key, &id, LPM_VRF_IDLEN);
+	memcpy(&key[LPM_VRF_IDLEN], addr, len);
+	len += LPM_VRF_IDLEN;
+	preflen += LPM_VRF_IDLEN * 8;
+
+	existed = lpm_lookup_entry(vrf->lpm, key, len, preflen) != NULL;
+	if (lpm_insert(vrf->lpm, key, len, preflen, val) == -1) {
+		lpm_vrf_tenant_put(vrf, id, t);
+		return -1;
+	}
+	if (!existed) {
+		t->nitems++;
+	}
+	preflen -= LPM_VRF_IDLEN * 8 + 1;
+	t->bitmask[preflen >> 5] |= 0x80000000U >> (preflen & 31);
+	return 0;
+}
+
+/*
+ * lpm_vrf_remove: remove the specified prefix from the table of the VRF.
+ */
+int
+lpm_vrf_remove(lpm_vrf_t *vrf, uint32_t id, const void *addr,
+    size_t len, unsigned preflen)
+{
+	uint8_t key[LPM_VRF_MAXKEY];
+	lpm_tenant_t *t;
+
+	ASSERT((len == 4 || len == 16) && preflen <= len * 8);
+
+	if ((t = lpm_vrf_tenant(vrf, id)) == NULL) {
+		return -1;
+	}
+	if (preflen == 0) {
+		t->defvals[LPM_VRF_DEFIDX(len)] = NULL;
+		lpm_vrf_tenant_put(vrf, id, t);
+		return 0;
+	}
+
+	memcpy(key, &id, LPM_VRF_IDLEN);
+	memcpy(&key[LPM_VRF_IDLEN], addr, len);
+	if (lpm_remove(vrf->lpm, key, LPM_VRF_IDLEN + len,
+	    LPM_VRF_IDLEN * 8 + preflen) == -1) {
+		return -1;
+	}
+	t->nitems--;
+	lpm_vrf_tenant_put(vrf, id, t);
+	return 0;
+}
+
+static __always_inline void *
+lpm_vrf_lookup_len(lpm_vrf_t *vrf, const lpm_tenant_t *t,
+    const void *key, const size_t len)
+{
+	const unsigned klen = LPM_VRF_IDLEN + len;
+	unsigned i, n = LPM_TO_WORDS(len);
+	uint32_t prefix[LPM_TO_WORDS(klen)];
+
+	while (n--) {
+		uint32_t bitmask = t->bitmask[n];
+
+		while ((i = ffs(bitmask)) != 0) {
+			const unsigned preflen = LPM_VRF_IDLEN * 8 +
+			    (32 * n) + (32 - --i);
+			lpm_hmap_t *hmap = &vrf->lpm->prefix[preflen];
+			lpm_ent_t *entry;
+
+			compute_prefix(klen, key, preflen, prefix);
+			entry = hashmap_lookup(vrf->lpm, hmap, prefix, klen);
+			if (entry) {
+				return entry->val;
+			}
+			bitmask &= ~(1U << i);
+		}
+	}
+	return t->defvals[LPM_VRF_DEFIDX(len)];
+}
+
+/*
+ * lpm_vrf_lookup: find the longest matching prefix given the VRF ID and
+ * the IP address.
+ *
+ * => Returns the associated value on success or NULL on failure.
+ */
+void *
+lpm_vrf_lookup(lpm_vrf_t *vrf, uint32_t id, const void *addr, size_t len)
+{
+	uint32_t key[LPM_TO_WORDS(LPM_VRF_MAXKEY)];
+	const lpm_tenant_t *t;
+
+	ASSERT(len == 4 || len == 16);
+
+	if ((t = lpm_vrf_tenant(vrf, id)) == NULL) {
+		return NULL;
+	}
+	key[0] = id;
+	memcpy(&key[1], addr, len);
+
+	/* Specialise for IPv4 and IPv6. */
+	if (len == 4) {
+		return lpm_vrf_lookup_len(vrf, t, key, 4);
+	}
+	return lpm_vrf_lookup_len(vrf, t, key, 16);
+}
+
+/*
+ * lpm_vrf_lookup_prefix: return the value associated with a prefix
+ * in the table of the given VRF.
+ *
+ * => Returns the associated value on success or NULL on failure.
+ */
+void *
+lpm_vrf_lookup_prefix(lpm_vrf_t *vrf, uint32_t id, const void *addr,
+    size_t len, unsigned preflen)
+{
+	uint8_t key[LPM_VRF_MAXKEY];
+	const lpm_tenant_t *t;
+
+	ASSERT((len == 4 || len == 16) && preflen <= len * 8);
+
+	if ((t = lpm_vrf_tenant(vrf, id)) == NULL) {
+		return NULL;
+	}
+	if (preflen == 0) {
+		return t->defvals[LPM_VRF_DEFIDX(len)];
+	}
+	memcpy(key, &id, LPM_VRF_IDLEN);
+	memcpy(&key[LPM_VRF_IDLEN], addr, len);
+	return lpm_lookup_prefix(vrf->lpm, key, LPM_VRF_IDLEN + len,
+	    LPM_VRF_IDLEN * 8 + preflen);
+}
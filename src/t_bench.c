@@ -0,0 +1,1870 @@
+/*
+ * This file is in the Public Domain.
+ */
+
+/*
+ * Benchmarks.  Usage: t_bench [-d seconds] [-n prefixes] [-t threads]
+ *     [-f prefix-file] [-r pcap-file] [-z skew] mode
+ *
+ * Modes:
+ *
+ * numa: lookup throughput of a regular table (allocated on the node of
+ * the main thread) and a replicated table (LPM_F_NUMA), with the worker
+ * threads pinned to the CPUs spread across the NUMA nodes.  Build with
+ * NUMA=1 to get the replicas and the per-node results.
+ *
+ * vrf: memory use and lookup throughput of the prefixes spread across
+ * many tenants, stored as a table per tenant vs a single VRF table.
+ *
+ * trace: lookup throughput, cycles and LLC misses per lookup of each
+ * lookup interface, replaying the destination addresses of a pcap file
+ * (-r) or a generated trace with the Zipf-distributed flows (-z skew).
+ * The prefixes are loaded from a file (-f), one CIDR per line, or random.
+ * The counters are read using perf_event_open(2), if permitted.
+ */
+
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <math.h>
+#include <arpa/inet.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <err.h>
+#include <malloc.h>
+#include <assert.h>
+
+#ifdef LPM_NUMA
+#include <numa.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+#include "lpm.h"
+#include "lpm_impl.h"
+
+#define	LOOKUP_ADDRS		(1024 * 1024)	// must be a power of 2
+#define	LOOKUP_BATCH		(4096)
+#define	VRF_TENANTS		(1000)
+#define	TRACE_FLOWS		(1024 * 1024)
+#define	TRACE_LEN		(4 * 1024 * 1024)
+#define	TRACE_SNAPLEN		(64 * 1024)
+#define	FLOW_ENTRIES		(64 * 1024)
+#define	FLOW_BATCH		(32)
+#define	HASH_CRAFTED		(2048)
+#define	HASH_BUCKETS		(64 * 1024)
+
+static unsigned			bench_seconds = 3;
+static unsigned			bench_prefixes = 500000;
+static unsigned			bench_nthreads = 0;
+static const char *		bench_prefix_file = NULL;
+static const char *		bench_pcap_file = NULL;
+static double			bench_skew = 1.0;
+
+static uint32_t *		prefixes;
+
+typedef struct {
+	pthread_t		thread;
+	lpm_t *			lpm;
+	unsigned		cpu;
+	int			node;
+	uint64_t		nlookups;
+} worker_t;
+
+static pthread_barrier_t	barrier;
+static volatile bool		stop;
+
+static int
+cpu_node(unsigned cpu)
+{
+#ifdef LPM_NUMA
+	if (numa_available() != -1) {
+		return numa_node_of_cpu(cpu);
+	}
+#endif
+	(void)cpu;
+	return 0;
+}
+
+static void
+pin_cpu(unsigned cpu)
+{
+	cpu_set_t cpuset;
+
+	CPU_ZERO(&cpuset);
+	CPU_SET(cpu, &cpuset);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(cpuset), &cpuset)) {
+		err(EXIT_FAILURE, "pthread_setaffinity_np");
+	}
+}
+
+/*
+ * Populate the table with random IPv4 prefixes, mostly /24s.
+ */
+static void
+populate(lpm_t *lpm)
+{
+	for (unsigned i = 0; i < bench_prefixes; i++) {
+		const unsigned r = i % 10;
+		const unsigned preflen = r < 6 ? 24 : (r < 8 ? 16 + r : 32);
+
+		if (lpm_insert(lpm, &prefixes[i], 4, preflen,
+		    (void *)(uintptr_t)(i + 1)) == -1) {
+			err(EXIT_FAILURE, "lpm_insert");
+		}
+	}
+}
+
+static void *
+lookup_worker(void *arg)
+{
+	worker_t *w = arg;
+	uint32_t *addrs;
+	uint64_t n = 0;
+	uintptr_t sum = 0;
+
+	pin_cpu(w->cpu);
+
+	/* Allocate the addresses after pinning: node-local memory. */
+	if ((addrs = malloc(LOOKUP_ADDRS * sizeof(uint32_t))) == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	for (unsigned i = 0; i < LOOKUP_ADDRS; i++) {
+		const uint32_t host = htonl(random() & 0xff);
+		addrs[i] = prefixes[random() % bench_prefixes] | host;
+	}
+
+	pthread_barrier_wait(&barrier);
+	while (!stop) {
+		for (unsigned i = 0; i < LOOKUP_BATCH; i++) {
+			const unsigned k = (n + i) & (LOOKUP_ADDRS - 1);
+			sum += (uintptr_t)lpm_lookup(w->lpm, &addrs[k], 4);
+		}
+		n += LOOKUP_BATCH;
+	}
+	w->nlookups = n + (sum & 1);
+	free(addrs);
+	return NULL;
+}
+
+static void
+run_lookups(const char *name, lpm_t *lpm, worker_t *workers, unsigned nworkers)
+{
+	int maxnode = 0;
+
+	pthread_barrier_init(&barrier, NULL, nworkers + 1);
+	stop = false;
+
+	for (unsigned i = 0; i < nworkers; i++) {
+		workers[i].lpm = lpm;
+		workers[i].nlookups = 0;
+		if (pthread_create(&workers[i].thread, NULL,
+		    lookup_worker, &workers[i]) != 0) {
+			err(EXIT_FAILURE, "pthread_create");
+		}
+		if (workers[i].node > maxnode) {
+			maxnode = workers[i].node;
+		}
+	}
+	pthread_barrier_wait(&barrier);
+	sleep(bench_seconds);
+	stop = true;
+
+	for (unsigned i = 0; i < nworkers; i++) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	pthread_barrier_destroy(&barrier);
+
+	for (int node = 0; node <= maxnode; node++) {
+		uint64_t total = 0;
+		unsigned nthreads = 0;
+
+		for (unsigned i = 0; i < nworkers; i++) {
+			if (workers[i].node == node) {
+				total += workers[i].nlookups;
+				nthreads++;
+			}
+		}
+		if (nthreads == 0) {
+			continue;
+		}
+		printf("%-12s node %d: %u threads, %.2f Mlookups/sec "
+		    "(%.2f per thread)\n", name, node, nthreads,
+		    (double)total / bench_seconds / 1e6,
+		    (double)total / bench_seconds / 1e6 / nthreads);
+	}
+}
+
+static void
+bench_numa(void)
+{
+	const lpm_conf_t conf = { .flags = LPM_F_NUMA };
+	const unsigned ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	const unsigned nworkers = bench_nthreads ? bench_nthreads : ncpus;
+	worker_t *workers;
+	unsigned *cpus, ncpu_sorted = 0;
+	int maxnode = 0;
+	lpm_t *lpm;
+
+	/*
+	 * Order the CPUs round-robin by node, so that the workers are
+	 * spread across the nodes.
+	 */
+	cpus = calloc(ncpus, sizeof(unsigned));
+	workers = calloc(nworkers, sizeof(worker_t));
+	if (!cpus || !workers) {
+		err(EXIT_FAILURE, "calloc");
+	}
+	for (unsigned cpu = 0; cpu < ncpus; cpu++) {
+		const int node = cpu_node(cpu);
+		maxnode = node > maxnode ? node : maxnode;
+	}
+	for (unsigned round = 0; ncpu_sorted < ncpus; round++) {
+		for (int node = 0; node <= maxnode; node++) {
+			unsigned seen = 0;
+
+			for (unsigned cpu = 0; cpu < ncpus; cpu++) {
+				if (cpu_node(cpu) == node && seen++ == round) {
+					cpus[ncpu_sorted++] = cpu;
+					break;
+				}
+			}
+		}
+	}
+	for (unsigned i = 0; i < nworkers; i++) {
+		workers[i].cpu = cpus[i % ncpus];
+		workers[i].node = cpu_node(workers[i].cpu);
+	}
+
+	/* The regular table: allocated on the node of the first CPU. */
+	pin_cpu(cpus[0]);
+	if ((lpm = lpm_create()) == NULL) {
+		err(EXIT_FAILURE, "lpm_create");
+	}
+	populate(lpm);
+	run_lookups("regular", lpm, workers, nworkers);
+	lpm_destroy(lpm);
+
+	if ((lpm = lpm_create_ex(&conf)) == NULL) {
+		err(EXIT_FAILURE, "lpm_create_ex");
+	}
+	populate(lpm);
+	run_lookups("replicated", lpm, workers, nworkers);
+	lpm_destroy(lpm);
+
+	free(workers);
+	free(cpus);
+}
+
+static size_t
+heap_used(void)
+{
+	const struct mallinfo2 mi = mallinfo2();
+
+	/* Including the large (mmap'ed) allocations. */
+	return mi.uordblks + mi.hblkhd;
+}
+
+static void
+vrf_report(const char *name, size_t mem, uint64_t n, double elapsed)
+{
+	printf("%-12s %u tenants: %zu bytes per tenant, "
+	    "%.2f Mlookups/sec\n", name, VRF_TENANTS, mem / VRF_TENANTS,
+	    (double)n / elapsed / 1e6);
+}
+
+static double
+elapsed_since(const struct timeval *start)
+{
+	struct timeval now;
+
+	gettimeofday(&now, NULL);
+	return (now.tv_sec - start->tv_sec) +
+	    (now.tv_usec - start->tv_usec) / 1e6;
+}
+
+static void
+bench_vrf(void)
+{
+	lpm_t **tables;
+	lpm_vrf_t *vrf;
+	uint32_t *addrs, *ids;
+	struct timeval start;
+	uintptr_t sum = 0;
+	uint64_t n;
+	size_t mem;
+
+	tables = calloc(VRF_TENANTS, sizeof(lpm_t *));
+	addrs = malloc(LOOKUP_ADDRS * sizeof(uint32_t));
+	ids = malloc(LOOKUP_ADDRS * sizeof(uint32_t));
+	if (!tables || !addrs || !ids) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	for (unsigned i = 0; i < LOOKUP_ADDRS; i++) {
+		const uint32_t host = htonl(random() & 0xff);
+		const unsigned p = random() % bench_prefixes;
+
+		addrs[i] = prefixes[p] | host;
+		ids[i] = p % VRF_TENANTS;
+	}
+
+	/* A table per tenant; the prefix i belongs to tenant i % N. */
+	mem = heap_used();
+	for (unsigned t = 0; t < VRF_TENANTS; t++) {
+		if ((tables[t] = lpm_create()) == NULL) {
+			err(EXIT_FAILURE, "lpm_create");
+		}
+	}
+	for (unsigned i = 0; i < bench_prefixes; i++) {
+		if (lpm_insert(tables[i % VRF_TENANTS], &prefixes[i], 4, 24,
+		    (void *)(uintptr_t)(i + 1)) == -1) {
+			err(EXIT_FAILURE, "lpm_insert");
+		}
+	}
+	mem = heap_used() - mem;
+
+	gettimeofday(&start, NULL);
+	for (n = 0; elapsed_since(&start) < bench_seconds; n += LOOKUP_BATCH) {
+		for (unsigned i = 0; i < LOOKUP_BATCH; i++) {
+			const unsigned k = (n + i) & (LOOKUP_ADDRS - 1);
+			sum += (uintptr_t)lpm_lookup(tables[ids[k]],
+			    &addrs[k], 4);
+		}
+	}
+	vrf_report("per-tenant", mem, n, elapsed_since(&start));
+
+	for (unsigned t = 0; t < VRF_TENANTS; t++) {
+		lpm_destroy(tables[t]);
+	}
+
+	/* A single VRF table. */
+	mem = heap_used();
+	if ((vrf = lpm_vrf_create()) == NULL) {
+		err(EXIT_FAILURE, "lpm_vrf_create");
+	}
+	for (unsigned i = 0; i < bench_prefixes; i++) {
+		if (lpm_vrf_insert(vrf, i % VRF_TENANTS, &prefixes[i], 4, 24,
+		    (void *)(uintptr_t)(i + 1)) == -1) {
+			err(EXIT_FAILURE, "lpm_vrf_insert");
+		}
+	}
+	mem = heap_used() - mem;
+
+	gettimeofday(&start, NULL);
+	for (n = 0; elapsed_since(&start) < bench_seconds; n += LOOKUP_BATCH) {
+		for (unsigned i = 0; i < LOOKUP_BATCH; i++) {
+			const unsigned k = (n + i) & (LOOKUP_ADDRS - 1);
+			sum += (uintptr_t)lpm_vrf_lookup(vrf, ids[k],
+			    &addrs[k], 4);
+		}
+	}
+	vrf_report("vrf", mem, n, elapsed_since(&start));
+	lpm_vrf_destroy(vrf);
+
+	free(ids);
+	free(addrs);
+	free(tables);
+	(void)sum;
+}
+
+static void
+bench_ivtab(void)
+{
+	lpm_ivtab_t *ivtab;
+	lpm_t *lpm;
+	uint32_t *addrs;
+	struct timeval start;
+	uintptr_t sum = 0;
+	size_t mem;
+	uint64_t n;
+
+	if ((addrs = malloc(LOOKUP_ADDRS * sizeof(uint32_t))) == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	for (unsigned i = 0; i < LOOKUP_ADDRS; i++) {
+		addrs[i] = (i & 1) ? (uint32_t)random() :
+		    prefixes[random() % bench_prefixes] | htonl(random() & 0xff);
+	}
+
+	/* Mostly /32 entries and every tenth a range of /16 to /24. */
+	mem = heap_used();
+	if ((lpm = lpm_create()) == NULL) {
+		err(EXIT_FAILURE, "lpm_create");
+	}
+	for (unsigned i = 0; i < bench_prefixes; i++) {
+		const uint32_t a = prefixes[i] | htonl(random() & 0xff);
+		const unsigned preflen = (i % 10) ? 32 : 16 + i % 9;
+
+		if (lpm_insert(lpm, &a, 4, preflen,
+		    (void *)(uintptr_t)(i % 4 + 1)) == -1) {
+			err(EXIT_FAILURE, "lpm_insert");
+		}
+	}
+	mem = heap_used() - mem;
+
+	gettimeofday(&start, NULL);
+	for (n = 0; elapsed_since(&start) < bench_seconds; n += LOOKUP_BATCH) {
+		for (unsigned i = 0; i < LOOKUP_BATCH; i++) {
+			const unsigned k = (n + i) & (LOOKUP_ADDRS - 1);
+			sum += (uintptr_t)lpm_lookup(lpm, &addrs[k], 4);
+		}
+	}
+	printf("%-12s %u prefixes: %zu bytes, %.2f Mlookups/sec\n",
+	    "lpm", bench_prefixes, mem,
+	    (double)n / elapsed_since(&start) / 1e6);
+
+	mem = heap_used();
+	if ((ivtab = lpm_ivtab_build(lpm)) == NULL) {
+		err(EXIT_FAILURE, "lpm_ivtab_build");
+	}
+	mem = heap_used() - mem;
+
+	gettimeofday(&start, NULL);
+	for (n = 0; elapsed_since(&start) < bench_seconds; n += LOOKUP_BATCH) {
+		for (unsigned i = 0; i < LOOKUP_BATCH; i++) {
+			const unsigned k = (n + i) & (LOOKUP_ADDRS - 1);
+			sum += (uintptr_t)lpm_ivtab_lookup(ivtab, &addrs[k], 4);
+		}
+	}
+	printf("%-12s %u prefixes: %zu bytes, %.2f Mlookups/sec\n",
+	    "ivtab", bench_prefixes, mem,
+	    (double)n / elapsed_since(&start) / 1e6);
+
+	lpm_ivtab_destroy(ivtab);
+	lpm_destroy(lpm);
+	free(addrs);
+	(void)sum;
+}
+
+static uint64_t
+lookup_loop(lpm_t *lpm, const uint32_t *addrs, double *elapsed)
+{
+	struct timeval start;
+	uintptr_t sum = 0;
+	uint64_t n;
+
+	gettimeofday(&start, NULL);
+	for (n = 0; elapsed_since(&start) < bench_seconds; n += LOOKUP_BATCH) {
+		for (unsigned i = 0; i < LOOKUP_BATCH; i++) {
+			const unsigned k = (n + i) & (LOOKUP_ADDRS - 1);
+			sum += (uintptr_t)lpm_lookup(lpm, &addrs[k], 4);
+		}
+	}
+	*elapsed = elapsed_since(&start);
+	return n + (sum & 1);
+}
+
+/*
+ * bench_ctab: memory use and lookup throughput of the IPv4 and IPv6
+ * routing tables (with a few distinct next-hops) in the LPM object vs
+ * the compact table.
+ */
+static void
+bench_ctab(void)
+{
+	static const unsigned lens[] = { 4, 16 };
+
+	for (unsigned l = 0; l < sizeof(lens) / sizeof(lens[0]); l++) {
+		const unsigned len = lens[l], nwords = len / 4;
+		uint32_t *addrs;
+		lpm_ctab_t *ctab;
+		lpm_t *lpm;
+		uintptr_t sum = 0;
+		size_t mem, ctmem;
+		double rates[2];
+
+		addrs = malloc(LOOKUP_ADDRS * len);
+		if (addrs == NULL || (lpm = lpm_create()) == NULL) {
+			err(EXIT_FAILURE, "malloc/lpm_create");
+		}
+		for (unsigned i = 0; i < LOOKUP_ADDRS * nwords; i++) {
+			addrs[i] = random();
+		}
+
+		/* The prefixes around the lookup addresses. */
+		mem = heap_used();
+		for (unsigned i = 0; i < bench_prefixes; i++) {
+			const uint32_t *a = &addrs[(i % LOOKUP_ADDRS) * nwords];
+			const unsigned preflen = len == 4 ?
+			    16 + random() % 17 : 32 + random() % 33;
+
+			if (lpm_insert(lpm, a, len, preflen,
+			    (void *)(uintptr_t)(i % 16 + 1)) == -1) {
+				err(EXIT_FAILURE, "lpm_insert");
+			}
+		}
+		mem = heap_used() - mem;
+		ctmem = heap_used();
+		if ((ctab = lpm_ctab_build(lpm)) == NULL) {
+			err(EXIT_FAILURE, "lpm_ctab_build");
+		}
+		ctmem = heap_used() - ctmem;
+
+		for (unsigned e = 0; e < 2; e++) {
+			struct timeval start;
+			uint64_t n;
+
+			gettimeofday(&start, NULL);
+			for (n = 0; elapsed_since(&start) < bench_seconds;
+			    n += LOOKUP_BATCH) {
+				for (unsigned i = 0; i < LOOKUP_BATCH; i++) {
+					const unsigned k = (n + i) &
+					    (LOOKUP_ADDRS - 1);
+					const uint32_t *a = &addrs[k * nwords];
+
+					sum += (uintptr_t)(e ?
+					    lpm_ctab_lookup(ctab, a, len) :
+					    lpm_lookup(lpm, a, len));
+				}
+			}
+			rates[e] = (double)n / elapsed_since(&start) / 1e6;
+		}
+		printf("IPv%u %-5s %u prefixes: %zu bytes (%.1f/prefix), "
+		    "%.2f Mlookups/sec\n", len == 4 ? 4 : 6, "lpm",
+		    bench_prefixes, mem, (double)mem / bench_prefixes,
+		    rates[0]);
+		printf("IPv%u %-5s %u prefixes: %zu bytes (%.1f/prefix), "
+		    "%.2f Mlookups/sec\n", len == 4 ? 4 : 6, "ctab",
+		    bench_prefixes, ctmem, (double)ctmem / bench_prefixes,
+		    rates[1] + (sum & 1) * 1e-9);
+		lpm_ctab_destroy(ctab);
+		lpm_destroy(lpm);
+		free(addrs);
+	}
+}
+
+static void
+bench_compact(void)
+{
+	uint32_t *addrs;
+	size_t mem0, mem;
+	double elapsed;
+	uint64_t n;
+	lpm_t *lpm;
+
+	if ((addrs = malloc(LOOKUP_ADDRS * sizeof(uint32_t))) == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	for (unsigned i = 0; i < LOOKUP_ADDRS; i++) {
+		const uint32_t host = htonl(random() & 0xff);
+		addrs[i] = prefixes[random() % bench_prefixes] | host;
+	}
+
+	mem0 = heap_used();
+	if ((lpm = lpm_create()) == NULL) {
+		err(EXIT_FAILURE, "lpm_create");
+	}
+	populate(lpm);
+
+	/*
+	 * Churn: keep removing and re-inserting the random prefixes, with
+	 * the unrelated allocations in between, and then remove a half.
+	 */
+	for (unsigned i = 0; i < 4 * bench_prefixes; i++) {
+		const unsigned k = random() % bench_prefixes;
+
+		lpm_remove(lpm, &prefixes[k], 4, 24);
+		free(malloc(random() % 256));
+		if (lpm_insert(lpm, &prefixes[k], 4, 24,
+		    (void *)(uintptr_t)(k + 1)) == -1) {
+			err(EXIT_FAILURE, "lpm_insert");
+		}
+	}
+	for (unsigned i = 0; i < bench_prefixes; i += 2) {
+		lpm_remove(lpm, &prefixes[i], 4, 24);
+	}
+
+	mem = heap_used() - mem0;
+	n = lookup_loop(lpm, addrs, &elapsed);
+	printf("%-12s %zu bytes, %.2f Mlookups/sec\n", "churned",
+	    mem, (double)n / elapsed / 1e6);
+
+	if (lpm_compact(lpm) == -1) {
+		err(EXIT_FAILURE, "lpm_compact");
+	}
+	mem = heap_used() - mem0;
+	n = lookup_loop(lpm, addrs, &elapsed);
+	printf("%-12s %zu bytes, %.2f Mlookups/sec\n", "compacted",
+	    mem, (double)n / elapsed / 1e6);
+
+	lpm_destroy(lpm);
+	free(addrs);
+}
+
+static void
+bench_build(void)
+{
+	lpm_prefix_t *pfx;
+	struct timeval start;
+	lpm_t *lpm;
+
+	if ((pfx = calloc(bench_prefixes, sizeof(lpm_prefix_t))) == NULL) {
+		err(EXIT_FAILURE, "calloc");
+	}
+	for (unsigned i = 0; i < bench_prefixes; i++) {
+		const unsigned r = i % 10;
+
+		pfx[i].addr = &prefixes[i];
+		pfx[i].len = 4;
+		pfx[i].preflen = r < 6 ? 24 : (r < 8 ? 16 + r : 32);
+		pfx[i].val = (void *)(uintptr_t)(i + 1);
+	}
+
+	if ((lpm = lpm_create()) == NULL) {
+		err(EXIT_FAILURE, "lpm_create");
+	}
+	gettimeofday(&start, NULL);
+	populate(lpm);
+	printf("%-12s %u prefixes: %.3f sec\n", "insert",
+	    bench_prefixes, elapsed_since(&start));
+	lpm_destroy(lpm);
+
+	if ((lpm = lpm_create()) == NULL) {
+		err(EXIT_FAILURE, "lpm_create");
+	}
+	gettimeofday(&start, NULL);
+	for (unsigned preflen = 16; preflen <= 32; preflen++) {
+		unsigned n = 0;
+
+		for (unsigned i = 0; i < bench_prefixes; i++) {
+			n += pfx[i].preflen == preflen;
+		}
+		if (n && lpm_reserve(lpm, 4, preflen, n) == -1) {
+			err(EXIT_FAILURE, "lpm_reserve");
+		}
+	}
+	populate(lpm);
+	printf("%-12s %u prefixes: %.3f sec\n", "reserved",
+	    bench_prefixes, elapsed_since(&start));
+	lpm_destroy(lpm);
+
+	if ((lpm = lpm_create()) == NULL) {
+		err(EXIT_FAILURE, "lpm_create");
+	}
+	gettimeofday(&start, NULL);
+	if (lpm_insert_bulk(lpm, pfx, bench_prefixes, bench_nthreads) == -1) {
+		err(EXIT_FAILURE, "lpm_insert_bulk");
+	}
+	printf("%-12s %u prefixes: %.3f sec (%u threads)\n", "insert_bulk",
+	    bench_prefixes, elapsed_since(&start), bench_nthreads ?
+	    bench_nthreads : (unsigned)sysconf(_SC_NPROCESSORS_ONLN));
+	lpm_destroy(lpm);
+	free(pfx);
+}
+
+static int
+latency_cmp(const void *p1, const void *p2)
+{
+	const uint64_t a = *(const uint64_t *)p1, b = *(const uint64_t *)p2;
+	return (a > b) - (a < b);
+}
+
+static void
+bench_update(void)
+{
+	uint64_t *lat;
+	lpm_t *lpm;
+
+	if ((lat = malloc(bench_prefixes * sizeof(uint64_t))) == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	if ((lpm = lpm_create()) == NULL) {
+		err(EXIT_FAILURE, "lpm_create");
+	}
+	for (unsigned i = 0; i < bench_prefixes; i++) {
+		const uint32_t a = htonl(i << 8);
+		struct timespec t1, t2;
+
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		if (lpm_insert(lpm, &a, 4, 24, (void *)(uintptr_t)(i + 1)) == -1) {
+			err(EXIT_FAILURE, "lpm_insert");
+		}
+		clock_gettime(CLOCK_MONOTONIC, &t2);
+		lat[i] = (t2.tv_sec - t1.tv_sec) * 1000000000ULL +
+		    t2.tv_nsec - t1.tv_nsec;
+	}
+	qsort(lat, bench_prefixes, sizeof(uint64_t), latency_cmp);
+	printf("insert latency (nsec): p50 %" PRIu64 ", p99 %" PRIu64
+	    ", p99.9 %" PRIu64 ", p99.99 %" PRIu64 ", max %" PRIu64 "\n",
+	    lat[bench_prefixes / 2], lat[bench_prefixes / 100 * 99],
+	    lat[bench_prefixes / 1000 * 999],
+	    lat[bench_prefixes / 10000 * 9999], lat[bench_prefixes - 1]);
+	lpm_destroy(lpm);
+	free(lat);
+}
+
+static void
+bench_sample(void)
+{
+	static const unsigned periods[] = { 0, 1024, 1 };
+	uint32_t *addrs;
+	lpm_hist_t hist;
+	double elapsed;
+	uint64_t n;
+	lpm_t *lpm;
+
+	if ((addrs = malloc(LOOKUP_ADDRS * sizeof(uint32_t))) == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	for (unsigned i = 0; i < LOOKUP_ADDRS; i++) {
+		const uint32_t host = htonl(random() & 0xff);
+		addrs[i] = prefixes[random() % bench_prefixes] | host;
+	}
+	if ((lpm = lpm_create()) == NULL) {
+		err(EXIT_FAILURE, "lpm_create");
+	}
+	populate(lpm);
+
+	memset(&hist, 0, sizeof(hist));
+	lpm_hist_register(&hist);
+	for (unsigned i = 0; i < sizeof(periods) / sizeof(periods[0]); i++) {
+		char name[32];
+
+		lpm_set_sampling(lpm, periods[i]);
+		n = lookup_loop(lpm, addrs, &elapsed);
+		if (periods[i]) {
+			snprintf(name, sizeof(name), "1/%u", periods[i]);
+		} else {
+			snprintf(name, sizeof(name), "off");
+		}
+		printf("sampling %-8s %.2f Mlookups/sec\n", name,
+		    (double)n / elapsed / 1e6);
+	}
+	lpm_hist_register(NULL);
+
+	printf("%" PRIu64 " samples\n%-10s %12s %12s\n",
+	    hist.nsamples, "range", "probes", "chain");
+	for (unsigned i = 0; i < LPM_HIST_BUCKETS; i++) {
+		char range[32];
+
+		if (hist.probes[i] == 0 && hist.chain[i] == 0) {
+			continue;
+		}
+		if (i == 0) {
+			snprintf(range, sizeof(range), "0");
+		} else if (i == LPM_HIST_BUCKETS - 1) {
+			snprintf(range, sizeof(range), "%u+", 1U << (i - 1));
+		} else {
+			snprintf(range, sizeof(range), "%u-%u",
+			    1U << (i - 1), (1U << i) - 1);
+		}
+		printf("%-10s %12" PRIu64 " %12" PRIu64 "\n", range,
+		    hist.probes[i], hist.chain[i]);
+	}
+	lpm_destroy(lpm);
+	free(addrs);
+}
+
+/*
+ * bench_bloom: IPv6 lookups in a table with many populated prefix
+ * lengths, where most of the hash map probes miss.
+ */
+static void
+bench_bloom(void)
+{
+	const lpm_conf_t confs[] = { { .flags = 0 }, { .flags = LPM_F_BLOOM } };
+	const char *names[] = { "regular", "LPM_F_BLOOM" };
+	uint32_t (*addrs)[4];
+
+	if ((addrs = malloc(LOOKUP_ADDRS * sizeof(*addrs))) == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	for (unsigned i = 0; i < LOOKUP_ADDRS; i++) {
+		addrs[i][0] = htonl(0x20010000 | (random() & 0xffff));
+		addrs[i][1] = random();
+		addrs[i][2] = random();
+		addrs[i][3] = random();
+	}
+
+	for (unsigned c = 0; c < 2; c++) {
+		struct timeval start;
+		uintptr_t sum = 0;
+		size_t mem;
+		uint64_t n;
+		lpm_t *lpm;
+
+		/* Same prefixes in each run. */
+		srandom(1);
+		mem = heap_used();
+		if ((lpm = lpm_create_ex(&confs[c])) == NULL) {
+			err(EXIT_FAILURE, "lpm_create_ex");
+		}
+		for (unsigned i = 0; i < bench_prefixes; i++) {
+			uint32_t addr[4] = { 0 };
+
+			addr[0] = htonl(0x20010000 | (random() & 0xffff));
+			addr[1] = random();
+			if (lpm_insert(lpm, addr, 16, 16 + i % 49,
+			    (void *)(uintptr_t)(i + 1)) == -1) {
+				err(EXIT_FAILURE, "lpm_insert");
+			}
+		}
+		mem = heap_used() - mem;
+
+		gettimeofday(&start, NULL);
+		for (n = 0; elapsed_since(&start) < bench_seconds;
+		    n += LOOKUP_BATCH) {
+			for (unsigned i = 0; i < LOOKUP_BATCH; i++) {
+				const unsigned k = (n + i) & (LOOKUP_ADDRS - 1);
+				sum += (uintptr_t)lpm_lookup(lpm, addrs[k], 16);
+			}
+		}
+		printf("%-12s %zu bytes, %.2f Mlookups/sec\n", names[c], mem,
+		    (double)(n + (sum & 1)) / elapsed_since(&start) / 1e6);
+		lpm_destroy(lpm);
+	}
+	free(addrs);
+}
+
+/*
+ * Trace replay.
+ */
+
+typedef struct {
+	uint32_t		addr[4];
+	unsigned		len;
+	unsigned		preflen;
+} trace_addr_t;
+
+typedef struct {
+	lpm_t *			lpm;
+	lpm_cache_t *		cache;
+	lpm_ivtab_t *		ivtab;
+	lpm_ctab_t *		ctab;
+} trace_ctx_t;
+
+/*
+ * trace_load: load the prefixes from the file, one CIDR per line.
+ */
+static size_t
+trace_load(lpm_t *lpm, const char *path, trace_addr_t **pfxp)
+{
+	trace_addr_t *pfx = NULL;
+	size_t n = 0, nalloc = 0;
+	char line[256];
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		err(EXIT_FAILURE, "%s", path);
+	}
+	while (fgets(line, sizeof(line), fp)) {
+		char *cidr = line + strspn(line, " \t");
+		trace_addr_t *p;
+		size_t len;
+
+		cidr[strcspn(cidr, " \t\r\n#")] = '\0';
+		if (*cidr == '\0') {
+			continue;
+		}
+		if (n == nalloc) {
+			nalloc = nalloc ? nalloc * 2 : 1024;
+			if ((pfx = realloc(pfx, nalloc * sizeof(*pfx))) == NULL) {
+				err(EXIT_FAILURE, "realloc");
+			}
+		}
+		p = &pfx[n];
+		memset(p, 0, sizeof(*p));
+		if (lpm_strtobin(cidr, p->addr, &len, &p->preflen) == -1) {
+			errx(EXIT_FAILURE, "%s: invalid prefix `%s'", path, cidr);
+		}
+		p->len = len;
+		if (lpm_insert(lpm, p->addr, len, p->preflen,
+		    (void *)(uintptr_t)(++n)) == -1) {
+			err(EXIT_FAILURE, "lpm_insert");
+		}
+	}
+	fclose(fp);
+	if (n == 0) {
+		errx(EXIT_FAILURE, "%s: no prefixes", path);
+	}
+	*pfxp = pfx;
+	return n;
+}
+
+/*
+ * trace_packet: get the destination address of the packet, given the
+ * link type of the capture.
+ */
+static bool
+trace_packet(unsigned linktype, const uint8_t *pkt, size_t caplen,
+    trace_addr_t *a)
+{
+	size_t off;
+	unsigned proto;
+
+	switch (linktype) {
+	case 1:		/* DLT_EN10MB */
+		off = 14;
+		if (caplen < off) {
+			return false;
+		}
+		proto = (pkt[12] << 8) | pkt[13];
+		while ((proto == 0x8100 || proto == 0x88a8) && caplen >= off + 4) {
+			proto = (pkt[off + 2] << 8) | pkt[off + 3];
+			off += 4;
+		}
+		break;
+	case 113:	/* DLT_LINUX_SLL */
+		off = 16;
+		if (caplen < off) {
+			return false;
+		}
+		proto = (pkt[14] << 8) | pkt[15];
+		break;
+	case 12:	/* DLT_RAW */
+	case 101:
+		off = 0;
+		proto = caplen ? ((pkt[0] >> 4) == 6 ? 0x86dd : 0x0800) : 0;
+		break;
+	default:
+		errx(EXIT_FAILURE, "unsupported link type %u", linktype);
+	}
+
+	memset(a, 0, sizeof(*a));
+	if (proto == 0x0800 && caplen >= off + 20) {
+		memcpy(a->addr, &pkt[off + 16], 4);
+		a->len = 4;
+		return true;
+	}
+	if (proto == 0x86dd && caplen >= off + 40) {
+		memcpy(a->addr, &pkt[off + 24], 16);
+		a->len = 16;
+		return true;
+	}
+	return false;
+}
+
+/*
+ * trace_pcap: read the destination addresses of the IPv4 and IPv6
+ * packets in the pcap file.
+ */
+static size_t
+trace_pcap(const char *path, trace_addr_t **tracep)
+{
+	trace_addr_t *trace = NULL;
+	size_t n = 0, nalloc = 0;
+	uint32_t hdr[6], rec[4];
+	unsigned linktype;
+	uint8_t *pkt;
+	bool swap;
+	FILE *fp;
+
+	if ((fp = fopen(path, "r")) == NULL) {
+		err(EXIT_FAILURE, "%s", path);
+	}
+	if (fread(hdr, sizeof(hdr), 1, fp) != 1) {
+		errx(EXIT_FAILURE, "%s: not a pcap file", path);
+	}
+	switch (hdr[0]) {
+	case 0xa1b2c3d4: case 0xa1b23c4d:
+		swap = false;
+		break;
+	case 0xd4c3b2a1: case 0x4d3cb2a1:
+		swap = true;
+		break;
+	default:
+		errx(EXIT_FAILURE, "%s: not a pcap file (pcapng is "
+		    "not supported)", path);
+	}
+	linktype = swap ? __builtin_bswap32(hdr[5]) : hdr[5];
+	if ((pkt = malloc(TRACE_SNAPLEN)) == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	while (fread(rec, sizeof(rec), 1, fp) == 1) {
+		const size_t caplen = swap ? __builtin_bswap32(rec[2]) : rec[2];
+		const size_t len = caplen < TRACE_SNAPLEN ? caplen : TRACE_SNAPLEN;
+
+		if (fread(pkt, 1, len, fp) != len ||
+		    (caplen > len && fseek(fp, caplen - len, SEEK_CUR) == -1)) {
+			break;
+		}
+		if (n == nalloc) {
+			nalloc = nalloc ? nalloc * 2 : 4096;
+			trace = realloc(trace, nalloc * sizeof(*trace));
+			if (trace == NULL) {
+				err(EXIT_FAILURE, "realloc");
+			}
+		}
+		if (trace_packet(linktype, pkt, len, &trace[n])) {
+			n++;
+		}
+	}
+	free(pkt);
+	fclose(fp);
+	if (n == 0) {
+		errx(EXIT_FAILURE, "%s: no IPv4 or IPv6 packets", path);
+	}
+	*tracep = trace;
+	return n;
+}
+
+/*
+ * trace_generate: generate the trace of the flows with the Zipf
+ * distribution of the given skew, i.e. the flow of the rank k has the
+ * frequency proportional to 1/k^s.  Each flow is a random address in
+ * one of the prefixes.
+ */
+static size_t
+trace_generate(const trace_addr_t *pfx, size_t npfx, trace_addr_t **tracep)
+{
+	trace_addr_t *flows, *trace;
+	double *cdf, sum = 0;
+
+	flows = malloc(TRACE_FLOWS * sizeof(trace_addr_t));
+	trace = malloc(TRACE_LEN * sizeof(trace_addr_t));
+	cdf = malloc(TRACE_FLOWS * sizeof(double));
+	if (!flows || !trace || !cdf) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	for (unsigned i = 0; i < TRACE_FLOWS; i++) {
+		const trace_addr_t *p = &pfx[random() % npfx];
+		trace_addr_t *f = &flows[i];
+		uint8_t *a = (uint8_t *)f->addr;
+
+		/* Random host bits. */
+		*f = *p;
+		for (unsigned b = p->preflen; b < p->len * 8; b++) {
+			const uint8_t bit = 0x80 >> (b & 7);
+			a[b >> 3] = (random() & 1) ? (a[b >> 3] | bit) :
+			    (a[b >> 3] & ~bit);
+		}
+		sum += 1.0 / pow(i + 1, bench_skew);
+		cdf[i] = sum;
+	}
+	for (unsigned i = 0; i < TRACE_LEN; i++) {
+		const double u = (double)random() / RAND_MAX * sum;
+		unsigned lo = 0, hi = TRACE_FLOWS - 1;
+
+		while (lo < hi) {
+			const unsigned mid = (lo + hi) / 2;
+
+			if (cdf[mid] < u) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		trace[i] = flows[lo];
+	}
+	free(cdf);
+	free(flows);
+	*tracep = trace;
+	return TRACE_LEN;
+}
+
+static int
+perf_open(uint32_t type, uint64_t config)
+{
+#ifdef __linux__
+	struct perf_event_attr attr;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = type;
+	attr.config = config;
+	attr.disabled = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv = 1;
+	return syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+	(void)type; (void)config;
+	return -1;
+#endif
+}
+
+static void
+perf_start(int fd)
+{
+#ifdef __linux__
+	if (fd != -1) {
+		ioctl(fd, PERF_EVENT_IOC_RESET, 0);
+		ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+	}
+#endif
+	(void)fd;
+}
+
+static double
+perf_stop(int fd, uint64_t n)
+{
+	uint64_t count;
+
+#ifdef __linux__
+	if (fd != -1) {
+		ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(fd, &count, sizeof(count)) == sizeof(count)) {
+			return (double)count / n;
+		}
+	}
+#endif
+	(void)fd; (void)count;
+	return NAN;
+}
+
+static void *
+trace_lookup(trace_ctx_t *ctx, const void *addr, size_t len)
+{
+	return lpm_lookup(ctx->lpm, addr, len);
+}
+
+static void *
+trace_lookup_cached(trace_ctx_t *ctx, const void *addr, size_t len)
+{
+	return lpm_lookup_cached(ctx->lpm, ctx->cache, addr, len);
+}
+
+static void *
+trace_ivtab_lookup(trace_ctx_t *ctx, const void *addr, size_t len)
+{
+	return lpm_ivtab_lookup(ctx->ivtab, addr, len);
+}
+
+static void *
+trace_ctab_lookup(trace_ctx_t *ctx, const void *addr, size_t len)
+{
+	return lpm_ctab_lookup(ctx->ctab, addr, len);
+}
+
+static const struct {
+	const char *	name;
+	void *		(*lookup)(trace_ctx_t *, const void *, size_t);
+} trace_engines[] = {
+	{ "lpm_lookup",		trace_lookup },
+	{ "lpm_lookup_cached",	trace_lookup_cached },
+	{ "lpm_ivtab_lookup",	trace_ivtab_lookup },
+	{ "lpm_ctab_lookup",	trace_ctab_lookup },
+};
+
+static void
+bench_trace(void)
+{
+	trace_addr_t *pfx, *trace;
+	size_t npfx, ntrace;
+	trace_ctx_t ctx;
+	int cycles_fd, llc_fd;
+
+	if ((ctx.lpm = lpm_create()) == NULL) {
+		err(EXIT_FAILURE, "lpm_create");
+	}
+	if (bench_prefix_file) {
+		npfx = trace_load(ctx.lpm, bench_prefix_file, &pfx);
+	} else {
+		populate(ctx.lpm);
+		if ((pfx = calloc(bench_prefixes, sizeof(*pfx))) == NULL) {
+			err(EXIT_FAILURE, "calloc");
+		}
+		for (unsigned i = 0; i < bench_prefixes; i++) {
+			pfx[i].addr[0] = prefixes[i];
+			pfx[i].len = 4;
+			pfx[i].preflen = 24;
+		}
+		npfx = bench_prefixes;
+	}
+	if (bench_pcap_file) {
+		ntrace = trace_pcap(bench_pcap_file, &trace);
+	} else {
+		ntrace = trace_generate(pfx, npfx, &trace);
+	}
+	ctx.cache = lpm_cache_create(4096);
+	ctx.ivtab = lpm_ivtab_build(ctx.lpm);
+	ctx.ctab = lpm_ctab_build(ctx.lpm);
+	if (ctx.cache == NULL || ctx.ivtab == NULL || ctx.ctab == NULL) {
+		err(EXIT_FAILURE, "lpm_cache_create/lpm_*tab_build");
+	}
+	printf("%zu prefixes, %zu addresses in the trace\n", npfx, ntrace);
+
+	cycles_fd = perf_open(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES);
+	llc_fd = perf_open(PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL |
+	    (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+	    (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+	if (cycles_fd == -1 || llc_fd == -1) {
+		warn("perf_event_open (the counters are not available)");
+	}
+
+	for (unsigned e = 0; e < sizeof(trace_engines) /
+	    sizeof(trace_engines[0]); e++) {
+		struct timeval start;
+		double elapsed, cycles, misses;
+		uintptr_t sum = 0;
+		uint64_t n = 0;
+
+		gettimeofday(&start, NULL);
+		perf_start(cycles_fd);
+		perf_start(llc_fd);
+		while ((elapsed = elapsed_since(&start)) < bench_seconds) {
+			for (size_t i = 0; i < ntrace; i++) {
+				const trace_addr_t *a = &trace[i];
+				sum += (uintptr_t)trace_engines[e].lookup(&ctx,
+				    a->addr, a->len);
+			}
+			n += ntrace;
+		}
+		cycles = perf_stop(cycles_fd, n);
+		misses = perf_stop(llc_fd, n);
+		printf("%-20s %.2f Mlookups/sec", trace_engines[e].name,
+		    (double)(n + (sum & 1)) / elapsed / 1e6);
+		if (!isnan(cycles)) {
+			printf(", %.1f cycles/lookup", cycles);
+		}
+		if (!isnan(misses)) {
+			printf(", %.3f LLC misses/lookup", misses);
+		}
+		putchar('\n');
+	}
+
+	if (cycles_fd != -1) {
+		close(cycles_fd);
+	}
+	if (llc_fd != -1) {
+		close(llc_fd);
+	}
+	lpm_ctab_destroy(ctx.ctab);
+	lpm_ivtab_destroy(ctx.ivtab);
+	lpm_cache_destroy(ctx.cache);
+	lpm_destroy(ctx.lpm);
+	free(trace);
+	free(pfx);
+}
+
+/*
+ * bench_flow: the source and destination lookups of the packets, where
+ * the flows follow the Zipf distribution: two lpm_lookup() calls vs the
+ * dual lookup, the batch of the dual lookups and the flow table.
+ */
+static void
+bench_flow(void)
+{
+	static const char *modes[] = {
+		"lpm_lookup x2", "lpm_lookup2", "lpm_lookup2_batch",
+		"lpm_flow_lookup",
+	};
+	trace_addr_t *pfx, *trace;
+	uint64_t hits, misses;
+	uint32_t *dst;
+	lpm_flow_t *flow;
+	lpm_t *lpm;
+	size_t ntrace;
+
+	if ((lpm = lpm_create()) == NULL) {
+		err(EXIT_FAILURE, "lpm_create");
+	}
+	populate(lpm);
+	if ((pfx = calloc(bench_prefixes, sizeof(*pfx))) == NULL) {
+		err(EXIT_FAILURE, "calloc");
+	}
+	for (unsigned i = 0; i < bench_prefixes; i++) {
+		pfx[i].addr[0] = prefixes[i];
+		pfx[i].len = 4;
+		pfx[i].preflen = 24;
+	}
+	ntrace = trace_generate(pfx, bench_prefixes, &trace);
+
+	/* The destination is a function of the source: same flows. */
+	if ((dst = malloc(ntrace * sizeof(uint32_t))) == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	for (size_t i = 0; i < ntrace; i++) {
+		const uint32_t h = trace[i].addr[0] * 2654435761U;
+		dst[i] = prefixes[h % bench_prefixes] | htonl(h >> 24);
+	}
+	if ((flow = lpm_flow_create(lpm, FLOW_ENTRIES)) == NULL) {
+		err(EXIT_FAILURE, "lpm_flow_create");
+	}
+
+	for (unsigned m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+		struct timeval start;
+		uintptr_t sum = 0;
+		double elapsed;
+		uint64_t n = 0;
+
+		gettimeofday(&start, NULL);
+		while ((elapsed = elapsed_since(&start)) < bench_seconds) {
+			for (size_t i = 0; i < ntrace; i += FLOW_BATCH) {
+				const void *srcs[FLOW_BATCH], *dsts[FLOW_BATCH];
+				void *svals[FLOW_BATCH], *dvals[FLOW_BATCH];
+				const unsigned k = ntrace - i < FLOW_BATCH ?
+				    ntrace - i : FLOW_BATCH;
+
+				for (unsigned j = 0; j < k; j++) {
+					srcs[j] = trace[i + j].addr;
+					dsts[j] = &dst[i + j];
+				}
+				switch (m) {
+				case 0:
+					for (unsigned j = 0; j < k; j++) {
+						svals[j] = lpm_lookup(lpm,
+						    srcs[j], 4);
+						dvals[j] = lpm_lookup(lpm,
+						    dsts[j], 4);
+					}
+					break;
+				case 1:
+					for (unsigned j = 0; j < k; j++) {
+						lpm_lookup2(lpm, srcs[j],
+						    dsts[j], 4, &svals[j],
+						    &dvals[j]);
+					}
+					break;
+				case 2:
+					lpm_lookup2_batch(lpm, srcs, dsts, 4,
+					    svals, dvals, k);
+					break;
+				case 3:
+					for (unsigned j = 0; j < k; j++) {
+						void *vals[2];
+
+						lpm_flow_lookup(flow, srcs[j],
+						    dsts[j], 4, vals);
+						svals[j] = vals[0];
+						dvals[j] = vals[1];
+					}
+					break;
+				}
+				for (unsigned j = 0; j < k; j++) {
+					sum += (uintptr_t)svals[j] +
+					    (uintptr_t)dvals[j];
+				}
+			}
+			n += ntrace;
+		}
+		printf("%-20s %.2f Mpackets/sec\n", modes[m],
+		    (double)(n + (sum & 1)) / elapsed / 1e6);
+	}
+	lpm_flow_stats(flow, &hits, &misses);
+	printf("%u flow entries, %.1f%% hits\n", FLOW_ENTRIES,
+	    100.0 * hits / (hits + misses));
+	lpm_flow_destroy(flow);
+	lpm_destroy(lpm);
+	free(dst);
+	free(trace);
+	free(pfx);
+}
+
+static unsigned
+hash_max_bucket(const uint32_t *keys, unsigned n, const uint64_t *seed)
+{
+	static unsigned count[HASH_BUCKETS];
+	unsigned max = 0;
+
+	memset(count, 0, sizeof(count));
+	for (unsigned i = 0; i < n; i++) {
+		const uint32_t h = seed ? lpm_hash_seed(seed, &keys[i], 4) :
+		    fnv1a_hash(&keys[i], 4);
+		const unsigned c = ++count[h & (HASH_BUCKETS - 1)];
+
+		max = c > max ? c : max;
+	}
+	return max;
+}
+
+/*
+ * bench_hash: throughput of FNV-1a vs the seeded hash function on the
+ * IPv4 and IPv6 keys, then the keys crafted to collide under FNV-1a:
+ * the longest chain and the lookup throughput of a table of them.
+ */
+static void
+bench_hash(void)
+{
+	static const char *names[] = { "fnv1a", "lpm_hash" };
+	const uint64_t seed[2] = { random(), random() };
+	uint32_t *keys, crafted[2][HASH_CRAFTED];
+	double rates[2];
+
+	if ((keys = malloc(LOOKUP_ADDRS * 16)) == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	for (unsigned i = 0; i < LOOKUP_ADDRS * 4; i++) {
+		keys[i] = random();
+	}
+	for (unsigned len = 4; len <= 16; len += 12) {
+		for (unsigned e = 0; e < 2; e++) {
+			struct timeval start;
+			uint32_t h = 0;
+			uint64_t n;
+
+			gettimeofday(&start, NULL);
+			for (n = 0; elapsed_since(&start) < bench_seconds;
+			    n += LOOKUP_BATCH) {
+				for (unsigned i = 0; i < LOOKUP_BATCH; i++) {
+					const unsigned k = (n + i) &
+					    (LOOKUP_ADDRS - 1);
+					const uint32_t *key = &keys[k * 4];
+
+					h += e ? (len == 4 ?
+					    lpm_hash_seed(seed, key, 4) :
+					    lpm_hash_seed(seed, key, 16)) :
+					    (len == 4 ? fnv1a_hash(key, 4) :
+					    fnv1a_hash(key, 16));
+				}
+			}
+			rates[e] = (double)n / elapsed_since(&start) / 1e6;
+			rates[e] += (h & 1) * 1e-9;
+		}
+		printf("%2u-byte keys: %s %.0f Mhashes/sec, %s %.0f "
+		    "Mhashes/sec\n", len, names[0], rates[0],
+		    names[1], rates[1]);
+	}
+
+	/* The addresses colliding in the low 16 bits of FNV-1a. */
+	for (unsigned i = 0, a = random(); i < HASH_CRAFTED; a++) {
+		const uint32_t key = htonl(a);
+
+		if ((fnv1a_hash(&key, 4) & (HASH_BUCKETS - 1)) == 0) {
+			crafted[0][i++] = key;
+		}
+	}
+	for (unsigned i = 0; i < HASH_CRAFTED; i++) {
+		crafted[1][i] = random();
+	}
+	printf("%u crafted keys, %u buckets: max. chain %s %u, %s %u\n",
+	    HASH_CRAFTED, HASH_BUCKETS,
+	    names[0], hash_max_bucket(crafted[0], HASH_CRAFTED, NULL),
+	    names[1], hash_max_bucket(crafted[0], HASH_CRAFTED, seed));
+
+	for (unsigned e = 0; e < 2; e++) {
+		uint32_t *addrs = keys;
+		double elapsed;
+		lpm_t *lpm;
+		uint64_t n;
+
+		if ((lpm = lpm_create()) == NULL) {
+			err(EXIT_FAILURE, "lpm_create");
+		}
+		for (unsigned i = 0; i < HASH_CRAFTED; i++) {
+			if (lpm_insert(lpm, &crafted[e][i], 4, 32,
+			    (void *)(uintptr_t)(i + 1)) == -1) {
+				err(EXIT_FAILURE, "lpm_insert");
+			}
+		}
+		for (unsigned i = 0; i < LOOKUP_ADDRS; i++) {
+			addrs[i] = crafted[e][i % HASH_CRAFTED];
+		}
+		n = lookup_loop(lpm, addrs, &elapsed);
+		printf("%-12s %u /32 prefixes: %.2f Mlookups/sec\n",
+		    e ? "random" : "crafted", HASH_CRAFTED,
+		    (double)n / elapsed / 1e6);
+		lpm_destroy(lpm);
+	}
+	free(keys);
+}
+
+typedef struct {
+	pthread_t	thread;
+	unsigned	id;
+	unsigned	nthreads;
+	lpm_t *		lpm;
+	lpm_queue_t *	queue;
+	uint64_t	seq;
+} update_worker_t;
+
+static pthread_mutex_t		update_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The updates of a worker: insert its share of the prefixes, replace
+ * the value of each and remove every fourth one.
+ */
+static void *
+update_worker(void *arg)
+{
+	update_worker_t *w = arg;
+	const unsigned start = bench_prefixes * w->id / w->nthreads;
+	const unsigned end = bench_prefixes * (w->id + 1) / w->nthreads;
+
+	pthread_barrier_wait(&barrier);
+	for (unsigned i = start; i < end; i++) {
+		const uint32_t *a = &prefixes[i];
+
+		for (unsigned k = 0; k < 2 + (i % 4 == 0); k++) {
+			void *val = (void *)(uintptr_t)(i + k + 1);
+
+			if (w->queue) {
+				w->seq = k == 2 ?
+				    lpm_queue_remove(w->queue, a, 4, 24) :
+				    lpm_queue_insert(w->queue, a, 4, 24, val);
+				continue;
+			}
+			pthread_mutex_lock(&update_lock);
+			if (k == 2) {
+				lpm_remove(w->lpm, a, 4, 24);
+			} else {
+				lpm_insert(w->lpm, a, 4, 24, val);
+			}
+			pthread_mutex_unlock(&update_lock);
+		}
+	}
+	return NULL;
+}
+
+static void
+bench_queue(void)
+{
+	const unsigned nthreads = bench_nthreads ? bench_nthreads : 4;
+	const uint64_t nupdates = bench_prefixes * 2ULL +
+	    (bench_prefixes + 3) / 4;
+	update_worker_t *workers;
+
+	if ((workers = calloc(nthreads, sizeof(update_worker_t))) == NULL) {
+		err(EXIT_FAILURE, "calloc");
+	}
+	for (unsigned m = 0; m < 2; m++) {
+		uint64_t applied = 0, coalesced = 0, failed = 0;
+		lpm_queue_t *queue = NULL;
+		struct timeval start;
+		lpm_t *lpm;
+
+		if ((lpm = lpm_create()) == NULL) {
+			err(EXIT_FAILURE, "lpm_create");
+		}
+		if (m && (queue = lpm_queue_create(lpm, NULL, NULL)) == NULL) {
+			err(EXIT_FAILURE, "lpm_queue_create");
+		}
+		pthread_barrier_init(&barrier, NULL, nthreads + 1);
+		for (unsigned i = 0; i < nthreads; i++) {
+			workers[i].id = i;
+			workers[i].nthreads = nthreads;
+			workers[i].lpm = lpm;
+			workers[i].queue = queue;
+			if (pthread_create(&workers[i].thread, NULL,
+			    update_worker, &workers[i]) != 0) {
+				err(EXIT_FAILURE, "pthread_create");
+			}
+		}
+		pthread_barrier_wait(&barrier);
+		gettimeofday(&start, NULL);
+		for (unsigned i = 0; i < nthreads; i++) {
+			pthread_join(workers[i].thread, NULL);
+			if (queue) {
+				lpm_queue_wait(queue, workers[i].seq);
+			}
+		}
+		printf("%-12s %u threads: %.2f Mupdates/sec", m ? "queue" :
+		    "mutex", nthreads, nupdates / elapsed_since(&start) / 1e6);
+		pthread_barrier_destroy(&barrier);
+		if (queue) {
+			lpm_queue_stats(queue, &applied, &coalesced, &failed);
+			printf(", %.1f%% coalesced", 100.0 * coalesced /
+			    (applied + coalesced));
+			lpm_queue_destroy(queue);
+		}
+		putchar('\n');
+		lpm_destroy(lpm);
+	}
+	free(workers);
+}
+
+/*
+ * bench_mapped: lookup throughput of the IPv4-mapped IPv6 addresses in
+ * a table with the IPv4 prefixes (LPM_F_MAPPED) vs a plain table with
+ * the same prefixes as the IPv4-mapped IPv6 ones.
+ */
+static void
+bench_mapped(void)
+{
+	static const char *names[] = { "ipv6", "mapped" };
+	uint32_t *addrs;
+	uintptr_t sum = 0;
+
+	if ((addrs = malloc(LOOKUP_ADDRS * 16)) == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	for (unsigned i = 0; i < LOOKUP_ADDRS; i++) {
+		uint32_t *a = &addrs[i * 4];
+
+		a[0] = a[1] = 0;
+		a[2] = htonl(0xffff);
+		a[3] = prefixes[i % bench_prefixes] | htonl(random() & 0xff);
+	}
+	for (unsigned e = 0; e < 2; e++) {
+		const lpm_conf_t conf = { .flags = e ? LPM_F_MAPPED : 0 };
+		struct timeval start;
+		lpm_t *lpm;
+		uint64_t n;
+
+		if ((lpm = lpm_create_ex(&conf)) == NULL) {
+			err(EXIT_FAILURE, "lpm_create_ex");
+		}
+		for (unsigned i = 0; i < bench_prefixes; i++) {
+			const unsigned preflen = 16 + random() % 9;
+			uint32_t a[4] = { 0, 0, htonl(0xffff), prefixes[i] };
+			int ret;
+
+			ret = e ? lpm_insert(lpm, &a[3], 4, preflen,
+			    (void *)(uintptr_t)(i + 1)) :
+			    lpm_insert(lpm, a, 16, 96 + preflen,
+			    (void *)(uintptr_t)(i + 1));
+			if (ret == -1) {
+				err(EXIT_FAILURE, "lpm_insert");
+			}
+		}
+
+		gettimeofday(&start, NULL);
+		for (n = 0; elapsed_since(&start) < bench_seconds;
+		    n += LOOKUP_BATCH) {
+			for (unsigned i = 0; i < LOOKUP_BATCH; i++) {
+				const unsigned k = (n + i) & (LOOKUP_ADDRS - 1);
+				sum += (uintptr_t)lpm_lookup(lpm,
+				    &addrs[k * 4], 16);
+			}
+		}
+		printf("%-8s %u prefixes: %.2f Mlookups/sec\n", names[e],
+		    bench_prefixes, (double)n / elapsed_since(&start) / 1e6 +
+		    (sum & 1) * 1e-9);
+		lpm_destroy(lpm);
+	}
+	free(addrs);
+}
+
+/*
+ * bench_str: lookup throughput of the addresses given as the text lines,
+ * a quarter of them IPv6, using lpm_strtobin() and lpm_lookup() vs
+ * lpm_lookup_str() vs lpm_lookup_str_batch().
+ */
+static void
+bench_str(void)
+{
+	static const char *names[] = { "strtobin", "str", "str_batch" };
+	const unsigned nlines = LOOKUP_ADDRS / 16;
+	void *vals[LOOKUP_BATCH];
+	uintptr_t sum = 0;
+	char *buf, *text, *p;
+	size_t buflen;
+	lpm_t *lpm;
+
+	if ((lpm = lpm_create()) == NULL ||
+	    (buf = malloc(nlines * INET6_ADDRSTRLEN)) == NULL) {
+		err(EXIT_FAILURE, "malloc/lpm_create");
+	}
+	for (unsigned i = 0; i < bench_prefixes; i++) {
+		uint32_t a6[4] = { htonl(0x20010db8), prefixes[i], 0, 0 };
+
+		if (lpm_insert(lpm, &prefixes[i], 4, 24,
+		    (void *)(uintptr_t)(i + 1)) == -1 ||
+		    lpm_insert(lpm, a6, 16, 56,
+		    (void *)(uintptr_t)(i + 1)) == -1) {
+			err(EXIT_FAILURE, "lpm_insert");
+		}
+	}
+	for (unsigned i = 0; i < nlines; i++) {
+		const uint32_t a = prefixes[random() % bench_prefixes] |
+		    htonl(random() & 0xff);
+		const uint32_t a6[4] = { htonl(0x20010db8), a, 0, random() };
+
+		p = &buf[i * INET6_ADDRSTRLEN];
+		if (i % 4 == 3) {
+			inet_ntop(AF_INET6, a6, p, INET6_ADDRSTRLEN);
+		} else {
+			inet_ntop(AF_INET, &a, p, INET6_ADDRSTRLEN);
+		}
+	}
+
+	/* Pack the NUL-terminated lines; also separated by the newlines. */
+	p = buf;
+	for (unsigned i = 0; i < nlines; i++) {
+		const size_t len = strlen(&buf[i * INET6_ADDRSTRLEN]);
+
+		memmove(p, &buf[i * INET6_ADDRSTRLEN], len + 1);
+		p += len + 1;
+	}
+	buflen = p - buf;
+	if ((text = malloc(buflen)) == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	for (size_t i = 0; i < buflen; i++) {
+		text[i] = buf[i] ? buf[i] : '\n';
+	}
+
+	for (unsigned e = 0; e < 3; e++) {
+		struct timeval start;
+		uint64_t n;
+
+		gettimeofday(&start, NULL);
+		for (n = 0; elapsed_since(&start) < bench_seconds; n += nlines) {
+			const char *line = buf;
+
+			if (e == 2) {
+				for (size_t off = 0; off < buflen; ) {
+					size_t consumed;
+					unsigned k;
+
+					k = lpm_lookup_str_batch(lpm,
+					    &text[off], buflen - off, vals,
+					    LOOKUP_BATCH, &consumed);
+					sum += (uintptr_t)vals[k - 1];
+					off += consumed;
+				}
+				continue;
+			}
+			for (unsigned i = 0; i < nlines; i++) {
+				const size_t len = strlen(line);
+				uint32_t addr[4];
+				size_t alen;
+				unsigned pref;
+
+				if (e == 1) {
+					sum += (uintptr_t)lpm_lookup_str(lpm,
+					    line, len);
+				} else if (lpm_strtobin(line, addr,
+				    &alen, &pref) == 0) {
+					sum += (uintptr_t)lpm_lookup(lpm,
+					    addr, alen);
+				}
+				line += len + 1;
+			}
+		}
+		printf("%-10s %.2f Mlookups/sec\n", names[e],
+		    (double)n / elapsed_since(&start) / 1e6 + (sum & 1) * 1e-9);
+	}
+	lpm_destroy(lpm);
+	free(text);
+	free(buf);
+}
+
+/*
+ * bench_memory: the memory use of the IPv4 prefixes, estimated upfront,
+ * accounted by the table and measured by the allocator, and the insertion
+ * throughput with the memory limit (of the estimate) vs without.
+ */
+static void
+bench_memory(void)
+{
+	lpm_memuse_t usage[33];
+	size_t est = 0;
+
+	for (unsigned e = 0; e < 2; e++) {
+		const lpm_conf_t conf = { .memlimit = e ? est : 0 };
+		struct timeval start;
+		size_t heap, total;
+		double elapsed;
+		lpm_t *lpm;
+
+		heap = heap_used();
+		if ((lpm = lpm_create_ex(&conf)) == NULL) {
+			err(EXIT_FAILURE, "lpm_create_ex");
+		}
+		if (e == 0) {
+			est = lpm_memory_estimate(lpm, 4, 24, bench_prefixes);
+		}
+		gettimeofday(&start, NULL);
+		for (unsigned i = 0; i < bench_prefixes; i++) {
+			/* The duplicates fit within the estimate. */
+			if (lpm_insert(lpm, &prefixes[i], 4, 24,
+			    (void *)(uintptr_t)(i + 1)) == -1) {
+				err(EXIT_FAILURE, "lpm_insert");
+			}
+		}
+		elapsed = elapsed_since(&start);
+		heap = heap_used() - heap;
+		total = lpm_memory_usage(lpm, usage, __arraycount(usage));
+
+		printf("%-8s %u prefixes: %.2f Minserts/sec, estimated %zu, "
+		    "accounted %zu (buckets %zu, entries %zu), "
+		    "heap %zu bytes\n",
+		    e ? "limit" : "no limit", bench_prefixes,
+		    bench_prefixes / elapsed / 1e6, est, total,
+		    usage[24].buckets, usage[24].entries, heap);
+		lpm_destroy(lpm);
+	}
+}
+
+static void
+usage(void)
+{
+	fprintf(stderr,
+	    "usage: t_bench [-d seconds] [-n prefixes] [-t threads]\n"
+	    "    [-f prefix-file] [-r pcap-file] [-z skew] mode\n"
+	    "modes: numa, vrf, ivtab, ctab, compact, build, update, sample,\n"
+	    "    bloom, trace, flow, queue, hash, mapped,\n    str, memory\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	const char *mode;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "d:f:n:r:t:z:")) != -1) {
+		switch (ch) {
+		case 'd':
+			bench_seconds = atoi(optarg);
+			break;
+		case 'f':
+			bench_prefix_file = optarg;
+			break;
+		case 'n':
+			bench_prefixes = atoi(optarg);
+			break;
+		case 'r':
+			bench_pcap_file = optarg;
+			break;
+		case 't':
+			bench_nthreads = atoi(optarg);
+			break;
+		case 'z':
+			bench_skew = atof(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if (optind >= argc || !bench_prefixes) {
+		usage();
+	}
+	mode = argv[optind];
+
+	if ((prefixes = malloc(bench_prefixes * sizeof(uint32_t))) == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+	for (unsigned i = 0; i < bench_prefixes; i++) {
+		prefixes[i] = htonl(random() & 0xffffff00);
+	}
+
+	if (strcmp(mode, "numa") == 0) {
+		bench_numa();
+	} else if (strcmp(mode, "vrf") == 0) {
+		bench_vrf();
+	} else if (strcmp(mode, "ivtab") == 0) {
+		bench_ivtab();
+	} else if (strcmp(mode, "ctab") == 0) {
+		bench_ctab();
+	} else if (strcmp(mode, "compact") == 0) {
+		bench_compact();
+	} else if (strcmp(mode, "build") == 0) {
+		bench_build();
+	} else if (strcmp(mode, "update") == 0) {
+		bench_update();
+	} else if (strcmp(mode, "sample") == 0) {
+		bench_sample();
+	} else if (strcmp(mode, "bloom") == 0) {
+		bench_bloom();
+	} else if (strcmp(mode, "trace") == 0) {
+		bench_trace();
+	} else if (strcmp(mode, "flow") == 0) {
+		bench_flow();
+	} else if (strcmp(mode, "queue") == 0) {
+		bench_queue();
+	} else if (strcmp(mode, "hash") == 0) {
+		bench_hash();
+	} else if (strcmp(mode, "mapped") == 0) {
+		bench_mapped();
+	} else if (strcmp(mode, "str") == 0) {
+		bench_str();
+	} else if (strcmp(mode, "memory") == 0) {
+		bench_memory();
+	} else {
+		usage();
+	}
+	free(prefixes);
+	return 0;
+}
@@ -0,0 +1,901 @@
+/*
+ * This file is in the Public Domain.
+ */
+
+/*
+ * Differential fuzzer: drives a random sequence of the operations on
+ * the LPM object and cross-checks every lookup interface against a naive
+ * reference implementation (a linear scan of all prefixes).  This also
+ * covers the transforms: lpm_optimize() of a copy of the table and the
+ * rollback to a snapshot with lpm_apply_diff().
+ *
+ * The operations are decoded from a byte string, therefore the same
+ * harness serves as a libFuzzer target (build with LIBFUZZER=1 using
+ * clang) or runs standalone with the pseudo-random input:
+ *
+ *	t_fuzz [-b] [-n runs] [-s seed]
+ *
+ * In the throughput mode (-b), the reference and the cross-checks are
+ * disabled and the rate of the operations is reported instead.
+ */
+
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "lpm.h"
+
+#define	FUZZ_MAXLEN		(32)
+#define	FUZZ_MAXREF		(4096)
+#define	FUZZ_BASES		(8)
+#define	FUZZ_BULK		(16)
+#define	FUZZ_BATCH		(11)
+#define	FUZZ_MAXMATCH		(FUZZ_MAXLEN * 8 + 1)
+#define	FUZZ_INPUT		(64 * 1024)
+#define	FUZZ_VRF_ID		(7)
+
+typedef struct {
+	uint8_t		addr[FUZZ_MAXLEN];
+	size_t		len;
+	unsigned	preflen;
+	void *		val;
+} fuzz_ref_t;
+
+typedef struct {
+	const uint8_t *	data;
+	size_t		size;
+	size_t		pos;
+	bool		check;
+	uint64_t	nops;
+
+	lpm_t *		lpm;
+	lpm_t *		bloom;		// same updates, with LPM_F_BLOOM
+	lpm_cache_t *	cache;
+	lpm_flow_t *	flow;
+	lpm_vrf_t *	vrf;
+	uintptr_t	nextval;
+
+	lpm_hist_t	hist;
+	fuzz_ref_t	ref[FUZZ_MAXREF];
+	unsigned	nref;
+
+	/* The snapshot of the table and the reference at that point. */
+	lpm_t *		snap;
+	fuzz_ref_t	snapref[FUZZ_MAXREF];
+	unsigned	nsnapref;
+} fuzz_t;
+
+static fuzz_t		fuzz_state;
+
+#define	fuzz_check(f, cond)	\
+    fuzz_check_impl((f), (cond), #cond, __LINE__)
+
+static void
+fuzz_check_impl(const fuzz_t *f, bool cond, const char *expr, int line)
+{
+	if (!cond) {
+		fprintf(stderr, "t_fuzz: line %d: check `%s' failed at the "
+		    "operation %" PRIu64 " (input offset %zu)\n",
+		    line, expr, f->nops, f->pos);
+		abort();
+	}
+}
+
+static unsigned
+fuzz_byte(fuzz_t *f)
+{
+	return f->pos < f->size ? f->data[f->pos++] : 0;
+}
+
+/*
+ * fuzz_key: decode the key length and the address.  The addresses are
+ * derived from a few base addresses per length, so that the prefixes
+ * overlap often.
+ */
+static size_t
+fuzz_key(fuzz_t *f, uint8_t *addr)
+{
+	const unsigned b = fuzz_byte(f);
+	const unsigned base = fuzz_byte(f) % FUZZ_BASES;
+	unsigned nflips = fuzz_byte(f) % 4;
+	size_t len;
+
+	if (b < 112) {
+		len = 4;
+	} else if (b < 224) {
+		len = 16;
+	} else {
+		len = 1 + b % FUZZ_MAXLEN;
+	}
+	for (unsigned i = 0; i < len; i++) {
+		addr[i] = (uint8_t)(base * 0x25 + i * (base + 1));
+	}
+	while (nflips--) {
+		const unsigned bit = fuzz_byte(f) % (len * 8);
+		addr[bit >> 3] ^= 0x80 >> (bit & 7);
+	}
+	return len;
+}
+
+static unsigned
+fuzz_preflen(fuzz_t *f, size_t len)
+{
+	const unsigned b = fuzz_byte(f);
+
+	/* Mostly the lengths near the common ones, sometimes any. */
+	if (b & 1) {
+		static const unsigned common[] = { 0, 8, 16, 24, 32, 48, 64 };
+		const unsigned preflen = common[(b >> 1) % 7];
+		return preflen <= len * 8 ? preflen : len * 8;
+	}
+	return (b >> 1) % (len * 8 + 1);
+}
+
+/*
+ * The reference implementation.
+ */
+
+/*
+ * ref_match: whether the prefix covers the address.
+ */
+static bool
+ref_match(const fuzz_ref_t *r, const uint8_t *addr, size_t len)
+{
+	const unsigned nbytes = r->preflen >> 3, rem = r->preflen & 7;
+
+	if (r->len != len || memcmp(r->addr, addr, nbytes) != 0) {
+		return false;
+	}
+	if (rem) {
+		const uint8_t mask = 0xff << (8 - rem);
+		return ((r->addr[nbytes] ^ addr[nbytes]) & mask) == 0;
+	}
+	return true;
+}
+
+static fuzz_ref_t *
+ref_find(fuzz_t *f, const uint8_t *addr, size_t len, unsigned preflen)
+{
+	for (unsigned i = 0; i < f->nref; i++) {
+		fuzz_ref_t *r = &f->ref[i];
+
+		if (r->preflen == preflen && ref_match(r, addr, len)) {
+			return r;
+		}
+	}
+	return NULL;
+}
+
+static bool
+ref_insert(fuzz_t *f, const uint8_t *addr, size_t len, unsigned preflen,
+    void *val)
+{
+	fuzz_ref_t *r;
+
+	if ((r = ref_find(f, addr, len, preflen)) == NULL) {
+		if (f->nref == FUZZ_MAXREF) {
+			return false;
+		}
+		r = &f->ref[f->nref++];
+		memcpy(r->addr, addr, len);
+		r->len = len;
+		r->preflen = preflen;
+	}
+	r->val = val;
+	return true;
+}
+
+static int
+ref_remove(fuzz_t *f, const uint8_t *addr, size_t len, unsigned preflen)
+{
+	fuzz_ref_t *r = ref_find(f, addr, len, preflen);
+
+	if (r) {
+		*r = f->ref[--f->nref];
+		return 0;
+	}
+	/* Removing the 0-length default always succeeds. */
+	return preflen ? -1 : 0;
+}
+
+/*
+ * ref_lookup_all: store the matching prefixes from the longest to the
+ * shortest; returns the number of the matches.
+ */
+static unsigned
+ref_lookup_all(fuzz_t *f, const uint8_t *addr, size_t len,
+    lpm_match_t *matches)
+{
+	unsigned count = 0;
+
+	for (int preflen = len * 8; preflen >= 0; preflen--) {
+		const fuzz_ref_t *r = ref_find(f, addr, len, preflen);
+
+		if (r) {
+			matches[count].val = r->val;
+			matches[count].preflen = preflen;
+			count++;
+		}
+	}
+	return count;
+}
+
+static void *
+ref_lookup_in(const fuzz_ref_t *ref, unsigned nref, const uint8_t *addr,
+    size_t len)
+{
+	const fuzz_ref_t *best = NULL;
+
+	for (unsigned i = 0; i < nref; i++) {
+		const fuzz_ref_t *r = &ref[i];
+
+		if (ref_match(r, addr, len) &&
+		    (best == NULL || r->preflen > best->preflen)) {
+			best = r;
+		}
+	}
+	return best ? best->val : NULL;
+}
+
+static void *
+ref_lookup(fuzz_t *f, const uint8_t *addr, size_t len)
+{
+	return ref_lookup_in(f->ref, f->nref, addr, len);
+}
+
+/*
+ * The lookup interfaces being cross-checked.
+ */
+
+static void *
+engine_lookup(fuzz_t *f, const void *addr, size_t len)
+{
+	return lpm_lookup(f->lpm, addr, len);
+}
+
+static void *
+engine_cached(fuzz_t *f, const void *addr, size_t len)
+{
+	return lpm_lookup_cached(f->lpm, f->cache, addr, len);
+}
+
+static void *
+engine_lookup_all(fuzz_t *f, const void *addr, size_t len)
+{
+	lpm_match_t m;
+	return lpm_lookup_all(f->lpm, addr, len, &m, 1) ? m.val : NULL;
+}
+
+static void *
+engine_bloom(fuzz_t *f, const void *addr, size_t len)
+{
+	return lpm_lookup(f->bloom, addr, len);
+}
+
+static void *
+engine_flow(fuzz_t *f, const void *addr, size_t len)
+{
+	void *vals[2];
+
+	lpm_flow_lookup(f->flow, addr, addr, len, vals);
+	return vals[0] == vals[1] ? vals[0] : (void *)-1;
+}
+
+/*
+ * fuzz_neighbour: another address close to the given one, i.e. sharing
+ * some of its prefixes.
+ */
+static void
+fuzz_neighbour(const void *addr, size_t len, unsigned n, uint8_t *addr2)
+{
+	memcpy(addr2, addr, len);
+	addr2[(n * 7) % len] ^= 1U << (n & 7);
+}
+
+static void *
+engine_lookup2(fuzz_t *f, const void *addr, size_t len)
+{
+	uint8_t addr2[FUZZ_MAXLEN];
+	void *sval, *dval;
+
+	fuzz_neighbour(addr, len, f->nops, addr2);
+	lpm_lookup2(f->lpm, addr, addr2, len, &sval, &dval);
+	return dval == ref_lookup(f, addr2, len) ? sval : (void *)-1;
+}
+
+static void *
+engine_lookup2_batch(fuzz_t *f, const void *addr, size_t len)
+{
+	const unsigned n = 1 + f->nops % FUZZ_BATCH;
+	uint8_t addrs[FUZZ_BATCH][FUZZ_MAXLEN];
+	const void *src[FUZZ_BATCH], *dst[FUZZ_BATCH];
+	void *svals[FUZZ_BATCH], *dvals[FUZZ_BATCH];
+
+	/* The first source is the address itself, then the neighbours. */
+	for (unsigned i = 0; i < n; i++) {
+		fuzz_neighbour(addr, len, f->nops + i, addrs[i]);
+		src[i] = i ? addrs[i] : addr;
+		dst[i] = addrs[i];
+	}
+	lpm_lookup2_batch(f->lpm, src, dst, len, svals, dvals, n);
+	for (unsigned i = 0; i < n; i++) {
+		if ((i && svals[i] != ref_lookup(f, src[i], len)) ||
+		    dvals[i] != ref_lookup(f, dst[i], len)) {
+			return (void *)-1;
+		}
+	}
+	return svals[0];
+}
+
+static void *
+engine_vrf(fuzz_t *f, const void *addr, size_t len)
+{
+	return lpm_vrf_lookup(f->vrf, FUZZ_VRF_ID, addr, len);
+}
+
+typedef struct {
+	const char *	name;
+	void *		(*lookup)(fuzz_t *, const void *, size_t);
+	bool		iponly;		// IPv4 and IPv6 keys only
+} fuzz_engine_t;
+
+static const fuzz_engine_t fuzz_engines[] = {
+	{ "lpm_lookup",		engine_lookup,		false },
+	{ "lpm_lookup_cached",	engine_cached,		false },
+	{ "lpm_lookup_all",	engine_lookup_all,	false },
+	{ "LPM_F_BLOOM",	engine_bloom,		false },
+	{ "lpm_lookup2",	engine_lookup2,		false },
+	{ "lpm_lookup2_batch",	engine_lookup2_batch,	false },
+	{ "lpm_flow_lookup",	engine_flow,		true },
+	{ "lpm_vrf_lookup",	engine_vrf,		true },
+};
+
+/*
+ * The operations.
+ */
+
+static void
+fuzz_insert(fuzz_t *f)
+{
+	uint8_t addr[FUZZ_MAXLEN];
+	const size_t len = fuzz_key(f, addr);
+	const unsigned preflen = fuzz_preflen(f, len);
+	void *val = (void *)++f->nextval;
+	int ret;
+
+	if (f->check && !ref_insert(f, addr, len, preflen, val)) {
+		return;
+	}
+	ret = lpm_insert(f->lpm, addr, len, preflen, val);
+	fuzz_check(f, ret == 0);
+	if (!f->check) {
+		return;
+	}
+	ret = lpm_insert(f->bloom, addr, len, preflen, val);
+	fuzz_check(f, ret == 0);
+	if (len == 4 || len == 16) {
+		ret = lpm_vrf_insert(f->vrf, FUZZ_VRF_ID,
+		    addr, len, preflen, val);
+		fuzz_check(f, ret == 0);
+	}
+}
+
+static void
+fuzz_insert_bulk(fuzz_t *f)
+{
+	uint8_t addrs[FUZZ_BULK][FUZZ_MAXLEN];
+	lpm_prefix_t pfx[FUZZ_BULK];
+	const unsigned n = 1 + fuzz_byte(f) % FUZZ_BULK;
+	int ret;
+
+	if (f->check && f->nref + n > FUZZ_MAXREF) {
+		return;
+	}
+	for (unsigned i = 0; i < n; i++) {
+		pfx[i].addr = addrs[i];
+		pfx[i].len = fuzz_key(f, addrs[i]);
+		pfx[i].preflen = fuzz_preflen(f, pfx[i].len);
+		pfx[i].val = (void *)++f->nextval;
+		if (!f->check) {
+			continue;
+		}
+		ref_insert(f, addrs[i], pfx[i].len, pfx[i].preflen, pfx[i].val);
+		if (pfx[i].len == 4 || pfx[i].len == 16) {
+			ret = lpm_vrf_insert(f->vrf, FUZZ_VRF_ID, addrs[i],
+			    pfx[i].len, pfx[i].preflen, pfx[i].val);
+			fuzz_check(f, ret == 0);
+		}
+	}
+	ret = lpm_insert_bulk(f->lpm, pfx, n, 2);
+	fuzz_check(f, ret == 0);
+	if (f->check) {
+		ret = lpm_insert_bulk(f->bloom, pfx, n, 2);
+		fuzz_check(f, ret == 0);
+	}
+}
+
+static void
+fuzz_remove(fuzz_t *f)
+{
+	uint8_t addr[FUZZ_MAXLEN];
+	const size_t len = fuzz_key(f, addr);
+	const unsigned preflen = fuzz_preflen(f, len);
+	int ret;
+
+	ret = lpm_remove(f->lpm, addr, len, preflen);
+	if (f->check) {
+		fuzz_check(f, ret == ref_remove(f, addr, len, preflen));
+		fuzz_check(f, ret == lpm_remove(f->bloom, addr, len, preflen));
+		if (len == 4 || len == 16) {
+			/* Note: the result differs for the unknown tenant. */
+			lpm_vrf_remove(f->vrf, FUZZ_VRF_ID, addr, len, preflen);
+		}
+	}
+}
+
+static void
+fuzz_lookup(fuzz_t *f)
+{
+	uint8_t addr[FUZZ_MAXLEN];
+	const size_t len = fuzz_key(f, addr);
+	lpm_match_t matches[FUZZ_MAXMATCH], refm[FUZZ_MAXMATCH];
+	unsigned count, refcount;
+	void *val;
+
+	if (!f->check) {
+		(void)lpm_lookup(f->lpm, addr, len);
+		return;
+	}
+	val = ref_lookup(f, addr, len);
+	for (unsigned i = 0; i < sizeof(fuzz_engines) /
+	    sizeof(fuzz_engines[0]); i++) {
+		const fuzz_engine_t *e = &fuzz_engines[i];
+
+		if (e->iponly && len != 4 && len != 16) {
+			continue;
+		}
+		if (e->lookup(f, addr, len) != val) {
+			fprintf(stderr, "t_fuzz: %s mismatch\n", e->name);
+			fuzz_check(f, false);
+		}
+	}
+
+	if (f->snap) {
+		/* The snapshot is not affected by the later updates. */
+		fuzz_check(f, lpm_lookup(f->snap, addr, len) ==
+		    ref_lookup_in(f->snapref, f->nsnapref, addr, len));
+	}
+
+	count = lpm_lookup_all(f->lpm, addr, len, matches, FUZZ_MAXMATCH);
+	refcount = ref_lookup_all(f, addr, len, refm);
+	fuzz_check(f, count == refcount);
+	for (unsigned i = 0; i < count; i++) {
+		fuzz_check(f, matches[i].val == refm[i].val);
+		fuzz_check(f, matches[i].preflen == refm[i].preflen);
+	}
+}
+
+static void
+fuzz_lookup_prefix(fuzz_t *f)
+{
+	uint8_t addr[FUZZ_MAXLEN];
+	const size_t len = fuzz_key(f, addr);
+	const unsigned preflen = fuzz_preflen(f, len);
+	void *val = lpm_lookup_prefix(f->lpm, addr, len, preflen);
+
+	if (f->check) {
+		const fuzz_ref_t *r = ref_find(f, addr, len, preflen);
+		fuzz_check(f, val == (r ? r->val : NULL));
+	}
+}
+
+static void
+fuzz_ivtab(fuzz_t *f)
+{
+	const unsigned n = fuzz_byte(f) % 16;
+	lpm_ivtab_t *ivtab;
+
+	ivtab = lpm_ivtab_build(f->lpm);
+	fuzz_check(f, ivtab != NULL);
+	for (unsigned i = 0; i < n; i++) {
+		uint8_t addr[FUZZ_MAXLEN];
+		const size_t len = fuzz_key(f, addr);
+		void *val = lpm_ivtab_lookup(ivtab, addr, len);
+
+		if (f->check) {
+			fuzz_check(f, val == ref_lookup(f, addr, len));
+		}
+	}
+	lpm_ivtab_destroy(ivtab);
+}
+
+static void
+fuzz_ctab(fuzz_t *f)
+{
+	const unsigned n = fuzz_byte(f) % 16;
+	lpm_ctab_t *ctab;
+
+	ctab = lpm_ctab_build(f->lpm);
+	fuzz_check(f, ctab != NULL);
+	for (unsigned i = 0; i < n; i++) {
+		uint8_t addr[FUZZ_MAXLEN];
+		const size_t len = fuzz_key(f, addr);
+		void *val = lpm_ctab_lookup(ctab, addr, len);
+
+		if (f->check) {
+			fuzz_check(f, val == ref_lookup(f, addr, len));
+		}
+	}
+	lpm_ctab_destroy(ctab);
+}
+
+static void
+fuzz_snapshot(fuzz_t *f)
+{
+	if (f->snap) {
+		lpm_snapshot_release(f->snap);
+	}
+	f->snap = lpm_snapshot(f->lpm);
+	fuzz_check(f, f->snap != NULL);
+	memcpy(f->snapref, f->ref, f->nref * sizeof(fuzz_ref_t));
+	f->nsnapref = f->nref;
+}
+
+/*
+ * fuzz_rollback: revert the table to the snapshot with lpm_apply_diff(),
+ * while the snapshot still shares the hash maps with the table.
+ */
+static void
+fuzz_rollback(fuzz_t *f)
+{
+	int ret;
+
+	if (f->snap == NULL) {
+		return;
+	}
+	ret = lpm_apply_diff(f->lpm, f->snap, NULL, NULL);
+	fuzz_check(f, ret == 0);
+	if (!f->check) {
+		return;
+	}
+	ret = lpm_apply_diff(f->bloom, f->snap, NULL, NULL);
+	fuzz_check(f, ret == 0);
+	memcpy(f->ref, f->snapref, f->nsnapref * sizeof(fuzz_ref_t));
+	f->nref = f->nsnapref;
+
+	/* The VRF has no snapshots: re-populate it. */
+	lpm_vrf_clear(f->vrf, NULL, NULL);
+	for (unsigned i = 0; i < f->nref; i++) {
+		const fuzz_ref_t *r = &f->ref[i];
+
+		if (r->len == 4 || r->len == 16) {
+			ret = lpm_vrf_insert(f->vrf, FUZZ_VRF_ID,
+			    r->addr, r->len, r->preflen, r->val);
+			fuzz_check(f, ret == 0);
+		}
+	}
+}
+
+/*
+ * The values of the same class (the low bits) are equivalent for
+ * lpm_optimize().
+ */
+static int
+fuzz_val_cmp(void *arg, const void *a, const void *b)
+{
+	(void)arg;
+	return ((uintptr_t)a & 3) != ((uintptr_t)b & 3);
+}
+
+static bool
+fuzz_val_equal(const void *a, const void *b)
+{
+	return a == b || (a && b && fuzz_val_cmp(NULL, a, b) == 0);
+}
+
+typedef struct {
+	fuzz_t *	f;
+	lpm_t *		lpm;
+} fuzz_optimize_t;
+
+static void
+fuzz_optimize_dtor(void *arg, const void *key, size_t len, void *val)
+{
+	fuzz_optimize_t *o = arg;
+
+	/* Merged into another value: no longer in the table. */
+	fuzz_check(o->f, lpm_lookup(o->lpm, key, len) != val);
+}
+
+/*
+ * fuzz_optimize: optimize a copy of the table, which must give the
+ * equivalent lookup results for the prefixes and the random addresses.
+ */
+static void
+fuzz_optimize(fuzz_t *f)
+{
+	const unsigned n = fuzz_byte(f) % 16, start = fuzz_byte(f);
+	fuzz_optimize_t o = { .f = f };
+	int ret;
+
+	if (!f->check) {
+		return;
+	}
+	if ((o.lpm = lpm_create()) == NULL) {
+		err(EXIT_FAILURE, "lpm_create");
+	}
+	for (unsigned i = 0; i < f->nref; i++) {
+		const fuzz_ref_t *r = &f->ref[i];
+
+		ret = lpm_insert(o.lpm, r->addr, r->len, r->preflen, r->val);
+		fuzz_check(f, ret == 0);
+	}
+	ret = lpm_optimize(o.lpm, fuzz_val_cmp, fuzz_optimize_dtor, &o);
+	fuzz_check(f, ret == 0);
+
+	for (unsigned i = 0; i < 64 && i < f->nref; i++) {
+		const fuzz_ref_t *r = &f->ref[(start + i) % f->nref];
+
+		fuzz_check(f, fuzz_val_equal(lpm_lookup(o.lpm,
+		    r->addr, r->len), ref_lookup(f, r->addr, r->len)));
+	}
+	for (unsigned i = 0; i < n; i++) {
+		uint8_t addr[FUZZ_MAXLEN];
+		const size_t len = fuzz_key(f, addr);
+
+		fuzz_check(f, fuzz_val_equal(lpm_lookup(o.lpm, addr, len),
+		    ref_lookup(f, addr, len)));
+	}
+	lpm_destroy(o.lpm);
+}
+
+/*
+ * fuzz_queue: a burst of the updates through the update queue, applied
+ * directly to the other objects.
+ */
+static void
+fuzz_queue(fuzz_t *f)
+{
+	const unsigned n = 1 + fuzz_byte(f) % FUZZ_BULK;
+	lpm_queue_t *q;
+	uint64_t seq = 0;
+
+	if ((q = lpm_queue_create(f->lpm, NULL, NULL)) == NULL) {
+		err(EXIT_FAILURE, "lpm_queue_create");
+	}
+	for (unsigned i = 0; i < n; i++) {
+		uint8_t addr[FUZZ_MAXLEN];
+		const size_t len = fuzz_key(f, addr);
+		const unsigned preflen = fuzz_preflen(f, len);
+		void *val;
+
+		if ((fuzz_byte(f) & 1) == 0) {
+			seq = lpm_queue_remove(q, addr, len, preflen);
+			if (f->check) {
+				ref_remove(f, addr, len, preflen);
+				lpm_remove(f->bloom, addr, len, preflen);
+				if (len == 4 || len == 16) {
+					lpm_vrf_remove(f->vrf, FUZZ_VRF_ID,
+					    addr, len, preflen);
+				}
+			}
+			continue;
+		}
+		val = (void *)++f->nextval;
+		if (f->check && !ref_insert(f, addr, len, preflen, val)) {
+			continue;
+		}
+		seq = lpm_queue_insert(q, addr, len, preflen, val);
+		if (f->check) {
+			fuzz_check(f, lpm_insert(f->bloom, addr, len,
+			    preflen, val) == 0);
+			if (len == 4 || len == 16) {
+				fuzz_check(f, lpm_vrf_insert(f->vrf,
+				    FUZZ_VRF_ID, addr, len, preflen, val) == 0);
+			}
+		}
+	}
+	lpm_queue_wait(q, seq);
+	lpm_queue_destroy(q);
+}
+
+/*
+ * fuzz_memory: the memory usage of the table is the sum of its breakdown.
+ */
+static size_t
+fuzz_memory(fuzz_t *f, lpm_t *lpm)
+{
+	lpm_memuse_t usage[FUZZ_MAXLEN * 8 + 1];
+	size_t total, sum = 0;
+
+	total = lpm_memory_usage(lpm, usage, FUZZ_MAXLEN * 8 + 1);
+	for (unsigned n = 1; n <= FUZZ_MAXLEN * 8; n++) {
+		sum += usage[n].buckets + usage[n].entries + usage[n].filters;
+	}
+	fuzz_check(f, total == sum);
+	return total;
+}
+
+static void
+fuzz_clear(fuzz_t *f)
+{
+	lpm_clear(f->lpm, NULL, NULL);
+	lpm_clear(f->bloom, NULL, NULL);
+	lpm_vrf_clear(f->vrf, NULL, NULL);
+	f->nref = 0;
+	if (f->check) {
+		fuzz_check(f, fuzz_memory(f, f->lpm) == 0);
+		fuzz_check(f, fuzz_memory(f, f->bloom) == 0);
+	}
+}
+
+/*
+ * fuzz_run: decode and run the operations on the fresh objects.
+ */
+static void
+fuzz_run(fuzz_t *f, const uint8_t *data, size_t size, bool check)
+{
+	const lpm_conf_t bloom_conf = { .flags = LPM_F_BLOOM };
+
+	memset(f, 0, sizeof(fuzz_t));
+	f->data = data;
+	f->size = size;
+	f->check = check;
+
+	f->lpm = lpm_create();
+	f->bloom = lpm_create_ex(&bloom_conf);
+	f->cache = lpm_cache_create(64);
+	f->flow = lpm_flow_create(f->lpm, 64);
+	f->vrf = lpm_vrf_create();
+	if (!f->lpm || !f->bloom || !f->cache || !f->flow || !f->vrf) {
+		err(EXIT_FAILURE, "lpm_create");
+	}
+	lpm_hist_register(&f->hist);
+
+	while (f->pos < f->size) {
+		const unsigned op = fuzz_byte(f);
+
+		switch (op % 16) {
+		case 0: case 1: case 2: case 3: case 4:
+			fuzz_insert(f);
+			break;
+		case 5: case 6:
+			fuzz_remove(f);
+			break;
+		case 7: case 8: case 9: case 10: case 11:
+			fuzz_lookup(f);
+			break;
+		case 12:
+			fuzz_lookup_prefix(f);
+			break;
+		case 13:
+			fuzz_insert_bulk(f);
+			break;
+		case 14:
+			/* Rarely: rebuild the table. */
+			if (op == 14) {
+				fuzz_ivtab(f);
+			} else if (op == 30) {
+				fuzz_check(f, lpm_compact(f->lpm) == 0);
+				fuzz_check(f, lpm_compact(f->bloom) == 0);
+			} else if (op == 46) {
+				fuzz_clear(f);
+			} else if (op == 62) {
+				fuzz_ctab(f);
+			} else if (op == 78 || op == 94) {
+				fuzz_snapshot(f);
+			} else if (op == 110) {
+				fuzz_queue(f);
+			} else if (op == 126) {
+				fuzz_optimize(f);
+			} else if (op == 142) {
+				fuzz_rollback(f);
+			}
+			break;
+		case 15:
+			lpm_set_sampling(f->lpm, op >> 4);
+			break;
+		}
+		f->nops++;
+	}
+
+	if (f->check) {
+		fuzz_memory(f, f->lpm);
+		fuzz_memory(f, f->bloom);
+		if (f->snap) {
+			fuzz_memory(f, f->snap);
+		}
+	}
+	lpm_hist_register(NULL);
+	lpm_vrf_destroy(f->vrf);
+	lpm_flow_destroy(f->flow);
+	lpm_cache_destroy(f->cache);
+	lpm_destroy(f->bloom);
+	lpm_destroy(f->lpm);
+	if (f->snap) {
+		/* The snapshot outlives the table. */
+		lpm_snapshot_release(f->snap);
+	}
+}
+
+#ifdef LPM_LIBFUZZER
+
+int	LLVMFuzzerTestOneInput(const uint8_t *, size_t);
+
+int
+LLVMFuzzerTestOneInput(const uint8_t *data, size_t size)
+{
+	fuzz_run(&fuzz_state, data, size, true);
+	return 0;
+}
+
+#else
+
+static void
+usage(void)
+{
+	fprintf(stderr, "usage: t_fuzz [-b] [-n runs] [-s seed]\n");
+	exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned nruns = 20, seed = 1;
+	bool bench = false;
+	struct timeval start, end;
+	uint64_t nops = 0;
+	uint8_t *data;
+	double elapsed = 0;
+	int ch;
+
+	while ((ch = getopt(argc, argv, "bn:s:")) != -1) {
+		switch (ch) {
+		case 'b':
+			bench = true;
+			break;
+		case 'n':
+			nruns = atoi(optarg);
+			break;
+		case 's':
+			seed = atoi(optarg);
+			break;
+		default:
+			usage();
+		}
+	}
+	if ((data = malloc(FUZZ_INPUT)) == NULL) {
+		err(EXIT_FAILURE, "malloc");
+	}
+
+	srandom(seed);
+	for (unsigned r = 0; r < nruns; r++) {
+		for (unsigned i = 0; i < FUZZ_INPUT; i++) {
+			data[i] = random();
+		}
+		gettimeofday(&start, NULL);
+		fuzz_run(&fuzz_state, data, FUZZ_INPUT, !bench);
+		gettimeofday(&end, NULL);
+		elapsed += (end.tv_sec - start.tv_sec) +
+		    (end.tv_usec - start.tv_usec) / 1e6;
+		nops += fuzz_state.nops;
+	}
+	free(data);
+
+	if (bench) {
+		printf("%" PRIu64 " operations, %.2f Mops/sec\n",
+		    nops, (double)nops / elapsed / 1e6);
+	} else {
+		printf("ok: %u runs, %" PRIu64 " operations\n", nruns, nops);
+	}
+	return 0;
+}
+
+#endif
@@ -2,13 +2,23 @@
  * This file is in the Public Domain.
  */
 
+#include <arpa/inet.h>
+
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
 #include <inttypes.h>
+#include <string.h>
+#include <errno.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include "lpm.h"
 
+#ifndef __arraycount
+#define	__arraycount(__x)	(sizeof(__x) / sizeof(__x[0]))
+#endif
+
 static void
 ipv4_basic_test(void)
 {
@@ -298,6 +308,2020 @@ default_test(void)
 	lpm_destroy(lpm);
 }
 
+typedef struct {
+	unsigned	nops[4];
+} diff_count_t;
+
+static int
+diff_count(void *arg, unsigned op, const void *key, size_t len,
+    unsigned preflen, void *oval, void *nval)
+{
+	diff_count_t *dc = arg;
+
+	assert(op == LPM_DIFF_ADD || op == LPM_DIFF_REMOVE ||
+	    op == LPM_DIFF_CHANGE);
+	assert(op != LPM_DIFF_ADD || oval == NULL);
+	assert(op != LPM_DIFF_REMOVE || nval == NULL);
+	assert(len == 4 || len == 16);
+	assert(preflen <= 128);
+	dc->nops[op]++;
+	(void)key;
+	return 0;
+}
+
+static void
+diff_test(void)
+{
+	static const char *old_cidrs[] = {
+		"10.0.0.0/8", "10.1.0.0/16", "10.1.1.0/24", "10.2.0.0/16",
+		"fd00::/8", "fd00:1::/32", "0.0.0.0/0",
+	};
+	static const char *new_cidrs[] = {
+		"10.0.0.0/8", "10.1.0.0/16", "10.3.0.0/16",
+		"fd00::/8", "fd00:2::/32", "::/0",
+	};
+	diff_count_t dc = {{ 0 }};
+	lpm_t *old, *new;
+	uint32_t addr[4];
+	size_t len;
+	unsigned pref;
+	int ret;
+
+	old = lpm_create();
+	assert(old != NULL);
+	new = lpm_create();
+	assert(new != NULL);
+
+	for (unsigned i = 0; i < __arraycount(old_cidrs); i++) {
+		lpm_strtobin(old_cidrs[i], addr, &len, &pref);
+		ret = lpm_insert(old, addr, len, pref, (void *)0x1);
+		assert(ret == 0);
+	}
+	for (unsigned i = 0; i < __arraycount(new_cidrs); i++) {
+		lpm_strtobin(new_cidrs[i], addr, &len, &pref);
+		ret = lpm_insert(new, addr, len, pref, (void *)0x1);
+		assert(ret == 0);
+	}
+
+	/* Change the value of one prefix. */
+	lpm_strtobin("10.1.0.0/16", addr, &len, &pref);
+	ret = lpm_insert(new, addr, len, pref, (void *)0x2);
+	assert(ret == 0);
+
+	ret = lpm_diff(old, new, diff_count, &dc);
+	assert(ret == 0);
+	assert(dc.nops[LPM_DIFF_ADD] == 3);	// 10.3/16, fd00:2::/32, ::/0
+	assert(dc.nops[LPM_DIFF_REMOVE] == 4);	// 10.1.1/24, 10.2/16, ...
+	assert(dc.nops[LPM_DIFF_CHANGE] == 1);	// 10.1/16
+
+	ret = lpm_apply_diff(old, new, NULL, NULL);
+	assert(ret == 0);
+
+	memset(&dc, 0, sizeof(dc));
+	ret = lpm_diff(old, new, diff_count, &dc);
+	assert(ret == 0);
+	assert(!dc.nops[LPM_DIFF_ADD] && !dc.nops[LPM_DIFF_REMOVE] &&
+	    !dc.nops[LPM_DIFF_CHANGE]);
+
+	lpm_strtobin("10.1.1.1", addr, &len, &pref);
+	assert(lpm_lookup(old, addr, len) == (void *)0x2);
+	lpm_strtobin("10.2.1.1", addr, &len, &pref);
+	assert(lpm_lookup(old, addr, len) == (void *)0x1);
+	lpm_strtobin("11.0.0.1", addr, &len, &pref);
+	assert(lpm_lookup(old, addr, len) == NULL);
+	lpm_strtobin("fd00:1::1", addr, &len, &pref);
+	assert(lpm_lookup(old, addr, len) == (void *)0x1);
+	lpm_strtobin("fe00::1", addr, &len, &pref);
+	assert(lpm_lookup(old, addr, len) == (void *)0x1);
+
+	lpm_destroy(old);
+	lpm_destroy(new);
+}
+
+static unsigned
+count_prefixes(lpm_t *lpm)
+{
+	diff_count_t dc = {{ 0 }};
+	lpm_t *empty;
+
+	empty = lpm_create();
+	assert(empty != NULL);
+	lpm_diff(lpm, empty, diff_count, &dc);
+	lpm_destroy(empty);
+	return dc.nops[LPM_DIFF_REMOVE];
+}
+
+typedef struct {
+	unsigned	ndestroyed;
+	void *		destroyed;
+} optimize_ctx_t;
+
+static int
+optimize_cmp(void *arg, const void *a, const void *b)
+{
+	/* The values of the same class (high bits) are equivalent. */
+	(void)arg;
+	return ((uintptr_t)a >> 4) != ((uintptr_t)b >> 4);
+}
+
+static void
+optimize_dtor(void *arg, const void *key, size_t len, void *val)
+{
+	optimize_ctx_t *ctx = arg;
+
+	assert(len == 4 || len == 16);
+	ctx->ndestroyed++;
+	ctx->destroyed = val;
+	(void)key;
+}
+
+static void
+optimize_test(void)
+{
+	static const char *cidrs[] = {
+		"10.0.0.0/24", "10.0.1.0/24",		// siblings
+		"10.1.0.0/23", "10.1.1.0/24",		// covered
+		"10.2.0.0/25", "10.2.0.128/25",		// siblings
+		"fd00::/64", "fd00:0:0:1::/64",		// siblings
+	};
+	optimize_ctx_t octx = { 0, NULL };
+	lpm_t *lpm, *orig;
+	void *merged;
+	uint32_t addr[4];
+	size_t len;
+	unsigned pref;
+	int ret;
+
+	lpm = lpm_create();
+	assert(lpm != NULL);
+
+	for (unsigned i = 0; i < __arraycount(cidrs); i++) {
+		lpm_strtobin(cidrs[i], addr, &len, &pref);
+		ret = lpm_insert(lpm, addr, len, pref, (void *)0x1);
+		assert(ret == 0);
+	}
+	ret = lpm_optimize(lpm, NULL, optimize_dtor, &octx);
+	assert(ret == 0);
+	assert(count_prefixes(lpm) == 4);
+	assert(octx.ndestroyed == 0);	// the value is still in use
+
+	lpm_strtobin("10.0.0.0/23", addr, &len, &pref);
+	assert(lpm_lookup_prefix(lpm, addr, len, pref) == (void *)0x1);
+	lpm_strtobin("10.2.0.0/24", addr, &len, &pref);
+	assert(lpm_lookup_prefix(lpm, addr, len, pref) == (void *)0x1);
+	lpm_strtobin("10.3.0.1", addr, &len, &pref);
+	assert(lpm_lookup(lpm, addr, len) == NULL);
+	lpm_strtobin("fd00:0:0:1::1", addr, &len, &pref);
+	assert(lpm_lookup(lpm, addr, len) == (void *)0x1);
+	lpm_destroy(lpm);
+
+	/*
+	 * Equivalent values: the siblings are merged into one of them and
+	 * the other one is destroyed.
+	 */
+	lpm = lpm_create();
+	assert(lpm != NULL);
+	lpm_strtobin("10.0.0.0/24", addr, &len, &pref);
+	ret = lpm_insert(lpm, addr, len, pref, (void *)0x10);
+	assert(ret == 0);
+	lpm_strtobin("10.0.1.0/24", addr, &len, &pref);
+	ret = lpm_insert(lpm, addr, len, pref, (void *)0x11);
+	assert(ret == 0);
+	ret = lpm_optimize(lpm, optimize_cmp, optimize_dtor, &octx);
+	assert(ret == 0);
+	assert(count_prefixes(lpm) == 1);
+	assert(octx.ndestroyed == 1);
+	lpm_strtobin("10.0.0.0/23", addr, &len, &pref);
+	merged = lpm_lookup_prefix(lpm, addr, len, pref);
+	assert(merged == (void *)0x10 || merged == (void *)0x11);
+	assert(merged != octx.destroyed);
+
+	/* Nothing to merge: nothing destroyed. */
+	ret = lpm_optimize(lpm, optimize_cmp, optimize_dtor, &octx);
+	assert(ret == 0);
+	assert(octx.ndestroyed == 1);
+	lpm_destroy(lpm);
+
+	/*
+	 * Random prefixes within 10.0.0.0/16 with a few distinct values:
+	 * the optimized table must give the same answers.
+	 */
+	lpm = lpm_create();
+	assert(lpm != NULL);
+	orig = lpm_create();
+	assert(orig != NULL);
+
+	for (unsigned i = 0; i < 4096; i++) {
+		const uint32_t a = htonl(0x0a000000 | (random() & 0xffff));
+		void *val = (void *)(uintptr_t)(random() % 3);
+
+		pref = 16 + random() % 17;
+		ret = lpm_insert(lpm, &a, 4, pref, val);
+		assert(ret == 0);
+		ret = lpm_insert(orig, &a, 4, pref, val);
+		assert(ret == 0);
+	}
+	ret = lpm_optimize(lpm, NULL, NULL, NULL);
+	assert(ret == 0);
+	assert(count_prefixes(lpm) <= count_prefixes(orig));
+
+	for (uint32_t i = 0; i <= 0xffff; i++) {
+		const uint32_t a = htonl(0x0a000000 | i);
+		assert(lpm_lookup(lpm, &a, 4) == lpm_lookup(orig, &a, 4));
+	}
+	lpm_destroy(lpm);
+	lpm_destroy(orig);
+}
+
+static void
+lookup_all_test(void)
+{
+	static const char *cidrs[] = {
+		"10.0.0.0/8", "10.1.0.0/16", "10.1.1.0/24", "10.1.1.1/32",
+		"10.2.0.0/16", "0.0.0.0/0", "::/0", "fd00::/8",
+	};
+	lpm_match_t matches[8];
+	lpm_t *lpm;
+	uint32_t addr[4];
+	size_t len;
+	unsigned pref, n;
+	int ret;
+
+	lpm = lpm_create();
+	assert(lpm != NULL);
+
+	for (unsigned i = 0; i < __arraycount(cidrs); i++) {
+		lpm_strtobin(cidrs[i], addr, &len, &pref);
+		ret = lpm_insert(lpm, addr, len, pref,
+		    (void *)(uintptr_t)(0x100 + pref));
+		assert(ret == 0);
+	}
+
+	lpm_strtobin("10.1.1.1", addr, &len, &pref);
+	n = lpm_lookup_all(lpm, addr, len, matches, __arraycount(matches));
+	assert(n == 5);
+	assert(matches[0].preflen == 32 && matches[0].val == (void *)0x120);
+	assert(matches[1].preflen == 24 && matches[1].val == (void *)0x118);
+	assert(matches[2].preflen == 16 && matches[2].val == (void *)0x110);
+	assert(matches[3].preflen == 8 && matches[3].val == (void *)0x108);
+	assert(matches[4].preflen == 0 && matches[4].val == (void *)0x100);
+
+	/* Limited by the maximum: the longest ones first. */
+	n = lpm_lookup_all(lpm, addr, len, matches, 2);
+	assert(n == 2);
+	assert(matches[0].preflen == 32 && matches[1].preflen == 24);
+
+	lpm_strtobin("10.2.0.1", addr, &len, &pref);
+	n = lpm_lookup_all(lpm, addr, len, matches, __arraycount(matches));
+	assert(n == 3);
+	assert(matches[0].preflen == 16 && matches[0].val == (void *)0x110);
+
+	lpm_strtobin("fd00::1", addr, &len, &pref);
+	n = lpm_lookup_all(lpm, addr, len, matches, __arraycount(matches));
+	assert(n == 2);
+	assert(matches[0].preflen == 8 && matches[1].preflen == 0);
+
+	lpm_destroy(lpm);
+}
+
+static void
+numa_test(void)
+{
+	const lpm_conf_t conf = { .flags = LPM_F_NUMA };
+	const unsigned nitems = 1024;
+	uint32_t addr[4], addrs[nitems];
+	lpm_t *lpm, *new, *snap;
+	size_t len;
+	unsigned pref;
+	int ret;
+
+	/*
+	 * The replicated table must behave as a regular one.
+	 */
+	lpm = lpm_create_ex(&conf);
+	assert(lpm != NULL);
+
+	for (unsigned i = 0; i < nitems; i++) {
+		addrs[i] = random();
+		ret = lpm_insert(lpm, &addrs[i], 4, 24 + (i % 9),
+		    (void *)(uintptr_t)(i + 1));
+		assert(ret == 0);
+	}
+	for (unsigned i = 0; i < nitems; i++) {
+		assert(lpm_lookup(lpm, &addrs[i], 4) != NULL);
+	}
+
+	/*
+	 * The snapshot is not supported for a replicated table (even with
+	 * a single node); otherwise, it outlives a copy-on-write update.
+	 */
+	snap = lpm_snapshot(lpm);
+	if (snap) {
+		const uint32_t a = htonl(0xc6336401);
+		void *val = lpm_lookup(lpm, &a, 4);
+
+		ret = lpm_insert(lpm, &a, 4, 32, (void *)0x5);
+		assert(ret == 0);
+		assert(lpm_lookup(lpm, &a, 4) == (void *)0x5);
+		assert(lpm_lookup(snap, &a, 4) == val);
+		lpm_snapshot_release(snap);
+		ret = lpm_remove(lpm, &a, 4, 32);
+		assert(ret == 0);
+	}
+
+	lpm_strtobin("fd00::/8", addr, &len, &pref);
+	ret = lpm_insert(lpm, addr, len, pref, (void *)0x1);
+	assert(ret == 0);
+	lpm_strtobin("::/0", addr, &len, &pref);
+	ret = lpm_insert(lpm, addr, len, pref, (void *)0x2);
+	assert(ret == 0);
+
+	lpm_strtobin("fd00::1", addr, &len, &pref);
+	assert(lpm_lookup(lpm, addr, len) == (void *)0x1);
+	lpm_strtobin("fe00::1", addr, &len, &pref);
+	assert(lpm_lookup(lpm, addr, len) == (void *)0x2);
+
+	/* Apply the changes to all replicas. */
+	new = lpm_create();
+	assert(new != NULL);
+	lpm_strtobin("fd00::/8", addr, &len, &pref);
+	ret = lpm_insert(new, addr, len, pref, (void *)0x3);
+	assert(ret == 0);
+
+	ret = lpm_apply_diff(lpm, new, NULL, NULL);
+	assert(ret == 0);
+	lpm_destroy(new);
+
+	lpm_strtobin("fd00::1", addr, &len, &pref);
+	assert(lpm_lookup(lpm, addr, len) == (void *)0x3);
+	lpm_strtobin("fe00::1", addr, &len, &pref);
+	assert(lpm_lookup(lpm, addr, len) == NULL);
+	for (unsigned i = 0; i < nitems; i++) {
+		assert(lpm_lookup(lpm, &addrs[i], 4) == NULL);
+	}
+
+	lpm_strtobin("fd00::/8", addr, &len, &pref);
+	ret = lpm_remove(lpm, addr, len, pref);
+	assert(ret == 0);
+	ret = lpm_remove(lpm, addr, len, pref);
+	assert(ret == -1);
+
+	lpm_destroy(lpm);
+}
+
+static void
+cache_test(void)
+{
+	lpm_cache_t *cache;
+	uint64_t hits, misses;
+	uint32_t addr[4];
+	lpm_t *lpm;
+	size_t len;
+	unsigned pref;
+	void *val;
+	int ret;
+
+	lpm = lpm_create();
+	assert(lpm != NULL);
+	cache = lpm_cache_create(64);
+	assert(cache != NULL);
+
+	lpm_strtobin("10.0.0.0/8", addr, &len, &pref);
+	ret = lpm_insert(lpm, addr, len, pref, (void *)0x1);
+	assert(ret == 0);
+
+	lpm_strtobin("10.1.1.1", addr, &len, &pref);
+	val = lpm_lookup_cached(lpm, cache, addr, len);
+	assert(val == (void *)0x1);
+	val = lpm_lookup_cached(lpm, cache, addr, len);
+	assert(val == (void *)0x1);
+	lpm_cache_stats(cache, &hits, &misses);
+	assert(hits == 1 && misses == 1);
+
+	/* The negative results are cached too. */
+	lpm_strtobin("fd00::1", addr, &len, &pref);
+	val = lpm_lookup_cached(lpm, cache, addr, len);
+	assert(val == NULL);
+	val = lpm_lookup_cached(lpm, cache, addr, len);
+	assert(val == NULL);
+	lpm_cache_stats(cache, &hits, &misses);
+	assert(hits == 2 && misses == 2);
+
+	/* An update invalidates the cache. */
+	lpm_strtobin("10.1.0.0/16", addr, &len, &pref);
+	ret = lpm_insert(lpm, addr, len, pref, (void *)0x2);
+	assert(ret == 0);
+
+	lpm_strtobin("10.1.1.1", addr, &len, &pref);
+	val = lpm_lookup_cached(lpm, cache, addr, len);
+	assert(val == (void *)0x2);
+	lpm_cache_stats(cache, &hits, &misses);
+	assert(hits == 2 && misses == 3);
+
+	lpm_strtobin("10.1.0.0/16", addr, &len, &pref);
+	ret = lpm_remove(lpm, addr, len, pref);
+	assert(ret == 0);
+
+	lpm_strtobin("10.1.1.1", addr, &len, &pref);
+	val = lpm_lookup_cached(lpm, cache, addr, len);
+	assert(val == (void *)0x1);
+
+	lpm_clear(lpm, NULL, NULL);
+	val = lpm_lookup_cached(lpm, cache, addr, len);
+	assert(val == NULL);
+
+	/* Many addresses: the results must match the table. */
+	for (unsigned i = 0; i < 1024; i++) {
+		const uint32_t a = random();
+
+		ret = lpm_insert(lpm, &a, 4, 24, (void *)(uintptr_t)(i + 1));
+		assert(ret == 0);
+	}
+	for (unsigned i = 0; i < 4096; i++) {
+		const uint32_t a = random();
+		assert(lpm_lookup_cached(lpm, cache, &a, 4) ==
+		    lpm_lookup(lpm, &a, 4));
+	}
+
+	lpm_cache_destroy(cache);
+	lpm_destroy(lpm);
+}
+
+static void
+keylen_test(void)
+{
+	/* MAC addresses (6 bytes). */
+	const uint8_t mac_oui[6] = { 0x00, 0x1b, 0x21, 0x00, 0x00, 0x00 };
+	const uint8_t mac_host[6] = { 0x00, 0x1b, 0x21, 0x12, 0x34, 0x56 };
+	const uint8_t mac_other[6] = { 0x00, 0x1b, 0x22, 0x12, 0x34, 0x56 };
+
+	/* VRF ID (2 bytes) followed by an IPv6 address. */
+	uint8_t vrf_addr[18] = { 0x00, 0x07 };
+	uint8_t key32[32];
+	uint32_t addr4;
+	lpm_match_t m[4];
+	lpm_t *lpm;
+	size_t len;
+	unsigned pref;
+	void *val;
+	int ret;
+
+	lpm = lpm_create();
+	assert(lpm != NULL);
+
+	ret = lpm_insert(lpm, mac_oui, 6, 24, (void *)0x1);
+	assert(ret == 0);
+	ret = lpm_insert(lpm, mac_host, 6, 48, (void *)0x2);
+	assert(ret == 0);
+
+	val = lpm_lookup(lpm, mac_host, 6);
+	assert(val == (void *)0x2);
+	val = lpm_lookup(lpm, mac_other, 6);
+	assert(val == NULL);
+	memcpy(key32, mac_host, 6);
+	key32[5] ^= 1;
+	val = lpm_lookup(lpm, key32, 6);
+	assert(val == (void *)0x1);
+
+	/* The 6-byte /24 must not match the IPv4 addresses. */
+	memcpy(&addr4, mac_host, 4);
+	val = lpm_lookup(lpm, &addr4, 4);
+	assert(val == NULL);
+
+	/* The VRF-scoped IPv6 prefix, i.e. 16 + 64 bits. */
+	lpm_strtobin("2001:db8::", &vrf_addr[2], &len, &pref);
+	ret = lpm_insert(lpm, vrf_addr, 18, 16 + 32, (void *)0x3);
+	assert(ret == 0);
+	lpm_strtobin("2001:db8::1", &vrf_addr[2], &len, &pref);
+	val = lpm_lookup(lpm, vrf_addr, 18);
+	assert(val == (void *)0x3);
+	vrf_addr[1] = 0x08;
+	val = lpm_lookup(lpm, vrf_addr, 18);
+	assert(val == NULL);
+
+	/* The defaults are per key length. */
+	ret = lpm_insert(lpm, vrf_addr, 18, 0, (void *)0x4);
+	assert(ret == 0);
+	val = lpm_lookup(lpm, vrf_addr, 18);
+	assert(val == (void *)0x4);
+	val = lpm_lookup(lpm, mac_other, 6);
+	assert(val == NULL);
+
+	/* The maximum key length. */
+	memset(key32, 0xa5, sizeof(key32));
+	ret = lpm_insert(lpm, key32, 32, 256, (void *)0x5);
+	assert(ret == 0);
+	ret = lpm_insert(lpm, key32, 32, 255, (void *)0x6);
+	assert(ret == 0);
+	val = lpm_lookup(lpm, key32, 32);
+	assert(val == (void *)0x5);
+	key32[31] ^= 1;
+	val = lpm_lookup(lpm, key32, 32);
+	assert(val == (void *)0x6);
+	assert(lpm_lookup_all(lpm, key32, 32, m, 4) == 1);
+
+	/* The minimum key length. */
+	ret = lpm_insert(lpm, key32, 1, 3, (void *)0x7);
+	assert(ret == 0);
+	val = lpm_lookup(lpm, key32, 1);
+	assert(val == (void *)0x7);
+
+	ret = lpm_remove(lpm, mac_host, 6, 48);
+	assert(ret == 0);
+	val = lpm_lookup(lpm, mac_host, 6);
+	assert(val == (void *)0x1);
+
+	lpm_destroy(lpm);
+}
+
+static void
+vrf_dtor(void *arg, const void *key, size_t len, void *val)
+{
+	unsigned *count = arg;
+
+	assert(len == 4 || len == 16);
+	(*count)++;
+	(void)key; (void)val;
+}
+
+static void
+vrf_test(void)
+{
+	lpm_vrf_t *vrf;
+	uint32_t addr[4];
+	size_t len;
+	unsigned pref, count = 0;
+	void *val;
+	int ret;
+
+	vrf = lpm_vrf_create();
+	assert(vrf != NULL);
+
+	/* The same prefix in two VRFs. */
+	lpm_strtobin("10.0.0.0/8", addr, &len, &pref);
+	ret = lpm_vrf_insert(vrf, 1, addr, len, pref, (void *)0x1);
+	assert(ret == 0);
+	ret = lpm_vrf_insert(vrf, 2, addr, len, pref, (void *)0x2);
+	assert(ret == 0);
+	lpm_strtobin("10.1.0.0/16", addr, &len, &pref);
+	ret = lpm_vrf_insert(vrf, 2, addr, len, pref, (void *)0x3);
+	assert(ret == 0);
+
+	lpm_strtobin("10.1.1.1", addr, &len, &pref);
+	val = lpm_vrf_lookup(vrf, 1, addr, len);
+	assert(val == (void *)0x1);
+	val = lpm_vrf_lookup(vrf, 2, addr, len);
+	assert(val == (void *)0x3);
+	val = lpm_vrf_lookup(vrf, 3, addr, len);
+	assert(val == NULL);
+
+	lpm_strtobin("10.1.0.0", addr, &len, &pref);
+	val = lpm_vrf_lookup_prefix(vrf, 2, addr, len, 16);
+	assert(val == (void *)0x3);
+	val = lpm_vrf_lookup_prefix(vrf, 1, addr, len, 16);
+	assert(val == NULL);
+
+	/* The defaults are per VRF and per address family. */
+	ret = lpm_vrf_insert(vrf, 3, addr, 4, 0, (void *)0x4);
+	assert(ret == 0);
+	lpm_strtobin("192.168.1.1", addr, &len, &pref);
+	val = lpm_vrf_lookup(vrf, 3, addr, len);
+	assert(val == (void *)0x4);
+	val = lpm_vrf_lookup(vrf, 1, addr, len);
+	assert(val == NULL);
+
+	lpm_strtobin("2001:db8::/32", addr, &len, &pref);
+	ret = lpm_vrf_insert(vrf, 1, addr, len, pref, (void *)0x5);
+	assert(ret == 0);
+	lpm_strtobin("2001:db8::1", addr, &len, &pref);
+	val = lpm_vrf_lookup(vrf, 1, addr, len);
+	assert(val == (void *)0x5);
+	val = lpm_vrf_lookup(vrf, 3, addr, len);
+	assert(val == NULL);
+
+	/* Removal must not affect the other VRFs. */
+	lpm_strtobin("10.1.0.0/16", addr, &len, &pref);
+	ret = lpm_vrf_remove(vrf, 2, addr, len, pref);
+	assert(ret == 0);
+	ret = lpm_vrf_remove(vrf, 2, addr, len, pref);
+	assert(ret == -1);
+	lpm_strtobin("10.1.1.1", addr, &len, &pref);
+	val = lpm_vrf_lookup(vrf, 2, addr, len);
+	assert(val == (void *)0x2);
+
+	ret = lpm_vrf_remove(vrf, 3, addr, 4, 0);
+	assert(ret == 0);
+	val = lpm_vrf_lookup(vrf, 3, addr, len);
+	assert(val == NULL);
+
+	lpm_vrf_clear(vrf, vrf_dtor, &count);
+	assert(count == 3);
+	val = lpm_vrf_lookup(vrf, 1, addr, len);
+	assert(val == NULL);
+
+	ret = lpm_vrf_insert(vrf, 1, addr, len, 24, (void *)0x6);
+	assert(ret == 0);
+	lpm_vrf_destroy(vrf);
+}
+
+static void
+ivtab_test(void)
+{
+	static uint32_t addrs6[1024][4];
+	lpm_ivtab_t *ivtab;
+	lpm_t *lpm;
+	uint32_t addr[4];
+	uint8_t key6[6];
+	size_t len;
+	unsigned pref;
+	int ret;
+
+	/* Empty table. */
+	lpm = lpm_create();
+	assert(lpm != NULL);
+	ivtab = lpm_ivtab_build(lpm);
+	assert(ivtab != NULL);
+	lpm_strtobin("10.1.1.1", addr, &len, &pref);
+	assert(lpm_ivtab_lookup(ivtab, addr, len) == NULL);
+	lpm_ivtab_destroy(ivtab);
+
+	/*
+	 * Random nested IPv4 prefixes within 10.0.0.0/16, plus the edges
+	 * of the address space and a default.
+	 */
+	for (unsigned i = 0; i < 4096; i++) {
+		const uint32_t a = htonl(0x0a000000 | (random() & 0xffff));
+		void *val = (void *)(uintptr_t)(random() % 5);
+
+		ret = lpm_insert(lpm, &a, 4, 16 + random() % 17, val);
+		assert(ret == 0);
+	}
+	lpm_strtobin("255.255.255.255/32", addr, &len, &pref);
+	ret = lpm_insert(lpm, addr, len, pref, (void *)0x10);
+	assert(ret == 0);
+	lpm_strtobin("0.0.0.0/1", addr, &len, &pref);
+	ret = lpm_insert(lpm, addr, len, pref, (void *)0x11);
+	assert(ret == 0);
+	ret = lpm_insert(lpm, addr, len, 0, (void *)0x12);
+	assert(ret == 0);
+
+	/* IPv6 prefixes and the keys of an odd length. */
+	for (unsigned i = 0; i < 1024; i++) {
+		addr[0] = htonl(0x20010db8);
+		addr[1] = random() & htonl(0xffff0000);
+		addr[2] = random();
+		addr[3] = random();
+		ret = lpm_insert(lpm, addr, 16, 32 + random() % 97,
+		    (void *)(uintptr_t)(i + 1));
+		assert(ret == 0);
+		memcpy(addrs6[i], addr, sizeof(addr));
+
+		memcpy(key6, addr, sizeof(key6));
+		ret = lpm_insert(lpm, key6, 6, 1 + random() % 48,
+		    (void *)(uintptr_t)(i + 1));
+		assert(ret == 0);
+	}
+
+	ivtab = lpm_ivtab_build(lpm);
+	assert(ivtab != NULL);
+
+	for (uint32_t i = 0; i <= 0x2ffff; i++) {
+		const uint32_t a = htonl(0x09ff0000 + i);
+		assert(lpm_ivtab_lookup(ivtab, &a, 4) == lpm_lookup(lpm, &a, 4));
+	}
+	lpm_strtobin("255.255.255.255", addr, &len, &pref);
+	assert(lpm_ivtab_lookup(ivtab, addr, len) == (void *)0x10);
+	lpm_strtobin("255.255.255.254", addr, &len, &pref);
+	assert(lpm_ivtab_lookup(ivtab, addr, len) == (void *)0x12);
+	lpm_strtobin("0.0.0.0", addr, &len, &pref);
+	assert(lpm_ivtab_lookup(ivtab, addr, len) == (void *)0x11);
+
+	for (unsigned i = 0; i < 65536; i++) {
+		/* Around the inserted prefixes and random ones. */
+		memcpy(addr, addrs6[i % 1024], sizeof(addr));
+		if (i & 1) {
+			addr[3] ^= htonl(1U << (random() % 32));
+		}
+		if (i & 2) {
+			addr[2] = random();
+			addr[3] = random();
+		}
+		assert(lpm_ivtab_lookup(ivtab, addr, 16) ==
+		    lpm_lookup(lpm, addr, 16));
+
+		memcpy(key6, addr, sizeof(key6));
+		assert(lpm_ivtab_lookup(ivtab, key6, 6) ==
+		    lpm_lookup(lpm, key6, 6));
+	}
+	lpm_ivtab_destroy(ivtab);
+	lpm_destroy(lpm);
+}
+
+static void
+compact_test(void)
+{
+	lpm_t *lpm, *orig;
+	uint32_t addr[4];
+	size_t len;
+	unsigned pref;
+	int ret;
+
+	lpm = lpm_create();
+	assert(lpm != NULL);
+	orig = lpm_create();
+	assert(orig != NULL);
+
+	/* Churn: insert and remove random prefixes. */
+	for (unsigned i = 0; i < 8192; i++) {
+		const uint32_t a = htonl(0x0a000000 | (random() & 0xffff));
+		const unsigned plen = 16 + random() % 17;
+		void *val = (void *)(uintptr_t)(i + 1);
+
+		ret = lpm_insert(lpm, &a, 4, plen, val);
+		assert(ret == 0);
+		ret = lpm_insert(orig, &a, 4, plen, val);
+		assert(ret == 0);
+		if (i & 1) {
+			lpm_remove(lpm, &a, 4, plen);
+			lpm_remove(orig, &a, 4, plen);
+		}
+	}
+	lpm_strtobin("2001:db8::/32", addr, &len, &pref);
+	ret = lpm_insert(lpm, addr, len, pref, (void *)0x1);
+	assert(ret == 0);
+	ret = lpm_insert(orig, addr, len, pref, (void *)0x1);
+	assert(ret == 0);
+
+	/*
+	 * Compact twice with the updates in between, mixing the entries
+	 * in the slabs and the regular ones.
+	 */
+	for (unsigned round = 0; round < 2; round++) {
+		ret = lpm_compact(lpm);
+		assert(ret == 0);
+
+		for (uint32_t i = 0; i <= 0xffff; i++) {
+			const uint32_t a = htonl(0x0a000000 | i);
+			assert(lpm_lookup(lpm, &a, 4) == lpm_lookup(orig, &a, 4));
+		}
+		assert(lpm_lookup(lpm, addr, 16) == (void *)0x1);
+
+		for (unsigned i = 0; i < 1024; i++) {
+			const uint32_t a = htonl(0x0a000000 | (random() & 0xffff));
+			const unsigned plen = 16 + random() % 17;
+
+			lpm_remove(lpm, &a, 4, plen);
+			lpm_remove(orig, &a, 4, plen);
+			ret = lpm_insert(lpm, &a, 4, 32, (void *)0x2);
+			assert(ret == 0);
+			ret = lpm_insert(orig, &a, 4, 32, (void *)0x2);
+			assert(ret == 0);
+		}
+	}
+	ret = lpm_remove(lpm, addr, len, pref);
+	assert(ret == 0);
+	ret = lpm_compact(lpm);
+	assert(ret == 0);
+	assert(lpm_lookup(lpm, addr, 16) == NULL);
+
+	lpm_clear(lpm, NULL, NULL);
+	lpm_destroy(lpm);
+	lpm_destroy(orig);
+}
+
+static void
+bulk_test(void)
+{
+	static uint32_t addrs[32768][4];
+	static lpm_prefix_t pfx[32768];
+	const unsigned n = __arraycount(pfx);
+	lpm_t *lpm, *orig;
+	int ret;
+
+	lpm = lpm_create();
+	assert(lpm != NULL);
+	orig = lpm_create();
+	assert(orig != NULL);
+
+	/* Some prefixes before the bulk insertion. */
+	for (unsigned i = 0; i < 256; i++) {
+		const uint32_t a = htonl(0x0a000000 | (i << 8));
+
+		ret = lpm_insert(lpm, &a, 4, 24, (void *)0x1);
+		assert(ret == 0);
+		ret = lpm_insert(orig, &a, 4, 24, (void *)0x1);
+		assert(ret == 0);
+	}
+
+	/* IPv4 and IPv6 prefixes, including the duplicates. */
+	for (unsigned i = 0; i < n; i++) {
+		const bool ipv6 = (i % 4) == 0;
+
+		addrs[i][0] = htonl(0x0a000000 | (random() & 0xffff00));
+		addrs[i][1] = random();
+		addrs[i][2] = random();
+		addrs[i][3] = random();
+		if (i % 8 == 1) {
+			memcpy(addrs[i], addrs[i - 1], sizeof(addrs[i]));
+		}
+		pfx[i].addr = addrs[i];
+		pfx[i].len = ipv6 ? 16 : 4;
+		pfx[i].preflen = ipv6 ? 16 + random() % 113 : 8 + random() % 25;
+		pfx[i].val = (void *)(uintptr_t)(i + 2);
+	}
+	pfx[n / 2].preflen = 0;
+
+	ret = lpm_insert_bulk(lpm, pfx, n, 4);
+	assert(ret == 0);
+	for (unsigned i = 0; i < n; i++) {
+		ret = lpm_insert(orig, pfx[i].addr, pfx[i].len,
+		    pfx[i].preflen, pfx[i].val);
+		assert(ret == 0);
+	}
+	assert(count_prefixes(lpm) == count_prefixes(orig));
+
+	for (unsigned i = 0; i < n; i++) {
+		const lpm_prefix_t *p = &pfx[i];
+
+		assert(lpm_lookup_prefix(lpm, p->addr, p->len, p->preflen) ==
+		    lpm_lookup_prefix(orig, p->addr, p->len, p->preflen));
+		assert(lpm_lookup(lpm, p->addr, p->len) ==
+		    lpm_lookup(orig, p->addr, p->len));
+	}
+
+	/* Remove everything: the counters must be consistent. */
+	for (unsigned i = 0; i < n; i++) {
+		lpm_remove(lpm, pfx[i].addr, pfx[i].len, pfx[i].preflen);
+	}
+	for (unsigned i = 0; i < 256; i++) {
+		const uint32_t a = htonl(0x0a000000 | (i << 8));
+		lpm_remove(lpm, &a, 4, 24);
+	}
+	assert(count_prefixes(lpm) == 0);
+	assert(lpm_lookup(lpm, addrs[0], 16) == NULL);
+
+	lpm_destroy(lpm);
+	lpm_destroy(orig);
+}
+
+static void
+rehash_test(void)
+{
+	static uint32_t addrs[20000];
+	const unsigned n = __arraycount(addrs);
+	unsigned nitems = 0;
+	lpm_t *lpm;
+	int ret;
+
+	lpm = lpm_create();
+	assert(lpm != NULL);
+
+	/*
+	 * Many resizes of the same prefix length, with the lookups and
+	 * removals while the buckets are still being migrated.
+	 */
+	for (unsigned i = 0; i < n; i++) {
+		addrs[i] = htonl(i << 8);
+		ret = lpm_insert(lpm, &addrs[i], 4, 24, (void *)(uintptr_t)(i + 1));
+		assert(ret == 0);
+		nitems++;
+
+		for (unsigned j = 0; j < 4; j++) {
+			const unsigned k = random() % (i + 1);
+			void *val = lpm_lookup_prefix(lpm, &addrs[k], 4, 24);
+
+			assert(val == ((k % 3 == 2 && k < i) ? NULL :
+			    (void *)(uintptr_t)(k + 1)));
+		}
+		if (i % 3 == 2) {
+			ret = lpm_remove(lpm, &addrs[i], 4, 24);
+			assert(ret == 0);
+			ret = lpm_remove(lpm, &addrs[i], 4, 24);
+			assert(ret == -1);
+			nitems--;
+		}
+		if (i % 5000 == 0) {
+			assert(count_prefixes(lpm) == nitems);
+		}
+	}
+	for (unsigned i = 0; i < n; i++) {
+		void *val = lpm_lookup(lpm, &addrs[i], 4);
+		assert(val == ((i % 3 == 2) ? NULL : (void *)(uintptr_t)(i + 1)));
+	}
+	assert(count_prefixes(lpm) == nitems);
+	lpm_destroy(lpm);
+}
+
+static void
+tunables_test(void)
+{
+	unsigned sizes[25] = { 0 };
+	lpm_conf_t conf = {
+		.max_load = 50, .growth = 3,
+		.sizes = sizes, .nsizes = __arraycount(sizes),
+	};
+	lpm_t *lpm, *orig;
+	uint32_t addr[4];
+	int ret;
+
+	sizes[24] = 10000;
+	lpm = lpm_create_ex(&conf);
+	assert(lpm != NULL);
+	orig = lpm_create();
+	assert(orig != NULL);
+
+	ret = lpm_reserve(lpm, 16, 48, 5000);
+	assert(ret == 0);
+	ret = lpm_reserve(lpm, 4, 0, 5000);
+	assert(ret == 0);
+
+	for (unsigned i = 0; i < 20000; i++) {
+		const unsigned pref = (i & 1) ? 24 : 8 + random() % 25;
+
+		addr[0] = random();
+		ret = lpm_insert(lpm, addr, 4, pref, (void *)(uintptr_t)(i + 1));
+		assert(ret == 0);
+		ret = lpm_insert(orig, addr, 4, pref, (void *)(uintptr_t)(i + 1));
+		assert(ret == 0);
+
+		addr[0] = htonl(0x20010db8);
+		addr[1] = random();
+		ret = lpm_insert(lpm, addr, 16, 48, (void *)(uintptr_t)(i + 1));
+		assert(ret == 0);
+		ret = lpm_insert(orig, addr, 16, 48, (void *)(uintptr_t)(i + 1));
+		assert(ret == 0);
+
+		if (i == 10000) {
+			/* Reserve while the growth may be in progress. */
+			ret = lpm_reserve(lpm, 4, 24, 40000);
+			assert(ret == 0);
+		}
+	}
+	assert(count_prefixes(lpm) == count_prefixes(orig));
+
+	for (unsigned i = 0; i < 100000; i++) {
+		addr[0] = random();
+		assert(lpm_lookup(lpm, addr, 4) == lpm_lookup(orig, addr, 4));
+		addr[0] = htonl(0x20010db8);
+		addr[1] = random();
+		assert(lpm_lookup(lpm, addr, 16) == lpm_lookup(orig, addr, 16));
+	}
+	lpm_destroy(lpm);
+	lpm_destroy(orig);
+}
+
+static void
+sampling_test(void)
+{
+	lpm_hist_t hist;
+	lpm_t *lpm, *orig;
+	uint32_t addr;
+	uint64_t sum;
+	int ret;
+
+	lpm = lpm_create();
+	assert(lpm != NULL);
+	orig = lpm_create();
+	assert(orig != NULL);
+	memset(&hist, 0, sizeof(hist));
+
+	addr = htonl(0x0a000000);
+	ret = lpm_insert(lpm, &addr, 4, 8, (void *)1);
+	assert(ret == 0);
+	addr = htonl(0x0a010000);
+	ret = lpm_insert(lpm, &addr, 4, 16, (void *)2);
+	assert(ret == 0);
+	addr = 0;
+	ret = lpm_insert(lpm, &addr, 4, 0, (void *)3);
+	assert(ret == 0);
+
+	/* No histogram registered: nothing is recorded. */
+	lpm_set_sampling(lpm, 1);
+	addr = htonl(0x0a010203);
+	assert(lpm_lookup(lpm, &addr, 4) == (void *)2);
+
+	/* Sample every lookup. */
+	lpm_hist_register(&hist);
+	addr = htonl(0x0a010203);
+	assert(lpm_lookup(lpm, &addr, 4) == (void *)2);
+	addr = htonl(0x0a020000);
+	assert(lpm_lookup(lpm, &addr, 4) == (void *)1);
+	addr = htonl(0x0b000000);
+	assert(lpm_lookup(lpm, &addr, 4) == (void *)3);
+	assert(hist.nsamples == 3);
+	assert(hist.probes[1] == 1 && hist.probes[2] == 2);
+	assert(hist.chain[1] >= 1);
+
+	sum = 0;
+	for (unsigned i = 0; i < LPM_HIST_BUCKETS; i++) {
+		sum += hist.chain[i];
+	}
+	assert(sum == 3);
+
+	/* Sample every 4th lookup. */
+	lpm_set_sampling(lpm, 4);
+	for (unsigned i = 0; i < 100; i++) {
+		addr = random();
+		lpm_lookup(lpm, &addr, 4);
+	}
+	assert(hist.nsamples == 3 + 25);
+
+	/* Disabled or unregistered. */
+	lpm_set_sampling(lpm, 0);
+	lpm_lookup(lpm, &addr, 4);
+	lpm_set_sampling(lpm, 1);
+	lpm_hist_register(NULL);
+	lpm_lookup(lpm, &addr, 4);
+	assert(hist.nsamples == 28);
+	lpm_destroy(lpm);
+
+	/* The sampled lookups (also while resizing) give the same results. */
+	lpm = lpm_create();
+	assert(lpm != NULL);
+	lpm_set_sampling(lpm, 3);
+	lpm_hist_register(&hist);
+	for (unsigned i = 0; i < 5000; i++) {
+		const unsigned pref = 8 + random() % 25;
+
+		addr = random();
+		ret = lpm_insert(lpm, &addr, 4, pref, (void *)(uintptr_t)(i + 1));
+		assert(ret == 0);
+		ret = lpm_insert(orig, &addr, 4, pref, (void *)(uintptr_t)(i + 1));
+		assert(ret == 0);
+
+		addr = random();
+		assert(lpm_lookup(lpm, &addr, 4) == lpm_lookup(orig, &addr, 4));
+	}
+	lpm_hist_register(NULL);
+	lpm_destroy(lpm);
+	lpm_destroy(orig);
+}
+
+static void
+bloom_test(void)
+{
+	const lpm_conf_t conf = { .flags = LPM_F_BLOOM };
+	lpm_t *lpm, *orig;
+	lpm_hist_t hist;
+	uint32_t addr[4];
+	int ret;
+
+	lpm = lpm_create_ex(&conf);
+	assert(lpm != NULL);
+	orig = lpm_create();
+	assert(orig != NULL);
+
+	/* IPv6 prefixes of many lengths. */
+	for (unsigned i = 0; i < 20000; i++) {
+		const unsigned pref = 16 + i % 49;
+
+		addr[0] = htonl(0x20010000 | (random() & 0xffff));
+		addr[1] = random();
+		addr[2] = addr[3] = 0;
+		ret = lpm_insert(lpm, addr, 16, pref, (void *)(uintptr_t)(i + 1));
+		assert(ret == 0);
+		ret = lpm_insert(orig, addr, 16, pref, (void *)(uintptr_t)(i + 1));
+		assert(ret == 0);
+	}
+
+	/* The misses mostly skip the hash maps. */
+	memset(&hist, 0, sizeof(hist));
+	lpm_set_sampling(lpm, 1);
+	lpm_hist_register(&hist);
+	for (unsigned i = 0; i < 1000; i++) {
+		addr[0] = htonl(0x30000000 | (random() & 0xffff));
+		addr[1] = random();
+		assert(lpm_lookup(lpm, addr, 16) == NULL);
+	}
+	lpm_hist_register(NULL);
+	lpm_set_sampling(lpm, 0);
+	assert(hist.probes[0] + hist.probes[1] + hist.probes[2] +
+	    hist.probes[3] > 900);
+
+	/* Remove most of the prefixes: the filters are rebuilt. */
+	for (unsigned i = 0; i < 30000; i++) {
+		const unsigned pref = 16 + random() % 49;
+
+		addr[0] = htonl(0x20010000 | (random() & 0xffff));
+		addr[1] = random();
+		ret = lpm_remove(lpm, addr, 16, pref);
+		assert(ret == lpm_remove(orig, addr, 16, pref));
+		if ((i & 3) == 0) {
+			ret = lpm_insert(lpm, addr, 16, pref, (void *)1);
+			assert(ret == 0);
+			ret = lpm_insert(orig, addr, 16, pref, (void *)1);
+			assert(ret == 0);
+		}
+	}
+	for (unsigned i = 0; i < 100000; i++) {
+		addr[0] = htonl(0x20010000 | (random() & 0xffff));
+		addr[1] = random();
+		addr[2] = random();
+		assert(lpm_lookup(lpm, addr, 16) == lpm_lookup(orig, addr, 16));
+	}
+	ret = lpm_compact(lpm);
+	assert(ret == 0);
+	assert(count_prefixes(lpm) == count_prefixes(orig));
+
+	lpm_clear(lpm, NULL, NULL);
+	addr[0] = htonl(0x20010db8);
+	assert(lpm_lookup(lpm, addr, 16) == NULL);
+	ret = lpm_insert(lpm, addr, 16, 32, (void *)2);
+	assert(ret == 0);
+	assert(lpm_lookup(lpm, addr, 16) == (void *)2);
+
+	lpm_destroy(lpm);
+	lpm_destroy(orig);
+}
+
+static void
+flow_test(void)
+{
+	uint32_t src, dst, addr;
+	uint64_t hits, misses;
+	lpm_flow_t *flow;
+	void *vals[2];
+	lpm_t *lpm;
+	int ret;
+
+	lpm = lpm_create();
+	assert(lpm != NULL);
+	flow = lpm_flow_create(lpm, 64);
+	assert(flow != NULL);
+
+	for (unsigned i = 0; i < 1000; i++) {
+		addr = random();
+		ret = lpm_insert(lpm, &addr, 4, 8 + random() % 17,
+		    (void *)(uintptr_t)(i + 1));
+		assert(ret == 0);
+	}
+
+	/* Few flows: the results are served from the table. */
+	for (unsigned i = 0; i < 1000; i++) {
+		src = htonl(0x0a000000 | (i % 32));
+		dst = htonl(0xc0a80000 | (i % 32));
+		lpm_flow_lookup(flow, &src, &dst, 4, vals);
+		assert(vals[0] == lpm_lookup(lpm, &src, 4));
+		assert(vals[1] == lpm_lookup(lpm, &dst, 4));
+	}
+	lpm_flow_stats(flow, &hits, &misses);
+	assert(hits == 1000 - 32 && misses == 32);
+
+	/* An update is reflected by the existing flows. */
+	src = htonl(0x0a000001);
+	dst = htonl(0xc0a80001);
+	ret = lpm_insert(lpm, &src, 4, 32, (void *)0x1234);
+	assert(ret == 0);
+	lpm_flow_lookup(flow, &src, &dst, 4, vals);
+	assert(vals[0] == (void *)0x1234);
+	assert(vals[1] == lpm_lookup(lpm, &dst, 4));
+	ret = lpm_remove(lpm, &src, 4, 32);
+	assert(ret == 0);
+	lpm_flow_lookup(flow, &src, &dst, 4, vals);
+	assert(vals[0] == lpm_lookup(lpm, &src, 4));
+
+	/* Many flows: the eviction keeps the table bounded. */
+	for (unsigned i = 0; i < 100000; i++) {
+		uint32_t src6[4], dst6[4];
+
+		src = random() % 1000;
+		dst = random();
+		lpm_flow_lookup(flow, &src, &dst, 4, vals);
+		assert(vals[0] == lpm_lookup(lpm, &src, 4));
+		assert(vals[1] == lpm_lookup(lpm, &dst, 4));
+
+		/* Hot flow. */
+		src = htonl(0x0a000005);
+		dst = htonl(0xc0a80005);
+		lpm_flow_lookup(flow, &src, &dst, 4, vals);
+		assert(vals[0] == lpm_lookup(lpm, &src, 4));
+
+		memset(src6, 0, sizeof(src6));
+		memset(dst6, 0, sizeof(dst6));
+		src6[3] = random() % 100;
+		lpm_flow_lookup(flow, src6, dst6, 16, vals);
+		assert(vals[0] == NULL && vals[1] == NULL);
+	}
+	lpm_flow_stats(flow, &hits, &misses);
+	assert(hits + misses == 1000 + 2 + 300000);
+
+	lpm_flow_destroy(flow);
+	lpm_destroy(lpm);
+}
+
+static void
+lookup2_test(void)
+{
+	static const unsigned counts[] = { 0, 1, 3, 4, 5, 8, 100 };
+	const void *src[100], *dst[100];
+	void *svals[100], *dvals[100], *poison;
+	uint32_t addrs[200][4], addr[4];
+	lpm_t *lpm;
+	int ret;
+
+	lpm = lpm_create();
+	assert(lpm != NULL);
+	for (unsigned i = 0; i < 2000; i++) {
+		for (unsigned j = 0; j < 4; j++) {
+			addr[j] = random();
+		}
+		ret = lpm_insert(lpm, addr, (i & 1) ? 16 : 4,
+		    1 + random() % 24, (void *)(uintptr_t)(i + 1));
+		assert(ret == 0);
+	}
+	ret = lpm_insert(lpm, addr, 4, 0, (void *)0x1234);
+	assert(ret == 0);
+
+	for (unsigned len = 4; len <= 16; len += 12) {
+		for (unsigned i = 0; i < 200; i++) {
+			/* Pairs which are often in the same prefixes. */
+			for (unsigned j = 0; j < 4; j++) {
+				addrs[i][j] = (i & 1) ? addrs[i - 1][j] :
+				    (uint32_t)random();
+			}
+			addrs[i][(i & 1) ? 0 : 1] ^= random() % 1024;
+		}
+		for (unsigned i = 0; i < 100; i++) {
+			void *sval, *dval;
+
+			src[i] = addrs[2 * i];
+			dst[i] = addrs[2 * i + 1];
+			lpm_lookup2(lpm, src[i], dst[i], len, &sval, &dval);
+			assert(sval == lpm_lookup(lpm, src[i], len));
+			assert(dval == lpm_lookup(lpm, dst[i], len));
+		}
+		for (unsigned c = 0; c < __arraycount(counts); c++) {
+			const unsigned n = counts[c];
+
+			memset(svals, 0xa5, sizeof(svals));
+			memset(&poison, 0xa5, sizeof(poison));
+			lpm_lookup2_batch(lpm, src, dst, len, svals, dvals, n);
+			for (unsigned i = 0; i < n; i++) {
+				assert(svals[i] == lpm_lookup(lpm, src[i], len));
+				assert(dvals[i] == lpm_lookup(lpm, dst[i], len));
+			}
+			/* Nothing past the n-th value is stored. */
+			assert(n == 100 || svals[n] == poison);
+		}
+	}
+	lpm_destroy(lpm);
+}
+
+static void
+ctab_test(void)
+{
+	static uint32_t addrs6[1024][4];
+	static void *vals[4096];
+	lpm_ctab_t *ctab;
+	lpm_t *lpm;
+	uint32_t addr[4];
+	uint8_t key6[6];
+	size_t len;
+	unsigned pref;
+	int ret;
+
+	/* Empty table. */
+	lpm = lpm_create();
+	assert(lpm != NULL);
+	ctab = lpm_ctab_build(lpm);
+	assert(ctab != NULL);
+	lpm_strtobin("10.1.1.1", addr, &len, &pref);
+	assert(lpm_ctab_lookup(ctab, addr, len) == NULL);
+	lpm_ctab_destroy(ctab);
+
+	/*
+	 * Nested IPv4 prefixes with a few distinct values (including NULL,
+	 * which hides the shorter prefixes), a default, the IPv6 prefixes
+	 * and the keys of an odd length.
+	 */
+	for (unsigned i = 0; i < 4096; i++) {
+		const uint32_t a = htonl(0x0a000000 | (random() & 0xffff));
+		void *val = (void *)(uintptr_t)(random() % 5);
+
+		ret = lpm_insert(lpm, &a, 4, 8 + random() % 25, val);
+		assert(ret == 0);
+	}
+	lpm_strtobin("0.0.0.0/0", addr, &len, &pref);
+	ret = lpm_insert(lpm, addr, len, pref, (void *)0x12);
+	assert(ret == 0);
+	for (unsigned i = 0; i < 1024; i++) {
+		addr[0] = htonl(0x20010db8);
+		addr[1] = random() & htonl(0xffff0000);
+		addr[2] = random();
+		addr[3] = random();
+		ret = lpm_insert(lpm, addr, 16, 32 + random() % 97,
+		    (void *)(uintptr_t)(i + 1));
+		assert(ret == 0);
+		memcpy(addrs6[i], addr, sizeof(addr));
+
+		memcpy(key6, addr, sizeof(key6));
+		ret = lpm_insert(lpm, key6, 6, 1 + random() % 48,
+		    (void *)(uintptr_t)(i + 1));
+		assert(ret == 0);
+	}
+
+	ctab = lpm_ctab_build(lpm);
+	assert(ctab != NULL);
+
+	for (uint32_t i = 0; i <= 0x2ffff; i++) {
+		const uint32_t a = htonl(0x09ff0000 + i);
+		assert(lpm_ctab_lookup(ctab, &a, 4) == lpm_lookup(lpm, &a, 4));
+	}
+	for (unsigned i = 0; i < 4096; i++) {
+		memcpy(addr, addrs6[i % 1024], sizeof(addr));
+		if (i & 1) {
+			addr[3] ^= htonl(1U << (random() % 32));
+		}
+		if (i & 2) {
+			addr[2] = random();
+			addr[3] = random();
+		}
+		vals[i] = lpm_lookup(lpm, addr, 16);
+		assert(lpm_ctab_lookup(ctab, addr, 16) == vals[i]);
+		memcpy(addrs6[i % 1024], addr, sizeof(addr));
+
+		memcpy(key6, addr, sizeof(key6));
+		assert(lpm_ctab_lookup(ctab, key6, 6) ==
+		    lpm_lookup(lpm, key6, 6));
+	}
+	assert(lpm_ctab_lookup(ctab, key6, 5) == NULL);
+
+	/* The table is independent of the LPM object. */
+	lpm_destroy(lpm);
+	for (unsigned i = 4096 - 1024; i < 4096; i++) {
+		assert(lpm_ctab_lookup(ctab, addrs6[i % 1024], 16) == vals[i]);
+	}
+	lpm_ctab_destroy(ctab);
+}
+
+#define	SNAP_NPREFIXES	10000
+#define	SNAP_NADDRS	4096
+
+typedef struct {
+	lpm_t *		snap;
+	uint32_t	addrs[SNAP_NADDRS];
+	void *		vals[SNAP_NADDRS];
+} snapshot_ctx_t;
+
+static void
+snapshot_check(const snapshot_ctx_t *ctx)
+{
+	for (unsigned i = 0; i < SNAP_NADDRS; i++) {
+		assert(lpm_lookup(ctx->snap, &ctx->addrs[i], 4) == ctx->vals[i]);
+	}
+}
+
+static void *
+snapshot_reader(void *arg)
+{
+	for (unsigned n = 0; n < 20; n++) {
+		snapshot_check(arg);
+	}
+	return NULL;
+}
+
+typedef struct {
+	lpm_t *		old;
+	lpm_t *		new;
+	diff_count_t	dc;
+} snapshot_diff_t;
+
+static void *
+snapshot_differ(void *arg)
+{
+	snapshot_diff_t *sd = arg;
+
+	for (unsigned n = 0; n < 20; n++) {
+		int ret = lpm_diff(sd->old, sd->new, diff_count, &sd->dc);
+		assert(ret == 0);
+	}
+	return NULL;
+}
+
+static void
+snapshot_test(void)
+{
+	static snapshot_ctx_t ctx1, ctx2;
+	static uint32_t pfx[SNAP_NPREFIXES];
+	const uint32_t magic = htonl(0xc6336400); // 198.51.100.0/24
+	static unsigned preflens[SNAP_NPREFIXES];
+	static snapshot_diff_t snaps[2];
+	pthread_t reader, differs[2];
+	size_t memused;
+	lpm_t *lpm;
+	int ret;
+
+	lpm = lpm_create();
+	assert(lpm != NULL);
+	for (unsigned i = 0; i < SNAP_NPREFIXES; i++) {
+		pfx[i] = random();
+		preflens[i] = 8 + random() % 25;
+		ret = lpm_insert(lpm, &pfx[i], 4, preflens[i],
+		    (void *)(uintptr_t)(i + 1));
+		assert(ret == 0);
+	}
+	ret = lpm_insert(lpm, &pfx[0], 4, 0, (void *)0x1234);
+	assert(ret == 0);
+	ret = lpm_insert(lpm, &magic, 4, 24, (void *)0x1);
+	assert(ret == 0);
+
+	for (unsigned i = 0; i < SNAP_NADDRS; i++) {
+		ctx1.addrs[i] = (i & 1) ? (uint32_t)random() :
+		    pfx[random() % SNAP_NPREFIXES] ^ htonl(random() & 0xff);
+		ctx1.vals[i] = lpm_lookup(lpm, &ctx1.addrs[i], 4);
+	}
+	ctx1.snap = lpm_snapshot(lpm);
+	assert(ctx1.snap != NULL);
+	snapshot_check(&ctx1);
+
+	/*
+	 * Update the table while the snapshot is read: remove, replace and
+	 * add the prefixes, compact and change the default.
+	 */
+	ret = pthread_create(&reader, NULL, snapshot_reader, &ctx1);
+	assert(ret == 0);
+	for (unsigned i = 0; i < SNAP_NPREFIXES; i++) {
+		uint32_t addr;
+
+		switch (i % 3) {
+		case 0:
+			/* May be a duplicate, removed already. */
+			(void)lpm_remove(lpm, &pfx[i], 4, preflens[i]);
+			break;
+		case 1:
+			ret = lpm_insert(lpm, &pfx[i], 4, preflens[i],
+			    (void *)(uintptr_t)(i + 0x10000));
+			assert(ret == 0);
+			break;
+		case 2:
+			addr = random();
+			ret = lpm_insert(lpm, &addr, 4, 8 + random() % 25,
+			    (void *)(uintptr_t)(i + 0x20000));
+			assert(ret == 0);
+			break;
+		}
+	}
+	ret = lpm_remove(lpm, &magic, 4, 24);
+	assert(ret == 0);
+	ret = lpm_compact(lpm);
+	assert(ret == 0);
+	ret = lpm_insert(lpm, &pfx[0], 4, 0, (void *)0x5678);
+	assert(ret == 0);
+	pthread_join(reader, NULL);
+	snapshot_check(&ctx1);
+
+	/* The table has changed. */
+	assert(lpm_lookup_prefix(lpm, &pfx[0], 4, 0) == (void *)0x5678);
+	assert(lpm_lookup_prefix(ctx1.snap, &pfx[0], 4, 0) == (void *)0x1234);
+	assert(lpm_lookup_prefix(lpm, &magic, 4, 24) == NULL);
+	assert(lpm_lookup_prefix(ctx1.snap, &magic, 4, 24) == (void *)0x1);
+
+	/* Two snapshots, the first one released. */
+	memcpy(ctx2.addrs, ctx1.addrs, sizeof(ctx2.addrs));
+	for (unsigned i = 0; i < SNAP_NADDRS; i++) {
+		ctx2.vals[i] = lpm_lookup(lpm, &ctx2.addrs[i], 4);
+	}
+	ctx2.snap = lpm_snapshot(lpm);
+	assert(ctx2.snap != NULL);
+	lpm_snapshot_release(ctx1.snap);
+	for (unsigned i = 0; i < SNAP_NPREFIXES; i += 2) {
+		lpm_remove(lpm, &pfx[i], 4, preflens[i]);
+	}
+	snapshot_check(&ctx2);
+
+	/*
+	 * Diff the same snapshots from two threads: the snapshots must
+	 * not be modified, including their accounting.
+	 */
+	snaps[0].old = snaps[1].old = ctx2.snap;
+	snaps[0].new = snaps[1].new = lpm_snapshot(lpm);
+	assert(snaps[0].new != NULL);
+	memused = lpm_memory_usage(ctx2.snap, NULL, 0);
+	for (unsigned t = 0; t < 2; t++) {
+		ret = pthread_create(&differs[t], NULL,
+		    snapshot_differ, &snaps[t]);
+		assert(ret == 0);
+	}
+	for (unsigned t = 0; t < 2; t++) {
+		pthread_join(differs[t], NULL);
+	}
+	assert(memcmp(&snaps[0].dc, &snaps[1].dc, sizeof(diff_count_t)) == 0);
+	assert(snaps[0].dc.nops[LPM_DIFF_REMOVE] != 0);
+	assert(lpm_memory_usage(ctx2.snap, NULL, 0) == memused);
+	lpm_snapshot_release(snaps[0].new);
+
+	/* The snapshot outlives the table. */
+	lpm_clear(lpm, NULL, NULL);
+	lpm_destroy(lpm);
+	snapshot_check(&ctx2);
+	lpm_snapshot_release(ctx2.snap);
+}
+
+#define	QUEUE_NTHREADS	4
+#define	QUEUE_NPREFIXES	5000
+
+typedef struct {
+	lpm_queue_t *	queue;
+	unsigned	id;
+	uint64_t	seq;
+} queue_producer_t;
+
+typedef struct {
+	lpm_t *		snap;
+	uint64_t	seq;
+	unsigned	npublished;
+} queue_publish_t;
+
+static void
+queue_publish(void *arg, lpm_t *lpm, uint64_t seq)
+{
+	queue_publish_t *pub = arg;
+
+	assert(seq > pub->seq);
+	if (pub->snap) {
+		lpm_snapshot_release(pub->snap);
+	}
+	pub->snap = lpm_snapshot(lpm);
+	assert(pub->snap != NULL);
+	pub->seq = seq;
+	pub->npublished++;
+}
+
+static uint32_t
+queue_prefix(unsigned id, unsigned i)
+{
+	return htonl(0x0a000000 | (id << 22) | (i << 8));
+}
+
+static void *
+queue_producer(void *arg)
+{
+	queue_producer_t *p = arg;
+
+	/*
+	 * Each prefix: insert; replace the value; remove every third one
+	 * and re-insert every sixth one.
+	 */
+	for (unsigned i = 0; i < QUEUE_NPREFIXES; i++) {
+		const uint32_t a = queue_prefix(p->id, i);
+		uint64_t seq;
+
+		seq = lpm_queue_insert(p->queue, &a, 4, 24, (void *)0x1);
+		assert(seq > p->seq);
+		p->seq = lpm_queue_insert(p->queue, &a, 4, 24,
+		    (void *)(uintptr_t)(i + 2));
+		if (i % 3 == 0) {
+			p->seq = lpm_queue_remove(p->queue, &a, 4, 24);
+		}
+		if (i % 6 == 0) {
+			p->seq = lpm_queue_insert(p->queue, &a, 4, 24,
+			    (void *)0x2);
+		}
+	}
+	return NULL;
+}
+
+static void
+queue_test(void)
+{
+	queue_producer_t producers[QUEUE_NTHREADS];
+	pthread_t threads[QUEUE_NTHREADS];
+	queue_publish_t pub = { NULL, 0, 0 };
+	uint64_t applied, coalesced, failed, nops = 0;
+	lpm_queue_t *q;
+	lpm_t *lpm;
+	uint32_t a;
+	int ret;
+
+	lpm = lpm_create();
+	assert(lpm != NULL);
+	q = lpm_queue_create(lpm, queue_publish, &pub);
+	assert(q != NULL);
+
+	for (unsigned t = 0; t < QUEUE_NTHREADS; t++) {
+		producers[t].queue = q;
+		producers[t].id = t;
+		producers[t].seq = 0;
+		ret = pthread_create(&threads[t], NULL,
+		    queue_producer, &producers[t]);
+		assert(ret == 0);
+	}
+	for (unsigned t = 0; t < QUEUE_NTHREADS; t++) {
+		pthread_join(threads[t], NULL);
+		lpm_queue_wait(q, producers[t].seq);
+		assert(pub.seq >= producers[t].seq);
+	}
+
+	for (unsigned t = 0; t < QUEUE_NTHREADS; t++) {
+		for (unsigned i = 0; i < QUEUE_NPREFIXES; i++) {
+			void *val = (void *)(uintptr_t)(i + 2);
+
+			if (i % 6 == 0) {
+				val = (void *)0x2;
+			} else if (i % 3 == 0) {
+				val = NULL;
+			}
+			a = queue_prefix(t, i);
+			assert(lpm_lookup_prefix(lpm, &a, 4, 24) == val);
+			assert(lpm_lookup(pub.snap, &a, 4) == val);
+			nops += 2 + (i % 3 == 0) + (i % 6 == 0);
+		}
+	}
+
+	/* The removal of a missing prefix fails; the masked key. */
+	a = htonl(0xc0000201);
+	lpm_queue_wait(q, lpm_queue_remove(q, &a, 4, 32));
+	lpm_queue_wait(q, lpm_queue_insert(q, &a, 4, 24, (void *)0x3));
+	a = htonl(0xc0000200);
+	assert(lpm_lookup_prefix(lpm, &a, 4, 24) == (void *)0x3);
+	nops += 2;
+
+	lpm_queue_stats(q, &applied, &coalesced, &failed);
+	assert(applied + coalesced == nops);
+	assert(coalesced > 0 && failed == 1);
+	assert(pub.npublished > 0);
+
+	lpm_queue_destroy(q);
+	lpm_snapshot_release(pub.snap);
+	lpm_destroy(lpm);
+}
+
+static void
+seed_test(void)
+{
+	static const uint64_t seeds[] = { 0, 1, 0xdeadbeef };
+	lpm_t *tables[3];
+	diff_count_t dc = {{ 0 }};
+	int ret;
+
+	/* The same contents, but a different layout. */
+	for (unsigned s = 0; s < 3; s++) {
+		const lpm_conf_t conf = { .seed = seeds[s] };
+
+		srandom(1);
+		tables[s] = lpm_create_ex(&conf);
+		assert(tables[s] != NULL);
+		for (unsigned i = 0; i < 10000; i++) {
+			const uint32_t a = random();
+			uint32_t a6[4] = { a, a, a, a };
+
+			ret = lpm_insert(tables[s], &a, 4, 8 + i % 25,
+			    (void *)(uintptr_t)(i + 1));
+			assert(ret == 0);
+			ret = lpm_insert(tables[s], a6, 16, 32 + i % 97,
+			    (void *)(uintptr_t)(i + 1));
+			assert(ret == 0);
+		}
+	}
+	for (unsigned i = 0; i < 10000; i++) {
+		const uint32_t a = random();
+		uint32_t a6[4] = { a, ~a, a, ~a };
+		void *val = lpm_lookup(tables[0], &a, 4);
+
+		assert(lpm_lookup(tables[1], &a, 4) == val);
+		assert(lpm_lookup(tables[2], &a, 4) == val);
+		val = lpm_lookup(tables[0], a6, 16);
+		assert(lpm_lookup(tables[1], a6, 16) == val);
+		assert(lpm_lookup(tables[2], a6, 16) == val);
+	}
+	ret = lpm_diff(tables[0], tables[1], diff_count, &dc);
+	assert(ret == 0);
+	ret = lpm_diff(tables[2], tables[0], diff_count, &dc);
+	assert(ret == 0);
+	assert(!dc.nops[1] && !dc.nops[2] && !dc.nops[3]);
+
+	/* Apply the changes across the seeds. */
+	ret = lpm_insert(tables[1], &(uint32_t){ htonl(0x0a000000) }, 4, 8,
+	    (void *)0x1);
+	assert(ret == 0);
+	ret = lpm_apply_diff(tables[0], tables[1], NULL, NULL);
+	assert(ret == 0);
+	ret = lpm_diff(tables[0], tables[1], diff_count, &dc);
+	assert(ret == 0);
+	assert(!dc.nops[1] && !dc.nops[2] && !dc.nops[3]);
+
+	for (unsigned s = 0; s < 3; s++) {
+		lpm_destroy(tables[s]);
+	}
+}
+
+static void *
+mapped_lookup(lpm_t *lpm, const char *str)
+{
+	uint8_t addr[16];
+	void *val, *vals[2];
+	const void *addrs[1] = { addr };
+
+	assert(inet_pton(AF_INET6, str, addr) == 1);
+	val = lpm_lookup(lpm, addr, 16);
+
+	/* The batch forms agree with it. */
+	lpm_lookup2(lpm, addr, addr, 16, &vals[0], &vals[1]);
+	assert(vals[0] == val && vals[1] == val);
+	lpm_lookup2_batch(lpm, addrs, addrs, 16, &vals[0], &vals[1], 1);
+	assert(vals[0] == val && vals[1] == val);
+	return val;
+}
+
+static void
+mapped_test(void)
+{
+	static const uint8_t nat64[12] = { 0x00, 0x64, 0xff, 0x9b };
+	const lpm_conf_t conf = { .flags = LPM_F_MAPPED, .nat64 = nat64 };
+	uint8_t addr[16];
+	size_t len;
+	unsigned pref;
+	lpm_t *lpm;
+	int ret;
+
+	lpm = lpm_create_ex(&conf);
+	assert(lpm != NULL);
+
+	lpm_strtobin("10.0.0.0/8", addr, &len, &pref);
+	ret = lpm_insert(lpm, addr, len, pref, (void *)0x1);
+	assert(ret == 0);
+	lpm_strtobin("10.1.0.0/16", addr, &len, &pref);
+	ret = lpm_insert(lpm, addr, len, pref, (void *)0x2);
+	assert(ret == 0);
+	lpm_strtobin("::/0", addr, &len, &pref);
+	ret = lpm_insert(lpm, addr, len, pref, (void *)0x6);
+	assert(ret == 0);
+
+	/* The IPv4-mapped and NAT64 addresses use the IPv4 prefixes. */
+	assert(mapped_lookup(lpm, "::ffff:10.1.2.3") == (void *)0x2);
+	assert(mapped_lookup(lpm, "::ffff:10.2.2.3") == (void *)0x1);
+	assert(mapped_lookup(lpm, "64:ff9b::10.1.2.3") == (void *)0x2);
+	assert(mapped_lookup(lpm, "2001:db8::10.1.2.3") == (void *)0x6);
+
+	/* No IPv4 match: the IPv6 prefixes up to /96. */
+	assert(mapped_lookup(lpm, "::ffff:192.0.2.1") == (void *)0x6);
+
+	/* The IPv4 default route covers them. */
+	lpm_strtobin("0.0.0.0/0", addr, &len, &pref);
+	ret = lpm_insert(lpm, addr, len, pref, (void *)0x4);
+	assert(ret == 0);
+	assert(mapped_lookup(lpm, "::ffff:192.0.2.1") == (void *)0x4);
+
+	/* Unless there is a matching IPv6 prefix longer than /96. */
+	lpm_strtobin("::ffff:10.1.2.0/120", addr, &len, &pref);
+	ret = lpm_insert(lpm, addr, len, pref, (void *)0x7);
+	assert(ret == 0);
+	assert(mapped_lookup(lpm, "::ffff:10.1.2.3") == (void *)0x7);
+	assert(mapped_lookup(lpm, "::ffff:10.1.3.3") == (void *)0x2);
+
+	/* Not supported by the other lookup structures. */
+	assert(lpm_ivtab_build(lpm) == NULL);
+	assert(lpm_ctab_build(lpm) == NULL);
+
+	/* Without the flag, these are plain IPv6 addresses. */
+	lpm_destroy(lpm);
+	lpm = lpm_create();
+	assert(lpm != NULL);
+	lpm_strtobin("10.0.0.0/8", addr, &len, &pref);
+	ret = lpm_insert(lpm, addr, len, pref, (void *)0x1);
+	assert(ret == 0);
+	assert(mapped_lookup(lpm, "::ffff:10.1.2.3") == NULL);
+	lpm_destroy(lpm);
+}
+
+static const char *
+str_random(char *buf, size_t size)
+{
+	static const char chars[] = "0123456789abcdefABCDEF:.";
+	uint8_t addr[16];
+	size_t n;
+
+	/* A valid address, possibly mutated, or random characters. */
+	for (unsigned i = 0; i < 16; i++) {
+		addr[i] = random() % 4 ? 0 : random();
+	}
+	if (random() % 2) {
+		inet_ntop(AF_INET6, addr, buf, size);
+	} else {
+		inet_ntop(AF_INET, addr, buf, size);
+	}
+	n = strlen(buf);
+	switch (random() % 4) {
+	case 0:
+		break;
+	case 1:
+		buf[random() % n] = chars[random() % (sizeof(chars) - 1)];
+		break;
+	case 2:
+		memmove(&buf[1], &buf[0], n);
+		buf[0] = chars[random() % (sizeof(chars) - 1)];
+		break;
+	case 3:
+		n = random() % 20;
+		for (unsigned i = 0; i < n; i++) {
+			buf[i] = chars[random() % (sizeof(chars) - 1)];
+		}
+		buf[n] = '\0';
+		break;
+	}
+	return buf;
+}
+
+static void
+str_test(void)
+{
+	static const char *strs[] = {
+		"10.1.2.3", "10.2.3.4", "2001:db8::1", "::ffff:10.1.2.3",
+		"1::", "::", "010.1.2.3", "10.1.2", "10.1.2.3.", "256.1.2.3",
+		"2001:db8:::1", ":1::", "1:2:3:4:5:6:7:8:9", "12345::",
+		"1:2:3:4:5:6:7::8", "::1.2.3.4.5", "", "garbage",
+	};
+	static const char lines[] =
+	    "10.1.2.3\n2001:db8::1\r\n\nbad\n::ffff:10.1.2.3\n"
+	    "11.0.0.1\n10.1.2.3\n2001:db8::2\n2001:db8::3\n10.1.0.0";
+	void *vals[__arraycount(strs)];
+	char buf[64];
+	size_t consumed;
+	uint8_t addr[16];
+	size_t len;
+	unsigned pref, n;
+	lpm_t *lpm;
+	int ret;
+
+	lpm = lpm_create();
+	assert(lpm != NULL);
+	lpm_strtobin("10.1.0.0/16", addr, &len, &pref);
+	ret = lpm_insert(lpm, addr, len, pref, (void *)0x1);
+	assert(ret == 0);
+	lpm_strtobin("2001:db8::/32", addr, &len, &pref);
+	ret = lpm_insert(lpm, addr, len, pref, (void *)0x2);
+	assert(ret == 0);
+
+	/* Not NUL-terminated. */
+	assert(lpm_lookup_str(lpm, "10.1.2.3999", 8) == (void *)0x1);
+	assert(lpm_lookup_str(lpm, "2001:db8::1/64", 11) == (void *)0x2);
+	assert(lpm_lookup_str(lpm, "10.2.3.4", 8) == NULL);
+
+	/* The batch, resuming after the consumed lines. */
+	n = lpm_lookup_str_batch(lpm, lines, sizeof(lines) - 1, vals, 4,
+	    &consumed);
+	assert(n == 4 && consumed == 27);
+	assert(vals[0] == (void *)0x1 && vals[1] == (void *)0x2);
+	assert(vals[2] == NULL && vals[3] == NULL);
+	n = lpm_lookup_str_batch(lpm, &lines[consumed],
+	    sizeof(lines) - 1 - consumed, vals, __arraycount(vals), &consumed);
+	assert(n == 6 && consumed == sizeof(lines) - 1 - 27);
+	assert(vals[0] == NULL && vals[1] == NULL && vals[2] == (void *)0x1);
+	assert(vals[3] == (void *)0x2 && vals[4] == (void *)0x2);
+	assert(vals[5] == (void *)0x1);
+
+	/*
+	 * With the default routes, a NULL value means the string is not
+	 * a valid address: check against inet_pton(3).
+	 */
+	lpm_strtobin("0.0.0.0/0", addr, &len, &pref);
+	ret = lpm_insert(lpm, addr, len, pref, (void *)0x4);
+	assert(ret == 0);
+	lpm_strtobin("::/0", addr, &len, &pref);
+	ret = lpm_insert(lpm, addr, len, pref, (void *)0x6);
+	assert(ret == 0);
+	for (unsigned i = 0; i < __arraycount(strs) + 100000; i++) {
+		const char *str = i < __arraycount(strs) ? strs[i] :
+		    str_random(buf, sizeof(buf));
+		const bool v4 = inet_pton(AF_INET, str, addr) == 1;
+		const bool v6 = !v4 && inet_pton(AF_INET6, str, addr) == 1;
+		const size_t alen = v4 ? 4 : 16;
+
+		if (!v4 && !v6) {
+			assert(lpm_lookup_str(lpm, str, strlen(str)) == NULL);
+			continue;
+		}
+		ret = lpm_insert(lpm, addr, alen, alen * 8, (void *)0x8);
+		assert(ret == 0);
+		assert(lpm_lookup_str(lpm, str, strlen(str)) == (void *)0x8);
+		ret = lpm_remove(lpm, addr, alen, alen * 8);
+		assert(ret == 0);
+	}
+	lpm_destroy(lpm);
+}
+
+/*
+ * memory_check: the total is the sum of the breakdown by prefix length.
+ */
+static size_t
+memory_check(lpm_t *lpm)
+{
+	lpm_memuse_t usage[129 + 1];
+	size_t total, sum = 0;
+
+	total = lpm_memory_usage(lpm, usage, __arraycount(usage));
+	assert(usage[0].buckets == 0 && usage[0].entries == 0);
+	for (unsigned n = 1; n <= 128; n++) {
+		sum += usage[n].buckets + usage[n].entries + usage[n].filters;
+	}
+	assert(usage[129].buckets == 0 && usage[129].entries == 0);
+	assert(total == sum);
+	assert(lpm_memory_usage(lpm, NULL, 0) == total);
+	return total;
+}
+
+static void
+memory_test(void)
+{
+	static lpm_prefix_t pfx[16384];
+	static uint32_t addrs[16384];
+	const lpm_conf_t bconf = { .flags = LPM_F_BLOOM };
+	lpm_conf_t conf = { .memlimit = 64 * 1024 };
+	lpm_memuse_t usage[33];
+	size_t est, total;
+	unsigned n = 0;
+	lpm_t *lpm, *snap;
+	uint32_t a;
+	int ret;
+
+	/* The estimate of a new table is exact. */
+	lpm = lpm_create_ex(&bconf);
+	assert(lpm != NULL);
+	assert(memory_check(lpm) == 0);
+	est = lpm_memory_estimate(lpm, 4, 24, 10000);
+	for (unsigned i = 0; i < 10000; i++) {
+		a = htonl(0x0a000000 | (i << 8));
+		ret = lpm_insert(lpm, &a, 4, 24, (void *)0x1);
+		assert(ret == 0);
+	}
+	assert(memory_check(lpm) == est);
+	lpm_memory_usage(lpm, usage, __arraycount(usage));
+	assert(usage[24].entries && usage[24].buckets && usage[24].filters);
+	assert(usage[24].entries % 10000 == 0);
+
+	/* Compaction, removals and the snapshots. */
+	ret = lpm_compact(lpm);
+	assert(ret == 0);
+	memory_check(lpm);
+	for (unsigned i = 0; i < 5000; i++) {
+		a = htonl(0x0a000000 | (i << 8));
+		ret = lpm_remove(lpm, &a, 4, 24);
+		assert(ret == 0);
+	}
+	total = memory_check(lpm);
+	snap = lpm_snapshot(lpm);
+	assert(snap != NULL);
+	assert(memory_check(snap) == total);
+	a = htonl(0x0b000000);
+	ret = lpm_insert(lpm, &a, 4, 24, (void *)0x1);
+	assert(ret == 0);
+	/* Copied: the entries no longer in the slab of lpm_compact(). */
+	assert(memory_check(lpm) != total);
+	assert(memory_check(snap) == total);
+	lpm_snapshot_release(snap);
+	lpm_clear(lpm, NULL, NULL);
+	assert(memory_check(lpm) == 0);
+	lpm_destroy(lpm);
+
+	/* The limit: the insertions fail gracefully. */
+	lpm = lpm_create_ex(&conf);
+	assert(lpm != NULL);
+	for (;; n++) {
+		a = htonl(0x0a000000 | (n << 8));
+		errno = 0;
+		if (lpm_insert(lpm, &a, 4, 24, (void *)0x1) == -1) {
+			assert(errno == ENOMEM);
+			break;
+		}
+	}
+	assert(n > 0 && memory_check(lpm) <= conf.memlimit);
+	for (unsigned i = 0; i < n; i++) {
+		a = htonl(0x0a000000 | (i << 8) | 1);
+		assert(lpm_lookup(lpm, &a, 4) == (void *)0x1);
+	}
+	a = htonl(0x0a000000);
+	ret = lpm_remove(lpm, &a, 4, 24);
+	assert(ret == 0);
+	a = htonl(0x0b000000);
+	ret = lpm_insert(lpm, &a, 4, 24, (void *)0x1);
+	assert(ret == 0);
+	lpm_destroy(lpm);
+
+	/* The bulk insertion: the same accounting and the limit. */
+	for (unsigned i = 0; i < __arraycount(pfx); i++) {
+		addrs[i] = htonl(random() & 0xffffff00);
+		pfx[i].addr = &addrs[i];
+		pfx[i].len = 4;
+		pfx[i].preflen = 16 + i % 9;
+		pfx[i].val = (void *)0x1;
+	}
+	lpm = lpm_create();
+	assert(lpm != NULL);
+	ret = lpm_insert_bulk(lpm, pfx, __arraycount(pfx), 4);
+	assert(ret == 0);
+	total = memory_check(lpm);
+	lpm_destroy(lpm);
+
+	conf.memlimit = total - 1;
+	lpm = lpm_create_ex(&conf);
+	assert(lpm != NULL);
+	errno = 0;
+	ret = lpm_insert_bulk(lpm, pfx, __arraycount(pfx), 4);
+	assert(ret == -1 && errno == ENOMEM);
+	assert(memory_check(lpm) <= conf.memlimit);
+	lpm_destroy(lpm);
+}
+
 int
 main(void)
 {
@@ -306,6 +2330,29 @@ main(void)
 	ipv6_basic_test();
 	removal_test();
 	default_test();
+	diff_test();
+	optimize_test();
+	lookup_all_test();
+	numa_test();
+	cache_test();
+	keylen_test();
+	vrf_test();
+	ivtab_test();
+	compact_test();
+	bulk_test();
+	rehash_test();
+	tunables_test();
+	sampling_test();
+	bloom_test();
+	flow_test();
+	lookup2_test();
+	ctab_test();
+	snapshot_test();
+	queue_test();
+	seed_test();
+	mapped_test();
+	str_test();
+	memory_test();
 	puts("ok");
 	return 0;
 }